@@ -0,0 +1,467 @@
+/*
+ * -----------------------------  bench.c  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Tree benchmark. Runs insert, find, range, delete and purge
+ * for every combination of order, key distribution and dataset
+ * size and writes the results as JSON to stdout. On Linux the
+ * hardware counters of every phase are reported per operation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "ytree.h"
+#include "bench.h"
+
+#define DATABASENAME "__bench.ydb"
+
+#define MAX_SWEEP 16
+#define RANGE_SPAN 100
+#define RANGE_DIVISOR 16
+#define PURGE_STEP_BUDGET 256
+
+/*
+ * Sweep parameters, each list is
+ * walked in full for every run.
+ */
+struct sweep {
+	int orders[MAX_SWEEP];
+	int norders;
+	int dists[MAX_SWEEP];
+	int ndists;
+	int sizes[MAX_SWEEP];
+	int nsizes;
+	uint64_t seed;
+	unsigned int radix;						// Radix table entries, zero for none
+	bool sparse;							// Spread the keys over the int range
+};
+
+/*
+ * Hardware counters read around every phase. Each
+ * counter is opened on its own so a missing one
+ * does not take the others down, counters that
+ * cannot be opened are left out of the report.
+ */
+enum counter {
+	CNT_CYCLES,
+	CNT_INSTRUCTIONS,
+	CNT_L1D_MISSES,
+	CNT_LLC_MISSES,
+	CNT_BRANCH_MISSES,
+	CNT_DTLB_MISSES,
+	CNT_MAX,
+};
+
+static const char *counter_names[] = {
+	"cycles",
+	"instructions",
+	"l1d_misses",
+	"llc_misses",
+	"branch_misses",
+	"dtlb_misses",
+};
+
+static int counter_fds[CNT_MAX] = {-1, -1, -1, -1, -1, -1};
+static uint64_t counter_values[CNT_MAX];
+
+#ifdef __linux__
+#define CACHE_READ_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} counter_events[] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+	{PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+#endif
+
+static void counters_open(void) {
+#ifdef __linux__
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < CNT_MAX; ++i) {
+		memset(&attr, 0, sizeof(struct perf_event_attr));
+		attr.size = sizeof(struct perf_event_attr);
+		attr.type = counter_events[i].type;
+		attr.config = counter_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		counter_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void counters_close(void) {
+	int i;
+
+	for (i = 0; i < CNT_MAX; ++i)
+		if (counter_fds[i] >= 0)
+			close(counter_fds[i]);
+}
+
+static void counters_start(void) {
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < CNT_MAX; ++i) {
+		if (counter_fds[i] < 0)
+			continue;
+
+		ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+/* Stop and read, values are scaled up when multiplexed */
+static void counters_stop(void) {
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < CNT_MAX; ++i) {
+		uint64_t data[3];
+
+		counter_values[i] = 0;
+		if (counter_fds[i] < 0)
+			continue;
+
+		ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter_fds[i], data, sizeof(data)) != sizeof(data) || !data[2])
+			continue;
+
+		counter_values[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+	}
+#endif
+}
+
+/* Counters per operation as members of the phase object */
+static void counters_json(FILE *fp, size_t count) {
+	bool first = true;
+	int i;
+
+	for (i = 0; i < CNT_MAX; ++i) {
+		if (counter_fds[i] < 0)
+			continue;
+
+		fprintf(fp, "%s\"%s\": %.1f", first ? ", \"counters\": {" : ", ", counter_names[i],
+			count ? (double)counter_values[i] / count : (double)counter_values[i]);
+		first = false;
+	}
+
+	if (!first)
+		fprintf(fp, "}");
+}
+
+static bool count_visit(int key, record_t *record, void *ctx) {
+	++*(size_t *)ctx;
+	return true;
+}
+
+/*
+ * Sparse keys are the dense ones multiplied by
+ * an odd constant, a bijection on 32 bits that
+ * scatters them over the whole int range.
+ */
+static int key_of(int key, bool sparse) {
+	return sparse ? (int)((uint32_t)key * 0x9E3779B1u) : key;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-o orders] [-d distributions] [-n sizes] [-s seed] [-R entries] [-x]\n"
+		"  -o <list>\tComma separated tree orders (default 4,32,100)\n"
+		"  -d <list>\tComma separated distributions: sequential,uniform,zipfian,reverse (default all),\n"
+		"\t\tzipfian inserts and deletes the hottest keys first\n"
+		"  -n <list>\tComma separated dataset sizes (default 10000,100000)\n"
+		"  -s <seed>\tRandom seed (default 1)\n"
+		"  -R <entries>\tRadix table of subtree roots (default none)\n"
+		"  -x\t\tSparse keys spread over the int range (default dense)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* Split a comma separated list of integers */
+static int parse_ints(char *arg, int *out) {
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_SWEEP; tok = strtok(NULL, ","))
+		out[n++] = atoi(tok);
+
+	return n;
+}
+
+static int parse_dists(char *arg, int *out) {
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_SWEEP; tok = strtok(NULL, ",")) {
+		int dist = bench_dist_parse(tok);
+		if (dist < 0) {
+			fprintf(stderr, "Unknown distribution: %s\n", tok);
+			exit(EXIT_FAILURE);
+		}
+		out[n++] = dist;
+	}
+
+	return n;
+}
+
+/*
+ * The counters cover the whole phase, including
+ * the latency sampling around each operation.
+ */
+static void phase_begin(struct bench_latency *l, size_t size) {
+	bench_latency_init(l, size);
+	counters_start();
+	l->start = bench_now();
+}
+
+static void phase_end(FILE *fp, const char *op, struct bench_latency *l, bool last) {
+	l->elapsed = bench_now() - l->start;
+	counters_stop();
+	fprintf(fp, "      ");
+	bench_latency_json_open(fp, op, l);
+	counters_json(fp, l->count);
+	fprintf(fp, last ? "}\n" : "},\n");
+	bench_latency_free(l);
+}
+
+/*
+ * Single run over a fresh database. Keys are inserted
+ * once each in distribution order, lookups and scans
+ * draw from the distribution, half of the keys are
+ * deleted and the remainder is purged.
+ */
+static void run(int order, enum bench_dist dist, int size, uint64_t seed, unsigned int radix, bool sparse, bool first) {
+	ytree_stats_t load_stats, stats;
+	struct bench_latency lat;
+	struct bench_keys stream;
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int *keys;
+	int i, nranges, found = 0;
+	size_t visited = 0;
+	uint64_t t;
+
+	unlink(DATABASENAME);
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_order(&db, order);
+	ytree_radix_table(&db, radix);
+
+	printf("%s  {\"order\": %d, \"distribution\": \"%s\", \"size\": %d, \"keys\": \"%s\", \"radix\": %u, \"phases\": [\n",
+		first ? "" : ",\n", order, bench_dist_names[dist], size, sparse ? "sparse" : "dense", radix);
+
+	/* Insert */
+	keys = bench_keys_load(dist, size, seed);
+	for (i = 0; i < size; ++i)
+		keys[i] = key_of(keys[i], sparse);
+	phase_begin(&lat, size);
+	for (i = 0; i < size; ++i) {
+		record_t *record = ytree_new_int(keys[i]);
+
+		t = bench_now();
+		ytree_insert(&db, keys[i], record);
+		bench_latency_add(&lat, bench_now() - t);
+
+		free(record);
+	}
+	phase_end(stdout, "insert", &lat, false);
+	ytree_stats(&db, &load_stats);
+
+	/* Find */
+	bench_keys_init(&stream, dist, size, seed + 1);
+	phase_begin(&lat, size);
+	for (i = 0; i < size; ++i) {
+		int key = key_of(bench_keys_next(&stream), sparse);
+
+		t = bench_now();
+		record_t *record = ytree_find(&db, key);
+		bench_latency_add(&lat, bench_now() - t);
+
+		if (record) {
+			++found;
+			free(record);
+		}
+	}
+	phase_end(stdout, "find", &lat, false);
+
+	/* Range */
+	nranges = size / RANGE_DIVISOR ? size / RANGE_DIVISOR : 1;
+	bench_keys_init(&stream, dist, size, seed + 2);
+	phase_begin(&lat, nranges);
+	for (i = 0; i < nranges; ++i) {
+		int key = key_of(bench_keys_next(&stream), sparse);
+		int end = key > INT_MAX - (RANGE_SPAN - 1) ? INT_MAX : key + RANGE_SPAN - 1;
+
+		t = bench_now();
+		ytree_range(&db, key, end, count_visit, &visited);
+		bench_latency_add(&lat, bench_now() - t);
+	}
+	phase_end(stdout, "range", &lat, false);
+
+	/* Delete, hottest keys first under skew */
+	if (dist != DIST_ZIPFIAN)
+		bench_shuffle(keys, size, &seed);
+	phase_begin(&lat, size / 2);
+	for (i = 0; i < size / 2; ++i) {
+		t = bench_now();
+		ytree_delete(&db, keys[i]);
+		bench_latency_add(&lat, bench_now() - t);
+	}
+	phase_end(stdout, "delete", &lat, false);
+
+	/* Purge, detached and released in steps */
+	phase_begin(&lat, 1);
+	t = bench_now();
+	ytree_purge_detach(&db);
+	bench_latency_add(&lat, bench_now() - t);
+	phase_end(stdout, "purge_detach", &lat, false);
+
+	phase_begin(&lat, 0);
+	for (;;) {
+		bool more;
+
+		t = bench_now();
+		more = ytree_purge_step(&db, PURGE_STEP_BUDGET);
+		bench_latency_add(&lat, bench_now() - t);
+
+		if (!more)
+			break;
+	}
+	phase_end(stdout, "purge_step", &lat, true);
+
+	ytree_stats(&db, &stats);
+	printf("    ], \"found\": %d, \"range_visited\": %zu, \"radix_hits\": %llu, \"radix_rebuilds\": %llu,\n    \"load_io\": ",
+		found, visited, (unsigned long long)stats.radix_hits, (unsigned long long)stats.radix_rebuilds);
+	bench_io_json(stdout, &load_stats);
+	printf(",\n    \"io\": ");
+	bench_io_json(stdout, &stats);
+	printf("}");
+
+	free(keys);
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+	unlink(DATABASENAME);
+}
+
+int main(int argc, char *argv[]) {
+	struct sweep sweep = {
+		.orders = {4, 32, 100},
+		.norders = 3,
+		.dists = {DIST_SEQUENTIAL, DIST_UNIFORM, DIST_ZIPFIAN, DIST_REVERSE},
+		.ndists = 4,
+		.sizes = {10000, 100000},
+		.nsizes = 2,
+		.seed = 1,
+	};
+	int opt, o, d, n;
+	bool first = true;
+
+	while ((opt = getopt(argc, argv, "o:d:n:s:R:xh")) != -1) {
+		switch (opt) {
+			case 'o':
+				sweep.norders = parse_ints(optarg, sweep.orders);
+				break;
+			case 'd':
+				sweep.ndists = parse_dists(optarg, sweep.dists);
+				break;
+			case 'n':
+				sweep.nsizes = parse_ints(optarg, sweep.sizes);
+				break;
+			case 's':
+				sweep.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'R':
+				sweep.radix = (unsigned int)atoi(optarg);
+				break;
+			case 'x':
+				sweep.sparse = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	for (o = 0; o < sweep.norders; ++o) {
+		if (sweep.orders[o] < 3 || sweep.orders[o] > 100) {
+			fprintf(stderr, "Invalid order: %d\n", sweep.orders[o]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (n = 0; n < sweep.nsizes; ++n) {
+		if (sweep.sizes[n] < 1) {
+			fprintf(stderr, "Invalid size: %d\n", sweep.sizes[n]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	counters_open();
+
+	printf("{\"version\": \"%s\", \"seed\": %llu, \"counters\": [",
+		ytree_version(), (unsigned long long)sweep.seed);
+	for (o = 0, n = 0; o < CNT_MAX; ++o)
+		if (counter_fds[o] >= 0)
+			printf("%s\"%s\"", n++ ? ", " : "", counter_names[o]);
+	printf("], \"runs\": [\n");
+
+	for (o = 0; o < sweep.norders; ++o)
+		for (d = 0; d < sweep.ndists; ++d)
+			for (n = 0; n < sweep.nsizes; ++n) {
+				run(sweep.orders[o], sweep.dists[d], sweep.sizes[n], sweep.seed, sweep.radix, sweep.sparse, first);
+				first = false;
+			}
+
+	printf("\n]}\n");
+
+	counters_close();
+
+	return 0;
+}
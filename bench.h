@@ -0,0 +1,383 @@
+/*
+ * -----------------------------  bench.h  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Benchmark helpers shared by the benchmark drivers:
+ * clock, random numbers, key distributions, latency
+ * percentiles and storage counters.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "ytree.h"
+
+/* ********************************
+ * CLOCK
+ * ********************************/
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ********************************
+ * RANDOM
+ * ********************************/
+
+/* xorshift64* generator */
+static inline uint64_t bench_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+/* Uniform double in [0, 1) */
+static inline double bench_rand_double(uint64_t *state) {
+	return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Fisher-Yates shuffle */
+static inline void bench_shuffle(int *keys, size_t n, uint64_t *state) {
+	size_t i;
+	for (i = n - 1; i > 0; --i) {
+		size_t j = bench_rand(state) % (i + 1);
+		int tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+/* ********************************
+ * DISTRIBUTIONS
+ * ********************************/
+
+enum bench_dist {
+	DIST_SEQUENTIAL,
+	DIST_UNIFORM,
+	DIST_ZIPFIAN,
+	DIST_REVERSE,
+	DIST_MAX,
+};
+
+static const char *bench_dist_names[] = {
+	"sequential",
+	"uniform",
+	"zipfian",
+	"reverse",
+};
+
+static inline int bench_dist_parse(const char *name) {
+	int i;
+	for (i = 0; i < DIST_MAX; ++i)
+		if (!strcmp(name, bench_dist_names[i]))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Zipfian ranks as described by Gray et al. in
+ * "Quickly generating billion-record synthetic
+ * databases", the generator used by YCSB.
+ */
+struct bench_zipf {
+	uint64_t n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+};
+
+static inline void bench_zipf_init(struct bench_zipf *z, uint64_t n, double theta) {
+	double zeta2 = 1.0 + pow(0.5, theta);
+	uint64_t i;
+
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (i = 1; i <= n; ++i)
+		z->zetan += 1.0 / pow((double)i, theta);
+
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static inline uint64_t bench_zipf_next(struct bench_zipf *z, uint64_t *state) {
+	double u = bench_rand_double(state);
+	double uz = u * z->zetan;
+
+	if (uz < 1.0)
+		return 0;
+
+	if (uz < 1.0 + pow(0.5, z->theta))
+		return 1;
+
+	uint64_t rank = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return rank < z->n ? rank : z->n - 1;
+}
+
+/*
+ * Spread zipfian ranks over the key space so
+ * the hot keys are not all adjacent.
+ */
+static inline uint64_t bench_scramble(uint64_t rank, uint64_t n) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		h ^= (rank >> (i * 8)) & 0xff;
+		h *= 0x100000001b3ull;
+	}
+
+	return h % n;
+}
+
+/*
+ * Stream of keys in [0, n) drawn
+ * from one of the distributions.
+ */
+struct bench_keys {
+	enum bench_dist dist;
+	uint64_t n;
+	uint64_t i;
+	uint64_t state;
+	struct bench_zipf zipf;
+};
+
+static inline void bench_keys_init(struct bench_keys *k, enum bench_dist dist, uint64_t n, uint64_t seed) {
+	memset(k, 0, sizeof(struct bench_keys));
+	k->dist = dist;
+	k->n = n;
+	k->state = seed ? seed : 88172645463325252ull;
+	if (dist == DIST_ZIPFIAN)
+		bench_zipf_init(&k->zipf, n, 0.99);
+}
+
+static inline int bench_keys_next(struct bench_keys *k) {
+	uint64_t i = k->i++ % k->n;
+
+	switch (k->dist) {
+		case DIST_SEQUENTIAL:
+			return (int)i;
+		case DIST_REVERSE:
+			return (int)(k->n - 1 - i);
+		case DIST_UNIFORM:
+			return (int)(bench_rand(&k->state) % k->n);
+		case DIST_ZIPFIAN:
+			return (int)bench_scramble(bench_zipf_next(&k->zipf, &k->state), k->n);
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Order shuffled keys by their first draw from
+ * a zipfian stream, so hot keys come first. Keys
+ * not drawn in n draws keep their shuffled order
+ * after those.
+ */
+static inline void bench_keys_skew(int *keys, size_t n, uint64_t seed) {
+	struct bench_keys stream;
+	uint8_t *seen = (uint8_t *)calloc(n ? n : 1, 1);
+	int *order = (int *)malloc((n ? n : 1) * sizeof(int));
+	size_t i, j = 0;
+
+	if (!seen || !order) {
+		perror("Benchmark keys");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_keys_init(&stream, DIST_ZIPFIAN, n, seed);
+	for (i = 0; i < n; ++i) {
+		int key = bench_keys_next(&stream);
+		if (!seen[key]) {
+			seen[key] = 1;
+			order[j++] = key;
+		}
+	}
+
+	for (i = 0; i < n; ++i)
+		if (!seen[keys[i]])
+			order[j++] = keys[i];
+
+	memcpy(keys, order, n * sizeof(int));
+	free(order);
+	free(seen);
+}
+
+/*
+ * Distinct keys 0 to n - 1 in the order the
+ * distribution visits them. Uniform keys have no
+ * natural order and are shuffled, zipfian keys
+ * come hottest first.
+ */
+static inline int *bench_keys_load(enum bench_dist dist, size_t n, uint64_t seed) {
+	int *keys = (int *)malloc((n ? n : 1) * sizeof(int));
+	size_t i;
+
+	if (!keys) {
+		perror("Benchmark keys");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; ++i)
+		keys[i] = dist == DIST_REVERSE ? (int)(n - 1 - i) : (int)i;
+
+	if (dist == DIST_UNIFORM || dist == DIST_ZIPFIAN)
+		bench_shuffle(keys, n, &seed);
+	if (dist == DIST_ZIPFIAN)
+		bench_keys_skew(keys, n, seed);
+
+	return keys;
+}
+
+/* ********************************
+ * LATENCY
+ * ********************************/
+
+/*
+ * Latency samples of a single phase.
+ */
+struct bench_latency {
+	uint64_t *samples;
+	size_t count;
+	size_t size;
+	uint64_t start;
+	uint64_t elapsed;
+};
+
+static inline void bench_latency_init(struct bench_latency *l, size_t size) {
+	memset(l, 0, sizeof(struct bench_latency));
+	l->samples = (uint64_t *)malloc((size ? size : 1) * sizeof(uint64_t));
+	if (!l->samples) {
+		perror("Latency samples");
+		exit(EXIT_FAILURE);
+	}
+	l->size = size;
+}
+
+static inline void bench_latency_free(struct bench_latency *l) {
+	free(l->samples);
+	l->samples = NULL;
+}
+
+static inline void bench_latency_add(struct bench_latency *l, uint64_t ns) {
+	if (l->count == l->size) {
+		size_t size = l->size ? l->size * 2 : 1024;
+		uint64_t *samples = (uint64_t *)realloc(l->samples, size * sizeof(uint64_t));
+		if (!samples) {
+			perror("Latency samples");
+			exit(EXIT_FAILURE);
+		}
+		l->samples = samples;
+		l->size = size;
+	}
+
+	l->samples[l->count++] = ns;
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Sort the samples, needed before asking for percentiles */
+static inline void bench_latency_sort(struct bench_latency *l) {
+	qsort(l->samples, l->count, sizeof(uint64_t), bench_compare_u64);
+}
+
+/* Percentile p in [0, 100] of the sorted samples */
+static inline uint64_t bench_percentile(struct bench_latency *l, double p) {
+	if (!l->count)
+		return 0;
+
+	size_t rank = (size_t)ceil(p / 100.0 * l->count);
+	return l->samples[rank ? rank - 1 : 0];
+}
+
+/*
+ * Print the phase as a JSON object left open for
+ * more members. The samples are sorted as a side
+ * effect.
+ */
+static inline void bench_latency_json_open(FILE *fp, const char *op, struct bench_latency *l) {
+	double seconds = l->elapsed / 1e9;
+
+	bench_latency_sort(l);
+	fprintf(fp, "{\"op\": \"%s\", \"count\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+			"\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu",
+			op, l->count, seconds, seconds > 0 ? l->count / seconds : 0.0,
+			(unsigned long long)bench_percentile(l, 50.0),
+			(unsigned long long)bench_percentile(l, 99.0),
+			(unsigned long long)bench_percentile(l, 99.9));
+}
+
+/* Print the phase as a JSON object */
+static inline void bench_latency_json(FILE *fp, const char *op, struct bench_latency *l) {
+	bench_latency_json_open(fp, op, l);
+	fprintf(fp, "}");
+}
+
+/* ********************************
+ * STORAGE
+ * ********************************/
+
+/* Print the storage counters of the stats as a JSON object */
+static inline void bench_io_json(FILE *fp, ytree_stats_t *stats) {
+	fprintf(fp, "{\"reads\": %llu, \"writes\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+			"\"seeks\": %llu, \"fsyncs\": %llu, \"pages_read\": %llu, \"pages_written\": %llu, "
+			"\"bytes_logical\": %llu, \"write_amplification\": %.2f}",
+			(unsigned long long)stats->io.reads,
+			(unsigned long long)stats->io.writes,
+			(unsigned long long)stats->io.bytes_read,
+			(unsigned long long)stats->io.bytes_written,
+			(unsigned long long)stats->io.seeks,
+			(unsigned long long)stats->io.fsyncs,
+			(unsigned long long)stats->io.pages_read,
+			(unsigned long long)stats->io.pages_written,
+			(unsigned long long)stats->bytes_logical,
+			stats->write_amplification);
+}
+
+#endif // _BENCH_H_
@@ -28,173 +28,337 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  *
- * Test hash vs full scan benchmark.
+ * Test hash vs ordered keys benchmark. Words are stored under
+ * either their djb2 hash or an order preserving prefix key, with
+ * colliding words kept in the posting list of the key. Both are
+ * measured on point lookups and prefix scans, in memory and on
+ * disk, over a generated word corpus.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "ytree.h"
+#include "bench.h"
 
-#define WORDFILE "words.txt"
+#define DATABASENAME "__hashtest.ydb"
 
-static const int counter = 4096 * 55;
+#define WORD_MIN 4
+#define WORD_MAX 12
+#define PREFIX_LENGTH 2
 
-unsigned long hash(unsigned char *str) {
-    unsigned long hash = 5381;
-    int c;
+enum key_mode {
+	MODE_HASH,
+	MODE_PREFIX,
+};
 
-    while (c = *str++)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+static const char *mode_names[] = {
+	"hash",
+	"prefix",
+};
 
-    return hash;
-}
+/*
+ * Generated word list, all words
+ * are stored back to back.
+ */
+struct corpus {
+	char **words;
+	size_t *lengths;
+	size_t count;
+	char *text;
+};
 
-struct kv {
-	unsigned long key;
-	char *value;
+struct lookup {
+	const char *word;
+	size_t length;
+	bool found;
 };
 
-int memtest() {
-	FILE *fp = fopen(WORDFILE, "r");
-	if (!fp)
-		return 1;
+struct scan {
+	const char *prefix;
+	size_t matches;
+};
 
-	struct kv **arr = calloc(sizeof(struct kv *), counter);
+unsigned long hash(const unsigned char *str, size_t length) {
+	unsigned long hash = 5381;
+	size_t i;
 
-	char search[32];
+	for (i = 0; i < length; ++i)
+		hash = ((hash << 5) + hash) + str[i]; /* hash * 33 + c */
 
-	int i;
-	for (i=0; i<counter; ++i) {
-		char *line = NULL;
-		size_t len = 0;
-		ssize_t read = getline(&line, &len, fp);
+	return hash;
+}
 
-#ifdef HASH
-		int idx = hash(line) % counter;
-#else
-		int idx = i;
-#endif
+/*
+ * First four bytes of the word as big endian
+ * integer with the sign bit flipped, so the
+ * key order is the order of the words.
+ */
+static int prefix_key(const char *word, size_t length) {
+	uint32_t key = 0;
+	size_t i;
 
-		arr[idx] = (struct kv *)malloc(sizeof(struct kv));
-		arr[idx]->key = (unsigned long)i;
-		arr[idx]->value = malloc(32);
-		strncpy(arr[idx]->value, line, 32);
+	for (i = 0; i < 4; ++i)
+		key = (key << 8) | (i < length ? (uint8_t)word[i] : 0);
 
-		if (i == counter - 1) {
-			strncpy(search, line, 32);
-			search[31] = '\0';
-		}
-	}
+	return (int)(key ^ 0x80000000u);
+}
 
-	printf("Looking for %s\n", search);
+static int word_key(enum key_mode mode, const char *word, size_t length) {
+	if (mode == MODE_HASH)
+		return (int)(uint32_t)hash((const unsigned char *)word, length);
 
-	int j;
-	for (j=0; j<25; ++j) {
+	return prefix_key(word, length);
+}
 
-#ifdef HASH
-		int idx = hash(search) % counter;
-		printf("%u ==> %s", arr[idx]->key, arr[idx]->value);
-#else
-		for (i=0; i<counter; ++i) {
-			if (!strcmp(arr[i]->value, search))
-				printf("%u => %s", arr[i]->key, arr[i]->value);
-		}
-#endif
+/* Random lowercase words, suffix is appended to each */
+static void corpus_generate(struct corpus *corpus, size_t count, const char *suffix, uint64_t seed) {
+	size_t i, pos = 0, extra = strlen(suffix);
+
+	corpus->count = count;
+	corpus->words = (char **)malloc(count * sizeof(char *));
+	corpus->lengths = (size_t *)malloc(count * sizeof(size_t));
+	corpus->text = (char *)malloc(count * (WORD_MAX + extra));
+	if (!corpus->words || !corpus->lengths || !corpus->text) {
+		perror("Word corpus");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; ++i) {
+		size_t j, length = WORD_MIN + bench_rand(&seed) % (WORD_MAX - WORD_MIN + 1);
 
+		corpus->words[i] = corpus->text + pos;
+		for (j = 0; j < length; ++j)
+			corpus->text[pos++] = 'a' + bench_rand(&seed) % 26;
+		memcpy(corpus->text + pos, suffix, extra);
+		pos += extra;
+		corpus->lengths[i] = length + extra;
 	}
+}
+
+static void corpus_free(struct corpus *corpus) {
+	free(corpus->words);
+	free(corpus->lengths);
+	free(corpus->text);
+}
 
-	free(arr);
+static bool lookup_visit(int key, record_t *record, void *ctx) {
+	struct lookup *lookup = (struct lookup *)ctx;
 
-	fclose(fp);
+	if (record->value_size == lookup->length && !memcmp(record->value._data, lookup->word, lookup->length)) {
+		lookup->found = true;
+		return false;
+	}
+
+	return true;
 }
 
-#define PAGE_SIZE	1024
+static bool scan_visit(int key, record_t *record, void *ctx) {
+	struct scan *scan = (struct scan *)ctx;
 
-int disktest() {
-	FILE *fp = fopen(WORDFILE, "r");
-	if (!fp)
-		return 1;
+	if (record->value_size >= PREFIX_LENGTH && !memcmp(record->value._data, scan->prefix, PREFIX_LENGTH))
+		scan->matches++;
 
-	FILE *fpo = fopen("outbin", "w+b");
-	if (!fpo)
-		return 1;
+	return true;
+}
 
-	char search[32];
+static bool find_word(db_t **db, enum key_mode mode, const char *word, size_t length) {
+	struct lookup lookup = {word, length, false};
 
-	int i;
-	for (i=0; i<counter; ++i) {
-		char *line = NULL;
-		size_t len = 0;
-		ssize_t read = getline(&line, &len, fp);
+	ytree_find_all(db, word_key(mode, word, length), lookup_visit, &lookup);
+	return lookup.found;
+}
 
-#ifdef HASH
-		int offset = hash(line) % counter;
-#else
-		int offset = i;
-#endif
+/*
+ * Words sharing a prefix are adjacent under the
+ * prefix keys. Hashed keys have no order and
+ * need a scan over the full key space.
+ */
+static size_t scan_prefix(db_t **db, enum key_mode mode, const char *prefix) {
+	struct scan scan = {prefix, 0};
+	char low[4] = {0, 0, 0, 0};
+	char high[4] = {'\xff', '\xff', '\xff', '\xff'};
+
+	if (mode == MODE_HASH) {
+		ytree_range(db, INT_MIN, INT_MAX, scan_visit, &scan);
+		return scan.matches;
+	}
 
-		fseek(fpo, i * (sizeof(struct kv) + (sizeof(char) * 32)), SEEK_SET);
+	memcpy(low, prefix, PREFIX_LENGTH);
+	memcpy(high, prefix, PREFIX_LENGTH);
+	ytree_range(db, prefix_key(low, 4), prefix_key(high, 4), scan_visit, &scan);
 
-		struct kv page;
-		page.key = (unsigned long)i;
-		page.value = malloc(32);
-		strncpy(page.value, line, 32);
+	return scan.matches;
+}
 
-		if (i == counter - 1) {
-			strncpy(search, line, 32);
-			search[31] = '\0';
-		}
+struct bucket_stats {
+	int last_key;
+	size_t keys;
+	size_t length;
+	size_t longest;
+};
 
-		fwrite(&page, sizeof(struct kv), 1, fpo);
-		fwrite(page.value, sizeof(char), 32, fpo);
+static bool bucket_visit(int key, record_t *record, void *ctx) {
+	struct bucket_stats *stats = (struct bucket_stats *)ctx;
 
-		free(page.value);
+	if (!stats->keys || key != stats->last_key) {
+		stats->keys++;
+		stats->length = 0;
+		stats->last_key = key;
 	}
 
-	printf("Looking for %s\n", search);
+	if (++stats->length > stats->longest)
+		stats->longest = stats->length;
 
-	fflush(fpo);
+	return true;
+}
 
-	int j;
-	for (j=0; j<45; ++j) {
-#ifdef HASH
-		int offset = hash(search) % counter;
+static void run(const char *dbname, enum key_mode mode, struct corpus *words, struct corpus *misses, int scans, uint64_t seed, bool first) {
+	struct bucket_stats stats;
+	struct bench_latency lat;
+	env_t *env = NULL;
+	db_t *db = NULL;
+	size_t i, found = 0, matched = 0;
+	uint64_t t;
 
-		char buffer[32];
-		struct kv page;
+	if (dbname)
+		unlink(dbname);
 
-		fseek(fpo, offset * (sizeof(struct kv) + (sizeof(char) * 32)), SEEK_SET);
-		fread(&page, sizeof(struct kv), 1, fpo);
-		fread(buffer, sizeof(char), 32, fpo);
+	ytree_env_init(dbname, &env, DB_FLAG_DUPLICATE);
+	ytree_db_init(0, &db, &env);
+	ytree_order(&db, 32);
 
-		printf("%u ==> %s", page.key, buffer);
-#else
-		fseek(fpo, 0, SEEK_SET);
+	printf("%s  {\"env\": \"%s\", \"mode\": \"%s\", \"phases\": [\n",
+		first ? "" : ",\n", dbname ? "disk" : "memory", mode_names[mode]);
 
-		for (i=0; i<counter; ++i) {
-			char buffer[32];
-			struct kv page;
+	/* Build */
+	bench_latency_init(&lat, words->count);
+	lat.start = bench_now();
+	for (i = 0; i < words->count; ++i) {
+		record_t *record = ytree_new_data(words->words[i], words->lengths[i]);
 
-			fread(&page, sizeof(struct kv), 1, fpo);
-			fread(buffer, sizeof(char), 32, fpo);
+		t = bench_now();
+		ytree_insert(&db, word_key(mode, words->words[i], words->lengths[i]), record);
+		bench_latency_add(&lat, bench_now() - t);
 
-			buffer[31] = '\0';
+		free(record);
+	}
+	lat.elapsed = bench_now() - lat.start;
+	printf("    ");
+	bench_latency_json(stdout, "insert", &lat);
+	printf(",\n");
+	bench_latency_free(&lat);
+
+	/* Lookups of stored words in random order */
+	bench_latency_init(&lat, words->count);
+	lat.start = bench_now();
+	for (i = 0; i < words->count; ++i) {
+		size_t w = bench_rand(&seed) % words->count;
+
+		t = bench_now();
+		found += find_word(&db, mode, words->words[w], words->lengths[w]);
+		bench_latency_add(&lat, bench_now() - t);
+	}
+	lat.elapsed = bench_now() - lat.start;
+	printf("    ");
+	bench_latency_json(stdout, "find_hit", &lat);
+	printf(",\n");
+	bench_latency_free(&lat);
+
+	/* Lookups of words that do not exist */
+	bench_latency_init(&lat, misses->count);
+	lat.start = bench_now();
+	for (i = 0; i < misses->count; ++i) {
+		t = bench_now();
+		find_word(&db, mode, misses->words[i], misses->lengths[i]);
+		bench_latency_add(&lat, bench_now() - t);
+	}
+	lat.elapsed = bench_now() - lat.start;
+	printf("    ");
+	bench_latency_json(stdout, "find_miss", &lat);
+	printf(",\n");
+	bench_latency_free(&lat);
+
+	/* Prefix scans */
+	bench_latency_init(&lat, scans);
+	lat.start = bench_now();
+	for (i = 0; i < (size_t)scans; ++i) {
+		const char *word = words->words[bench_rand(&seed) % words->count];
+
+		t = bench_now();
+		matched += scan_prefix(&db, mode, word);
+		bench_latency_add(&lat, bench_now() - t);
+	}
+	lat.elapsed = bench_now() - lat.start;
+	printf("    ");
+	bench_latency_json(stdout, "prefix_scan", &lat);
+	printf("\n");
+	bench_latency_free(&lat);
+
+	/* Posting list length per key */
+	memset(&stats, 0, sizeof(struct bucket_stats));
+	ytree_range(&db, INT_MIN, INT_MAX, bucket_visit, &stats);
+
+	printf("  ], \"found\": %zu, \"prefix_matches\": %zu, \"keys\": %zu, \"longest_bucket\": %zu}",
+		found, matched, stats.keys, stats.longest);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+	if (dbname)
+		unlink(dbname);
+}
 
-			if (!strcmp(buffer, search))
-				printf("%u => %s", page.key, buffer);
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-n words] [-q scans] [-s seed]\n"
+		"  -n <count>\tWords in the corpus (default 100000)\n"
+		"  -q <count>\tPrefix scans (default 50)\n"
+		"  -s <seed>\tRandom seed (default 1)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	struct corpus words, misses;
+	int opt, count = 100000, scans = 50;
+	uint64_t seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:q:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'q':
+				scans = atoi(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
 		}
-#endif
 	}
 
-	fclose(fpo);
+	if (count < 1 || scans < 0)
+		usage(argv[0]);
 
-	fclose(fp);
-}
+	/* Misses carry a digit, which generated words never have */
+	corpus_generate(&words, count, "", seed);
+	corpus_generate(&misses, count, "0", seed + 1);
+
+	printf("{\"words\": %d, \"runs\": [\n", count);
+
+	run(NULL, MODE_HASH, &words, &misses, scans, seed, true);
+	run(NULL, MODE_PREFIX, &words, &misses, scans, seed, false);
+	run(DATABASENAME, MODE_HASH, &words, &misses, scans, seed, false);
+	run(DATABASENAME, MODE_PREFIX, &words, &misses, scans, seed, false);
 
-int main(int argc, char *agrv[]) {
+	printf("\n]}\n");
 
-	// memtest();
-	disktest();
+	corpus_free(&words);
+	corpus_free(&misses);
 
 	return 0;
 }
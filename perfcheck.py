@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+#
+# -----------------------------  perfcheck.py  ------------------------------
+#
+# Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#   * Redistributions of source code must retain the above copyright notice,
+#     this list of conditions and the following disclaimer.
+#   * Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#   * Neither the name of Redis nor the names of its contributors may be used
+#     to endorse or promote products derived from this software without
+#     specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+# Performance regression check. Runs the benchmark suite listed in
+# the baseline a number of times pinned to one CPU, takes the median
+# of every metric and compares it against the stored baseline. Exits
+# non zero when a metric moved past its tolerance in the wrong way.
+#
+# Usage: perfcheck.py [-b baseline] [-r runs] [-c cpu] [--update]
+#
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+
+BASELINE = "perf_baseline.json"
+
+# Phases with fewer operations are too noisy to compare
+MIN_COUNT = 1000
+
+# Metrics taken from every phase, and whether higher is better
+METRICS = {
+    "ops_per_sec": True,
+    "p50_ns": False,
+    "p99_ns": False,
+}
+
+
+def phase_metrics(prefix, phase, out):
+    if phase["count"] < MIN_COUNT:
+        return
+    for metric in METRICS:
+        out["%s/%s/%s" % (prefix, phase["op"], metric)] = phase[metric]
+
+
+def flatten(name, result):
+    """Metrics of a single benchmark run keyed by a stable name."""
+    out = {}
+
+    # ytree_bench, one entry per order, distribution and size
+    for run in result.get("runs", []):
+        prefix = "%s/%d/%s/%d" % (name, run["order"], run["distribution"], run["size"])
+        for phase in run["phases"]:
+            phase_metrics(prefix, phase, out)
+
+    # ytree_ycsb, load followed by the operation mix
+    if "workload" in result:
+        prefix = "%s/%s/%s" % (name, result["workload"], result["distribution"])
+        phase_metrics(prefix, result["load"], out)
+        for phase in result["run"]:
+            phase_metrics(prefix, phase, out)
+        out["%s/total/ops_per_sec" % prefix] = result["ops_per_sec"]
+
+    return out
+
+
+def pin(cpu):
+    """Keep the benchmark and all its threads on one CPU."""
+    def apply():
+        os.sched_setaffinity(0, {cpu})
+    return apply
+
+
+def run_suite(suite, runs, cpu):
+    samples = {}
+
+    for i in range(runs):
+        for bench in suite:
+            proc = subprocess.run(bench["argv"], stdout=subprocess.PIPE, check=True,
+                                  preexec_fn=pin(cpu), universal_newlines=True)
+            for key, value in flatten(bench["name"], json.loads(proc.stdout)).items():
+                samples.setdefault(key, []).append(value)
+        print("run %d/%d done" % (i + 1, runs), file=sys.stderr)
+
+    return {key: statistics.median(values) for key, values in samples.items()}
+
+
+def compare(baseline, current):
+    """Rows of metric, baseline, current, change and verdict."""
+    rows = []
+    failed = False
+
+    for key in sorted(set(baseline["metrics"]) | set(current)):
+        entry = baseline["metrics"].get(key)
+        if entry is None:
+            rows.append((key, None, current[key], None, "new"))
+            continue
+        if key not in current:
+            rows.append((key, entry["value"], None, None, "missing"))
+            failed = True
+            continue
+
+        metric = key.rsplit("/", 1)[1]
+        tolerance = entry.get("tolerance", baseline["tolerance"][metric])
+        change = (current[key] - entry["value"]) / entry["value"] if entry["value"] else 0.0
+        worse = -change if METRICS[metric] else change
+
+        verdict = "ok"
+        if worse > tolerance:
+            verdict = "REGRESSION"
+            failed = True
+        elif -worse > tolerance:
+            verdict = "improved"
+        rows.append((key, entry["value"], current[key], change, verdict))
+
+    return rows, failed
+
+
+def report(rows, verbose):
+    width = max(len(row[0]) for row in rows) if rows else 0
+
+    for key, old, new, change, verdict in rows:
+        if verdict == "ok" and not verbose:
+            continue
+        print("%-*s %14s %14s %8s  %s" % (
+            width, key,
+            "-" if old is None else "%.1f" % old,
+            "-" if new is None else "%.1f" % new,
+            "-" if change is None else "%+.1f%%" % (change * 100),
+            verdict))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare the benchmark suite against a stored baseline.")
+    parser.add_argument("-b", "--baseline", default=BASELINE, help="Baseline file (default %s)" % BASELINE)
+    parser.add_argument("-r", "--runs", type=int, help="Runs to take the median of (default from baseline)")
+    parser.add_argument("-c", "--cpu", type=int, help="CPU to pin to (default the last available)")
+    parser.add_argument("-v", "--verbose", action="store_true", help="Show metrics within tolerance")
+    parser.add_argument("--update", action="store_true", help="Store the results as the new baseline")
+    args = parser.parse_args()
+
+    with open(args.baseline) as fp:
+        baseline = json.load(fp)
+
+    runs = args.runs or baseline["runs"]
+    cpu = args.cpu if args.cpu is not None else max(os.sched_getaffinity(0))
+
+    current = run_suite(baseline["suite"], runs, cpu)
+
+    if args.update:
+        metrics = {}
+        for key, value in sorted(current.items()):
+            metrics[key] = {"value": round(value, 1)}
+            if "tolerance" in baseline["metrics"].get(key, {}):
+                metrics[key]["tolerance"] = baseline["metrics"][key]["tolerance"]
+        baseline["metrics"] = metrics
+        with open(args.baseline, "w") as fp:
+            json.dump(baseline, fp, indent=2)
+            fp.write("\n")
+        print("Baseline updated with %d metrics" % len(metrics))
+        return 0
+
+    rows, failed = compare(baseline, current)
+    report(rows, args.verbose)
+
+    print("%d metrics, %d regressions" % (len(rows), sum(row[4] in ("REGRESSION", "missing") for row in rows)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
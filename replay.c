@@ -0,0 +1,410 @@
+/*
+ * -----------------------------  replay.c  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Capture replay. Reads a file written by ytree_capture_start
+ * and executes the operations in timestamp order against a fresh
+ * environment, as fast as possible or at the captured pace, and
+ * writes throughput and latency per operation as JSON to stdout.
+ * Each database is recreated from its setup event before its
+ * first operation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "ytree.h"
+#include "bench.h"
+
+#define DATABASENAME "__replay.ydb"
+
+#define MAX_SCHEMA 65536
+
+/* Sleep instead of spinning when this far ahead */
+#define PACE_SLEEP_NS 200000
+
+static const char *op_names[] = {
+	"insert",
+	"find",
+	"delete",
+	"range",
+	"incr",
+	"cas",
+	"update",
+	"find_all",
+	"delete_value",
+	"batch_insert",
+	"batch_delete",
+	"batch_commit",
+	"index_range",
+	"setup",
+};
+
+/*
+ * Captured event with its position in the
+ * file, to keep the order of equal timestamps.
+ */
+struct entry {
+	capture_event_t event;
+	size_t seq;
+};
+
+struct range_ctx {
+	int remaining;
+};
+
+static bool range_visit(int key, record_t *record, void *ctx) {
+	struct range_ctx *range = (struct range_ctx *)ctx;
+	return --range->remaining > 0;
+}
+
+static bool all_visit(int key, record_t *record, void *ctx) {
+	return true;
+}
+
+/* Store the record unchanged */
+static bool update_keep(record_t *record, void *ctx) {
+	return true;
+}
+
+static int entry_compare(const void *a, const void *b) {
+	const struct entry *x = (const struct entry *)a;
+	const struct entry *y = (const struct entry *)b;
+
+	if (x->event.timestamp != y->event.timestamp)
+		return x->event.timestamp < y->event.timestamp ? -1 : 1;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Read all events of the capture, sorted on timestamp */
+static struct entry *load_capture(const char *path, size_t *count) {
+	capture_header_t header;
+	struct entry *entries = NULL;
+	capture_event_t event;
+	size_t size = 0, n = 0;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(&header, sizeof(capture_header_t), 1, fp) != 1
+		|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic))
+		|| header.version != CAPTURE_VERSION
+		|| header.event_size != sizeof(capture_event_t)) {
+		fprintf(stderr, "%s: not a capture of this version\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fread(&event, sizeof(capture_event_t), 1, fp) == 1) {
+		if (n == size) {
+			size = size ? size * 2 : 4096;
+			entries = (struct entry *)realloc(entries, size * sizeof(struct entry));
+			if (!entries) {
+				perror("Capture events");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		entries[n].event = event;
+		entries[n].seq = n;
+		n++;
+	}
+
+	fclose(fp);
+
+	qsort(entries, n, sizeof(struct entry), entry_compare);
+	*count = n;
+	return entries;
+}
+
+/* Record of the captured type and size */
+static record_t *make_value(capture_event_t *event, char *buffer) {
+	switch (event->value_type) {
+		case DT_CHAR:
+			return ytree_new_char((char)event->key);
+		case DT_INT:
+			return ytree_new_int(event->key);
+		case DT_FLOAT:
+			return ytree_new_float((float)event->key);
+		default:
+			break;
+	}
+
+	return ytree_new_data(buffer, event->arg);
+}
+
+/*
+ * Create the database with the captured flags,
+ * order and front cache, and declare its index.
+ * Indexes take integer and character values as
+ * is, extractors are not captured.
+ */
+static void setup(db_t **db, env_t **env, capture_event_t *event) {
+	if (!*db) {
+		ytree_db_init(event->schema_id, db, env);
+		(*db)->flags = (char)event->value_type;
+		ytree_order(db, event->order);
+		if (event->arg > 0)
+			ytree_front_cache(db, event->arg);
+	}
+
+	if (event->key >= 0 && !(*db)->index)
+		ytree_index_init(event->key, db, NULL);
+}
+
+/*
+ * Run one event. Batch operations are buffered
+ * in the batch of the database until the commit.
+ */
+static void execute(db_t **db, ytree_batch_t **batch, capture_event_t *event, char *buffer) {
+	struct range_ctx range;
+	record_t *record, *current;
+	float delta;
+
+	switch (event->op) {
+		case CAPTURE_INSERT:
+			record = make_value(event, buffer);
+			ytree_insert(db, event->key, record);
+			free(record);
+			break;
+		case CAPTURE_FIND:
+			free(ytree_find(db, event->key));
+			break;
+		case CAPTURE_DELETE:
+			ytree_delete(db, event->key);
+			break;
+		case CAPTURE_RANGE:
+			range.remaining = event->arg;
+			if (range.remaining > 0)
+				ytree_range(db, event->key, INT_MAX, range_visit, &range);
+			break;
+		case CAPTURE_INCR:
+			memcpy(&delta, &event->arg, sizeof(float));
+			ytree_incr(db, event->key, delta);
+			break;
+		case CAPTURE_CAS:
+			/* The expected value is not captured, swap what is there */
+			current = ytree_find(db, event->key);
+			if (current) {
+				record = make_value(event, buffer);
+				ytree_cas(db, event->key, current, record);
+				free(record);
+				free(current);
+			}
+			break;
+		case CAPTURE_UPDATE:
+			ytree_update(db, event->key, update_keep, NULL);
+			break;
+		case CAPTURE_FIND_ALL:
+			ytree_find_all(db, event->key, all_visit, NULL);
+			break;
+		case CAPTURE_DELETE_VALUE:
+			record = make_value(event, buffer);
+			ytree_delete_value(db, event->key, record);
+			free(record);
+			break;
+		case CAPTURE_BATCH_INSERT:
+			if (!*batch)
+				ytree_batch_init(batch, &(*db)->env);
+			record = make_value(event, buffer);
+			ytree_batch_insert(batch, event->key, record);
+			free(record);
+			break;
+		case CAPTURE_BATCH_DELETE:
+			if (!*batch)
+				ytree_batch_init(batch, &(*db)->env);
+			ytree_batch_delete(batch, event->key);
+			break;
+		case CAPTURE_BATCH_COMMIT:
+			if (!*batch)
+				ytree_batch_init(batch, &(*db)->env);
+			ytree_batch_commit(db, batch);
+			break;
+		case CAPTURE_INDEX_RANGE:
+			range.remaining = event->arg;
+			if (range.remaining > 0)
+				ytree_index_range(db, event->key, INT_MAX, range_visit, &range);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Wait until the event is due */
+static void pace(uint64_t start, uint64_t timestamp) {
+	for (;;) {
+		uint64_t now = bench_now() - start;
+		if (now >= timestamp)
+			return;
+
+		if (timestamp - now > PACE_SLEEP_NS) {
+			struct timespec ts = {0, (long)(timestamp - now - PACE_SLEEP_NS / 2)};
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-t] [-m] capture\n"
+		"  -t\tReplay at the captured pace (default as fast as possible)\n"
+		"  -m\tReplay against a memory environment (default a file)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_latency latency[CAPTURE_MAX];
+	db_t **dbs;
+	ytree_batch_t **batches;
+	struct entry *entries;
+	env_t *env = NULL;
+	char *buffer = NULL;
+	size_t i, count, buffer_size = 0;
+	uint64_t start, elapsed, lag = 0;
+	int opt, op, threads = 0;
+	bool timed = false, memory = false, first = true;
+
+	while ((opt = getopt(argc, argv, "tmh")) != -1) {
+		switch (opt) {
+			case 't':
+				timed = true;
+				break;
+			case 'm':
+				memory = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	entries = load_capture(argv[optind], &count);
+
+	/* Value bytes are not captured, any content of the size will do */
+	for (i = 0; i < count; ++i) {
+		if (entries[i].event.thread >= threads)
+			threads = entries[i].event.thread + 1;
+		if (entries[i].event.value_type == DT_DATA && (size_t)entries[i].event.arg > buffer_size)
+			buffer_size = entries[i].event.arg;
+	}
+
+	buffer = (char *)malloc(buffer_size ? buffer_size : 1);
+	if (!buffer) {
+		perror("Value buffer");
+		exit(EXIT_FAILURE);
+	}
+	memset(buffer, 'x', buffer_size);
+
+	if (!memory)
+		unlink(DATABASENAME);
+	ytree_env_init(memory ? NULL : DATABASENAME, &env, 0);
+	dbs = (db_t **)calloc(MAX_SCHEMA, sizeof(db_t *));
+	batches = (ytree_batch_t **)calloc(MAX_SCHEMA, sizeof(ytree_batch_t *));
+	if (!dbs || !batches) {
+		perror("Databases");
+		exit(EXIT_FAILURE);
+	}
+
+	for (op = 0; op < CAPTURE_MAX; ++op)
+		bench_latency_init(&latency[op], 0);
+
+	start = bench_now();
+	for (i = 0; i < count; ++i) {
+		capture_event_t *event = &entries[i].event;
+		db_t **db = &dbs[event->schema_id];
+		uint64_t t;
+
+		if (event->op >= CAPTURE_MAX)
+			continue;
+
+		if (event->op == CAPTURE_SETUP) {
+			setup(db, &env, event);
+			continue;
+		}
+
+		if (!*db) {
+			ytree_db_init(event->schema_id, db, &env);
+			ytree_order(db, event->order);
+		}
+
+		if (timed) {
+			pace(start, event->timestamp);
+			if (bench_now() - start - event->timestamp > lag)
+				lag = bench_now() - start - event->timestamp;
+		}
+
+		t = bench_now();
+		execute(db, &batches[event->schema_id], event, buffer);
+		bench_latency_add(&latency[event->op], bench_now() - t);
+	}
+	elapsed = bench_now() - start;
+
+	printf("{\"capture\": \"%s\", \"events\": %zu, \"threads\": %d, \"mode\": \"%s\", \"env\": \"%s\", "
+		"\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"captured_seconds\": %.6f, \"max_lag_ns\": %llu, \"ops\": [\n",
+		argv[optind], count, threads, timed ? "timed" : "fast", memory ? "memory" : "disk",
+		elapsed / 1e9, elapsed ? count / (elapsed / 1e9) : 0.0,
+		count ? entries[count - 1].event.timestamp / 1e9 : 0.0, (unsigned long long)lag);
+
+	for (op = 0; op < CAPTURE_MAX; ++op) {
+		if (latency[op].count) {
+			latency[op].elapsed = elapsed;
+			printf("%s  ", first ? "" : ",\n");
+			bench_latency_json(stdout, op_names[op], &latency[op]);
+			first = false;
+		}
+		bench_latency_free(&latency[op]);
+	}
+	printf("\n]}\n");
+
+	for (i = 0; i < MAX_SCHEMA; ++i) {
+		if (batches[i])
+			ytree_batch_close(&batches[i]);
+		if (dbs[i])
+			ytree_db_close(&dbs[i]);
+	}
+	ytree_env_close(&env);
+	if (!memory)
+		unlink(DATABASENAME);
+
+	free(dbs);
+	free(batches);
+	free(entries);
+	free(buffer);
+
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * -----------------------------  scalebench.c  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Thread scaling benchmark. Runs read only, write only and mixed
+ * workloads from one thread up to all cores, against one tree
+ * behind a global mutex and against trees sharded on the key with
+ * a mutex and environment per shard. Throughput and lock contention
+ * per thread count are written as CSV to stdout.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ytree.h"
+#include "bench.h"
+
+#define MAX_THREADS 256
+#define MAX_SHARDS 256
+
+enum mode {
+	MODE_GLOBAL,
+	MODE_SHARDED,
+	MODE_MAX,
+};
+
+static const char *mode_names[] = {
+	"global",
+	"sharded",
+};
+
+enum workload {
+	WL_READ,
+	WL_WRITE,
+	WL_MIXED,
+	WL_MAX,
+};
+
+static const char *workload_names[] = {
+	"read",
+	"write",
+	"mixed",
+};
+
+/*
+ * Tree partition with its own lock. The global
+ * mode uses a single shard for all keys.
+ */
+struct shard {
+	pthread_mutex_t lock;
+	env_t *env;
+	db_t *db;
+	uint64_t acquired;
+	uint64_t contended;		// Acquisitions that had to wait
+	uint64_t wait_ns;		// Time spent waiting for the lock
+	char pad[64];
+};
+
+struct config {
+	int records;			// Records loaded before each run
+	int operations;			// Operations per thread
+	int max_threads;
+	int shards;
+	int order;
+	uint64_t seed;
+};
+
+struct run {
+	struct config *config;
+	struct shard *shards;
+	int nshards;
+	enum workload workload;
+	int threads;
+};
+
+struct worker {
+	pthread_t thread;
+	struct run *run;
+	int id;
+	uint64_t state;
+};
+
+/*
+ * Take the lock of the shard, counting the
+ * acquisitions that found it taken.
+ */
+static void shard_lock(struct shard *shard) {
+	if (!pthread_mutex_trylock(&shard->lock)) {
+		shard->acquired++;
+		return;
+	}
+
+	uint64_t t = bench_now();
+	pthread_mutex_lock(&shard->lock);
+	shard->acquired++;
+	shard->contended++;
+	shard->wait_ns += bench_now() - t;
+}
+
+static struct shard *shard_of(struct run *run, int key) {
+	return &run->shards[(unsigned int)key % run->nshards];
+}
+
+/*
+ * Loaded keys are the even numbers, writers
+ * insert odd keys unique to their thread.
+ */
+static void *worker_run(void *arg) {
+	struct worker *worker = (struct worker *)arg;
+	struct run *run = worker->run;
+	struct config *config = run->config;
+	int i, next = worker->id;
+
+	for (i = 0; i < config->operations; ++i) {
+		bool write = run->workload == WL_WRITE
+			|| (run->workload == WL_MIXED && bench_rand(&worker->state) % 2);
+		int key;
+
+		if (write) {
+			key = 2 * (next += run->threads) + 1;
+		} else {
+			key = 2 * (int)(bench_rand(&worker->state) % config->records);
+		}
+
+		struct shard *shard = shard_of(run, key);
+		shard_lock(shard);
+		if (write) {
+			record_t *record = ytree_new_int(key);
+			ytree_insert(&shard->db, key, record);
+			free(record);
+		} else {
+			free(ytree_find(&shard->db, key));
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return NULL;
+}
+
+/* Fresh memory trees holding the loaded records */
+static void shards_init(struct run *run) {
+	int i;
+
+	for (i = 0; i < run->nshards; ++i) {
+		struct shard *shard = &run->shards[i];
+
+		memset(shard, 0, sizeof(struct shard));
+		pthread_mutex_init(&shard->lock, NULL);
+		ytree_env_init(NULL, &shard->env, 0);
+		ytree_db_init(0, &shard->db, &shard->env);
+		ytree_order(&shard->db, run->config->order);
+	}
+
+	for (i = 0; i < run->config->records; ++i) {
+		record_t *record = ytree_new_int(2 * i);
+		struct shard *shard = shard_of(run, 2 * i);
+
+		ytree_insert(&shard->db, 2 * i, record);
+		free(record);
+	}
+}
+
+static void shards_free(struct run *run) {
+	int i;
+
+	for (i = 0; i < run->nshards; ++i) {
+		ytree_db_close(&run->shards[i].db);
+		ytree_env_close(&run->shards[i].env);
+		pthread_mutex_destroy(&run->shards[i].lock);
+	}
+}
+
+/* Powers of two, ending at max even if that is not one */
+static int next_threads(int threads, int max) {
+	if (threads == max)
+		return 0;
+
+	return threads * 2 < max ? threads * 2 : max;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -n <count>\tRecords to load (default 100000)\n"
+		"  -c <count>\tOperations per thread (default 200000)\n"
+		"  -t <count>\tMost threads to run (default all cores)\n"
+		"  -S <count>\tShards in the sharded mode (default 16)\n"
+		"  -o <order>\tTree order (default 32)\n"
+		"  -s <seed>\tRandom seed (default 1)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	static struct shard shards[MAX_SHARDS];
+	static struct worker workers[MAX_THREADS];
+	struct config config = {
+		.records = 100000,
+		.operations = 200000,
+		.max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+		.shards = 16,
+		.order = 32,
+		.seed = 1,
+	};
+	int opt, mode, workload, threads, i;
+
+	while ((opt = getopt(argc, argv, "n:c:t:S:o:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				config.records = atoi(optarg);
+				break;
+			case 'c':
+				config.operations = atoi(optarg);
+				break;
+			case 't':
+				config.max_threads = atoi(optarg);
+				break;
+			case 'S':
+				config.shards = atoi(optarg);
+				break;
+			case 'o':
+				config.order = atoi(optarg);
+				break;
+			case 's':
+				config.seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (config.records < 1 || config.operations < 1
+		|| config.max_threads < 1 || config.max_threads > MAX_THREADS
+		|| config.shards < 1 || config.shards > MAX_SHARDS
+		|| config.order < 3 || config.order > 100)
+		usage(argv[0]);
+
+	printf("mode,workload,threads,shards,operations,seconds,ops_per_sec,ops_per_sec_per_thread,speedup,contended_pct,wait_ns_per_op\n");
+
+	for (mode = 0; mode < MODE_MAX; ++mode) {
+		for (workload = 0; workload < WL_MAX; ++workload) {
+			double single = 0;
+
+			for (threads = 1; threads; threads = next_threads(threads, config.max_threads)) {
+				struct run run = {&config, shards, mode == MODE_GLOBAL ? 1 : config.shards, workload, threads};
+				uint64_t acquired = 0, contended = 0, wait_ns = 0, start, elapsed;
+
+				shards_init(&run);
+
+				for (i = 0; i < threads; ++i) {
+					workers[i].run = &run;
+					workers[i].id = i;
+					workers[i].state = config.seed * 0x9E3779B97F4A7C15ull + i + 1;
+				}
+
+				start = bench_now();
+				for (i = 0; i < threads; ++i)
+					pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+				for (i = 0; i < threads; ++i)
+					pthread_join(workers[i].thread, NULL);
+				elapsed = bench_now() - start;
+
+				for (i = 0; i < run.nshards; ++i) {
+					acquired += shards[i].acquired;
+					contended += shards[i].contended;
+					wait_ns += shards[i].wait_ns;
+				}
+
+				double total = (double)config.operations * threads;
+				double ops = elapsed ? total / (elapsed / 1e9) : 0.0;
+				if (threads == 1)
+					single = ops;
+
+				printf("%s,%s,%d,%d,%.0f,%.6f,%.1f,%.1f,%.2f,%.2f,%.1f\n",
+					mode_names[mode], workload_names[workload], threads, run.nshards,
+					total, elapsed / 1e9, ops, ops / threads, single > 0 ? ops / single : 0.0,
+					acquired ? 100.0 * contended / acquired : 0.0, wait_ns / total);
+				fflush(stdout);
+
+				shards_free(&run);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * -----------------------------  searchbench.c  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Node search kernel benchmark. Times every search kernel on
+ * full nodes of each order, with the node in cache (hot) and
+ * with a different node per search (cold), and reports the
+ * orders from which each kernel beats the linear scan. Kernels
+ * the CPU level does not support are left out.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ytree.h"
+#include "bench.h"
+
+#define MIN_ORDER 3
+#define MAX_SWEEP_ORDER 1024
+
+#define HOT_QUERIES 200000
+#define COLD_QUERIES 100000
+#define COLD_BYTES (64 * 1024 * 1024)
+
+enum scenario {
+	HOT,
+	COLD,
+	SCENARIO_MAX,
+};
+
+static const char *scenario_names[] = {
+	"hot",
+	"cold",
+};
+
+/*
+ * Orders measured, dense where nodes are
+ * small and sparser towards page sized nodes.
+ */
+static int next_order(int order) {
+	if (order < 32)
+		return order + 1;
+	if (order < 128)
+		return order + 8;
+	return order + 64;
+}
+
+/*
+ * Nodes with n even keys. The hot scenario
+ * searches a single node, the cold one picks
+ * a node from a pool larger than the cache.
+ */
+struct workload {
+	int *nodes;
+	size_t count;
+	int n;
+	uint32_t *which;
+	int *needles;
+	size_t queries;
+};
+
+static void workload_init(struct workload *w, int n, enum scenario scenario, uint64_t *seed) {
+	size_t i;
+	int j;
+
+	w->n = n;
+	w->count = scenario == HOT ? 1 : COLD_BYTES / (n * sizeof(int));
+	w->queries = scenario == HOT ? HOT_QUERIES : COLD_QUERIES;
+	w->nodes = (int *)malloc(w->count * n * sizeof(int));
+	w->which = (uint32_t *)malloc(w->queries * sizeof(uint32_t));
+	w->needles = (int *)malloc(w->queries * sizeof(int));
+	if (!w->nodes || !w->which || !w->needles) {
+		perror("Search workload");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < w->count; ++i)
+		for (j = 0; j < n; ++j)
+			w->nodes[i * n + j] = j * 2;
+
+	for (i = 0; i < w->queries; ++i) {
+		w->which[i] = (uint32_t)(bench_rand(seed) % w->count);
+		w->needles[i] = (int)(bench_rand(seed) % (2 * n + 1)) - 1;
+	}
+}
+
+static void workload_free(struct workload *w) {
+	free(w->nodes);
+	free(w->which);
+	free(w->needles);
+}
+
+/* Nanoseconds per search, sum receives the results */
+static double measure(struct workload *w, search_fn fn, long *sum) {
+	uint64_t start;
+	size_t i;
+	long total = 0;
+
+	start = bench_now();
+	for (i = 0; i < w->queries; ++i)
+		total += fn(w->nodes + (size_t)w->which[i] * w->n, w->n, w->needles[i]);
+
+	*sum = total;
+	return (double)(bench_now() - start) / w->queries;
+}
+
+int main(int argc, char *argv[]) {
+	static double results[MAX_SWEEP_ORDER + 1][SCENARIO_MAX][SEARCH_MAX];
+	uint64_t seed = 1;
+	int order, scenario, kernel;
+	bool first = true;
+
+	printf("{\"cpu\": \"%s\", \"orders\": [\n", ytree_cpu_name(ytree_cpu_level()));
+
+	for (order = MIN_ORDER; order <= MAX_SWEEP_ORDER; order = next_order(order)) {
+		printf("%s  {\"order\": %d, \"keys\": %d", first ? "" : ",\n", order, order - 1);
+		first = false;
+
+		for (scenario = 0; scenario < SCENARIO_MAX; ++scenario) {
+			struct workload w;
+			long expect = 0;
+
+			workload_init(&w, order - 1, scenario, &seed);
+
+			printf(", \"%s\": {", scenario_names[scenario]);
+			for (kernel = 0; kernel < SEARCH_MAX; ++kernel) {
+				search_fn fn = ytree_search_kernel(kernel);
+				long sum;
+
+				if (!fn)
+					continue;
+
+				/* Warm up, then keep the best of three */
+				double best = measure(&w, fn, &sum);
+				int round;
+				for (round = 0; round < 3; ++round) {
+					double ns = measure(&w, fn, &sum);
+					if (ns < best)
+						best = ns;
+				}
+
+				if (kernel == SEARCH_LINEAR) {
+					expect = sum;
+				} else if (sum != expect) {
+					fprintf(stderr, "Kernel %s disagrees at order %d\n", ytree_search_name(kernel), order);
+					exit(EXIT_FAILURE);
+				}
+
+				results[order][scenario][kernel] = best;
+				printf("%s\"%s\": %.2f", kernel ? ", " : "", ytree_search_name(kernel), best);
+			}
+			printf("}");
+
+			workload_free(&w);
+		}
+
+		printf(", \"selected\": \"%s\"}", ytree_search_name(ytree_search_select(order)));
+	}
+
+	/*
+	 * The crossover of a kernel is the first order
+	 * from which it stays faster than the linear scan.
+	 */
+	printf("\n], \"crossover\": {");
+	for (scenario = 0; scenario < SCENARIO_MAX; ++scenario) {
+		printf("%s\"%s\": {", scenario ? ", " : "", scenario_names[scenario]);
+		for (kernel = SEARCH_BINARY; kernel < SEARCH_MAX; ++kernel) {
+			int crossover = 0;
+
+			if (!ytree_search_kernel(kernel))
+				continue;
+
+			for (order = MIN_ORDER; order <= MAX_SWEEP_ORDER; order = next_order(order)) {
+				if (results[order][scenario][kernel] < results[order][scenario][SEARCH_LINEAR]) {
+					if (!crossover)
+						crossover = order;
+				} else {
+					crossover = 0;
+				}
+			}
+
+			printf("%s\"%s\": %d", kernel > SEARCH_BINARY ? ", " : "", ytree_search_name(kernel), crossover);
+		}
+		printf("}");
+	}
+	printf("}}\n");
+
+	return 0;
+}
@@ -0,0 +1,372 @@
+/*
+ * -----------------------------  stlbench.cpp  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Comparison against the standard containers. The memory environment
+ * of ytree, std::map, std::unordered_map and a sorted std::vector are
+ * timed on insert, point lookup, ordered scan and delete over the same
+ * shuffled int keys, and the heap bytes per key are measured. The
+ * sorted vector is built and pruned in bulk, one by one it would be
+ * quadratic. Results are written as JSON to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ytree.h"
+#include "bench.h"
+
+#define MAX_SIZES 16
+#define LOOKUPS 1000000
+
+enum phase {
+	PH_INSERT,
+	PH_FIND,
+	PH_SCAN,
+	PH_DELETE,
+	PH_MAX,
+};
+
+static const char *phase_names[] = {
+	"insert",
+	"find",
+	"scan",
+	"delete",
+};
+
+/*
+ * Result of one container at one size,
+ * nanoseconds per key or per lookup.
+ */
+struct result {
+	double ns[PH_MAX];
+	double bytes_per_key;
+	long checksum;
+};
+
+/*
+ * Heap bytes in use, -1 where glibc cannot tell.
+ * Large blocks, such as the memory image of an
+ * environment, are mapped and only in hblkhd.
+ */
+static long heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+	return (long)(info.uordblks + info.hblkhd);
+#else
+	return -1;
+#endif
+}
+
+static double per(uint64_t ns, size_t n) {
+	return n ? (double)ns / n : 0.0;
+}
+
+static double heap_per_key(long before, long after, size_t n) {
+	return before < 0 || after < 0 ? -1.0 : (double)(after - before) / n;
+}
+
+static bool sum_visit(int key, record_t *record, void *ctx) {
+	*(long *)ctx += key;
+	return true;
+}
+
+static struct result run_ytree(const std::vector<int> &keys, const std::vector<int> &lookups, int order) {
+	struct result r;
+	env_t *env = NULL;
+	db_t *db = NULL;
+	long before = heap_in_use();
+	uint64_t t;
+
+	memset(&r, 0, sizeof(r));
+	ytree_env_init(NULL, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_order(&db, order);
+
+	t = bench_now();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		record_t *record = ytree_new_int(keys[i]);
+		ytree_insert(&db, keys[i], record);
+		free(record);
+	}
+	r.ns[PH_INSERT] = per(bench_now() - t, keys.size());
+	r.bytes_per_key = heap_per_key(before, heap_in_use(), keys.size());
+
+	t = bench_now();
+	for (size_t i = 0; i < lookups.size(); ++i) {
+		record_t *record = ytree_find(&db, lookups[i]);
+		if (record) {
+			r.checksum += record->value._int;
+			free(record);
+		}
+	}
+	r.ns[PH_FIND] = per(bench_now() - t, lookups.size());
+
+	t = bench_now();
+	ytree_range(&db, INT_MIN, INT_MAX, sum_visit, &r.checksum);
+	r.ns[PH_SCAN] = per(bench_now() - t, keys.size());
+
+	t = bench_now();
+	for (size_t i = 0; i < keys.size(); ++i)
+		ytree_delete(&db, keys[i]);
+	r.ns[PH_DELETE] = per(bench_now() - t, keys.size());
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+	return r;
+}
+
+static struct result run_map(const std::vector<int> &keys, const std::vector<int> &lookups) {
+	struct result r;
+	long before = heap_in_use();
+	uint64_t t;
+
+	memset(&r, 0, sizeof(r));
+	{
+		std::map<int, int> map;
+
+		t = bench_now();
+		for (size_t i = 0; i < keys.size(); ++i)
+			map.insert(std::make_pair(keys[i], keys[i]));
+		r.ns[PH_INSERT] = per(bench_now() - t, keys.size());
+		r.bytes_per_key = heap_per_key(before, heap_in_use(), keys.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < lookups.size(); ++i) {
+			std::map<int, int>::iterator it = map.find(lookups[i]);
+			if (it != map.end())
+				r.checksum += it->second;
+		}
+		r.ns[PH_FIND] = per(bench_now() - t, lookups.size());
+
+		t = bench_now();
+		for (std::map<int, int>::iterator it = map.begin(); it != map.end(); ++it)
+			r.checksum += it->first;
+		r.ns[PH_SCAN] = per(bench_now() - t, keys.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < keys.size(); ++i)
+			map.erase(keys[i]);
+		r.ns[PH_DELETE] = per(bench_now() - t, keys.size());
+	}
+
+	return r;
+}
+
+/* The scan has to sort a copy of the keys to visit them in order */
+static struct result run_unordered(const std::vector<int> &keys, const std::vector<int> &lookups) {
+	struct result r;
+	long before = heap_in_use();
+	uint64_t t;
+
+	memset(&r, 0, sizeof(r));
+	{
+		std::unordered_map<int, int> map;
+
+		t = bench_now();
+		for (size_t i = 0; i < keys.size(); ++i)
+			map.insert(std::make_pair(keys[i], keys[i]));
+		r.ns[PH_INSERT] = per(bench_now() - t, keys.size());
+		r.bytes_per_key = heap_per_key(before, heap_in_use(), keys.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < lookups.size(); ++i) {
+			std::unordered_map<int, int>::iterator it = map.find(lookups[i]);
+			if (it != map.end())
+				r.checksum += it->second;
+		}
+		r.ns[PH_FIND] = per(bench_now() - t, lookups.size());
+
+		t = bench_now();
+		std::vector<int> ordered;
+		ordered.reserve(map.size());
+		for (std::unordered_map<int, int>::iterator it = map.begin(); it != map.end(); ++it)
+			ordered.push_back(it->first);
+		std::sort(ordered.begin(), ordered.end());
+		for (size_t i = 0; i < ordered.size(); ++i)
+			r.checksum += ordered[i];
+		r.ns[PH_SCAN] = per(bench_now() - t, keys.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < keys.size(); ++i)
+			map.erase(keys[i]);
+		r.ns[PH_DELETE] = per(bench_now() - t, keys.size());
+	}
+
+	return r;
+}
+
+static bool pair_less(const std::pair<int, int> &a, const std::pair<int, int> &b) {
+	return a.first < b.first;
+}
+
+/*
+ * Inserts are appended and sorted once, deletes
+ * sort the doomed keys and compact in one pass.
+ */
+static struct result run_vector(const std::vector<int> &keys, const std::vector<int> &lookups) {
+	struct result r;
+	long before = heap_in_use();
+	uint64_t t;
+
+	memset(&r, 0, sizeof(r));
+	{
+		std::vector<std::pair<int, int> > vec;
+
+		t = bench_now();
+		for (size_t i = 0; i < keys.size(); ++i)
+			vec.push_back(std::make_pair(keys[i], keys[i]));
+		std::sort(vec.begin(), vec.end(), pair_less);
+		r.ns[PH_INSERT] = per(bench_now() - t, keys.size());
+		r.bytes_per_key = heap_per_key(before, heap_in_use(), keys.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < lookups.size(); ++i) {
+			std::vector<std::pair<int, int> >::iterator it =
+				std::lower_bound(vec.begin(), vec.end(), std::make_pair(lookups[i], 0), pair_less);
+			if (it != vec.end() && it->first == lookups[i])
+				r.checksum += it->second;
+		}
+		r.ns[PH_FIND] = per(bench_now() - t, lookups.size());
+
+		t = bench_now();
+		for (size_t i = 0; i < vec.size(); ++i)
+			r.checksum += vec[i].first;
+		r.ns[PH_SCAN] = per(bench_now() - t, keys.size());
+
+		t = bench_now();
+		std::vector<int> doomed(keys);
+		std::sort(doomed.begin(), doomed.end());
+		size_t out = 0, d = 0;
+		for (size_t i = 0; i < vec.size(); ++i) {
+			while (d < doomed.size() && doomed[d] < vec[i].first)
+				++d;
+			if (d < doomed.size() && doomed[d] == vec[i].first)
+				continue;
+			vec[out++] = vec[i];
+		}
+		vec.resize(out);
+		r.ns[PH_DELETE] = per(bench_now() - t, keys.size());
+	}
+
+	return r;
+}
+
+static void print_result(const char *name, struct result *r, bool last) {
+	int p;
+
+	printf("      {\"container\": \"%s\"", name);
+	for (p = 0; p < PH_MAX; ++p)
+		printf(", \"%s_ns\": %.1f", phase_names[p], r->ns[p]);
+	printf(", \"bytes_per_key\": %.1f, \"checksum\": %ld}%s\n", r->bytes_per_key, r->checksum, last ? "" : ",");
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-n sizes] [-o order] [-s seed]\n"
+		"  -n <list>\tComma separated key counts (default 1000,10000,100000,1000000)\n"
+		"  -o <order>\tTree order (default 32)\n"
+		"  -s <seed>\tRandom seed (default 1)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	long sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+	int nsizes = 4, order = 32, opt, s;
+	uint64_t seed = 1;
+	char *tok;
+
+	while ((opt = getopt(argc, argv, "n:o:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				nsizes = 0;
+				for (tok = strtok(optarg, ","); tok && nsizes < MAX_SIZES; tok = strtok(NULL, ","))
+					sizes[nsizes++] = atol(tok);
+				break;
+			case 'o':
+				order = atoi(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (order < 3 || order > 100)
+		usage(argv[0]);
+
+	printf("{\"version\": \"%s\", \"order\": %d, \"seed\": %llu, \"sizes\": [\n",
+		ytree_version(), order, (unsigned long long)seed);
+
+	for (s = 0; s < nsizes; ++s) {
+		size_t n = (size_t)sizes[s];
+		uint64_t state = seed;
+
+		if (sizes[s] < 1 || sizes[s] > INT_MAX / 2) {
+			fprintf(stderr, "Invalid size: %ld\n", sizes[s]);
+			exit(EXIT_FAILURE);
+		}
+
+		/* Even keys, half of the lookups miss */
+		std::vector<int> keys(n);
+		for (size_t i = 0; i < n; ++i)
+			keys[i] = (int)(2 * i);
+		bench_shuffle(&keys[0], n, &state);
+
+		std::vector<int> lookups(LOOKUPS);
+		for (size_t i = 0; i < lookups.size(); ++i)
+			lookups[i] = (int)(bench_rand(&state) % (2 * n));
+
+		struct result ytree = run_ytree(keys, lookups, order);
+		struct result map = run_map(keys, lookups);
+		struct result unordered = run_unordered(keys, lookups);
+		struct result vector = run_vector(keys, lookups);
+
+		printf("  {\"keys\": %zu, \"lookups\": %zu, \"results\": [\n", n, lookups.size());
+		print_result("ytree", &ytree, false);
+		print_result("std::map", &map, false);
+		print_result("std::unordered_map", &unordered, false);
+		print_result("sorted_vector", &vector, true);
+		printf("  ]}%s\n", s + 1 < nsizes ? "," : "");
+		fflush(stdout);
+	}
+
+	printf("]}\n");
+
+	return 0;
+}
@@ -153,6 +153,1210 @@ TESTCASE(purge) {
 	ytree_env_close(&env);
 }
 
+TESTCASE(purge_step) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int i, steps = 0;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	for (i=0; i<2000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	test_assert(ytree_count(&db) == 2000);
+
+	ytree_purge_detach(&db);
+
+	test_assert(ytree_db_empty(&db));
+	test_assert(ytree_count(&db) == 0);
+
+	ytree_insert(&db, 42, ytree_new_int(42));
+	test_assert(ytree_count(&db) == 1);
+
+	while (ytree_purge_step(&db, 16))
+		++steps;
+
+	test_assert(steps > 1);
+	test_assert(ytree_count(&db) == 1);
+
+	for (i=0; i<2000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	ytree_purge_background(&db);
+
+	test_assert(ytree_db_empty(&db));
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+static size_t released = 0;
+
+static void release_batch(void **objects, size_t count) {
+	size_t i;
+	for (i=0; i<count; ++i)
+		test_assert(!strcmp((char *)objects[i], "somval"));
+	released += count;
+}
+
+TESTCASE(purge_release) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	db->hooks.object_release_batch = &release_batch;
+
+	valuepair_t value;
+	value.data = "somval";
+	value.size = sizeof("somval");
+
+	for (i=0; i<500; ++i)
+		ytree_insert(&db, i, ytree_new_record(&value));
+
+	record_t *record = ytree_find(&db, 250);
+	test_assert(record);
+	test_assert(record->value_size == sizeof("somval"));
+	test_assert(!strcmp((char *)record->value._data, "somval"));
+	free(record);
+
+	ytree_delete(&db, 250);
+	test_assert(released == 1);
+
+	ytree_purge(&db);
+
+	test_assert(released == 500);
+	test_assert(ytree_db_empty(&db));
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(incr) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	ytree_insert(&db, 1, ytree_new_int(10));
+	ytree_insert(&db, 2, ytree_new_float(1.5f));
+	ytree_insert(&db, 3, ytree_new_char('a'));
+
+	test_assert(ytree_incr(&db, 1, 5));
+	test_assert(ytree_incr(&db, 1, -2));
+	test_assert(ytree_incr(&db, 2, 1.0));
+	test_assert(!ytree_incr(&db, 3, 1));
+	test_assert(!ytree_incr(&db, 4, 1));
+
+	record_t *record = ytree_find(&db, 1);
+	test_assert(record->value._int == 13);
+	free(record);
+
+	record = ytree_find(&db, 2);
+	test_assert(record->value._float == 2.5f);
+	free(record);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(cas) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	ytree_insert(&db, 7, ytree_new_int(100));
+
+	test_assert(!ytree_cas(&db, 7, ytree_new_int(99), ytree_new_int(1)));
+	test_assert(ytree_cas(&db, 7, ytree_new_int(100), ytree_new_int(1)));
+
+	valuepair_t value;
+	value.data = "longer value";
+	value.size = sizeof("longer value");
+
+	test_assert(ytree_cas(&db, 7, ytree_new_int(1), ytree_new_record(&value)));
+
+	record_t *record = ytree_find(&db, 7);
+	test_assert(record->value_type == DT_DATA);
+	test_assert(!strcmp((char *)record->value._data, "longer value"));
+	free(record);
+
+	test_assert(ytree_count(&db) == 1);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+static bool double_value(record_t *record, void *ctx) {
+	record->value._int *= *(int *)ctx;
+	return true;
+}
+
+TESTCASE(update) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int i, factor = 2;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	for (i=0; i<100; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	for (i=0; i<100; ++i)
+		test_assert(ytree_update(&db, i, &double_value, &factor));
+
+	test_assert(!ytree_update(&db, 100, &double_value, &factor));
+
+	for (i=0; i<100; ++i) {
+		record_t *record = ytree_find(&db, i);
+		test_assert(record->value._int == i * 2);
+		free(record);
+	}
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+static bool sum_values(int key, record_t *record, void *ctx) {
+	*(int *)ctx += record->value._int;
+	return true;
+}
+
+TESTCASE(duplicate) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int i, sum = 0;
+
+	ytree_env_init(DATABASENAME, &env, DB_FLAG_DUPLICATE);
+	ytree_db_init(0, &db, &env);
+
+	for (i=1; i<=1000; ++i) {
+		ytree_insert(&db, i % 3, ytree_new_int(i));
+		ytree_insert(&db, 1000 + i, ytree_new_int(i));
+	}
+
+	test_assert(ytree_count(&db) == 1003);
+	test_assert(ytree_find_all(&db, 1, &sum_values, &sum) == 334);
+	test_assert(sum == 167167);
+
+	test_assert(ytree_delete_value(&db, 1, ytree_new_int(499)));
+	test_assert(!ytree_delete_value(&db, 1, ytree_new_int(499)));
+	test_assert(!ytree_delete_value(&db, 1, ytree_new_int(500)));
+
+	sum = 0;
+	test_assert(ytree_find_all(&db, 1, &sum_values, &sum) == 333);
+	test_assert(sum == 167167 - 499);
+
+	ytree_delete(&db, 2);
+	test_assert(ytree_find_all(&db, 2, &sum_values, &sum) == 0);
+
+	test_assert(ytree_delete_value(&db, 1500, ytree_new_int(500)));
+	test_assert(ytree_count(&db) == 1001);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+static bool collect_keys(int key, record_t *record, void *ctx) {
+	int *keys = (int *)ctx;
+	keys[keys[0]++ + 1] = key;
+	return true;
+}
+
+static bool extract_size(record_t *record, int *value) {
+	if (record->value_type != DT_DATA)
+		return false;
+
+	*value = (int)record->value_size;
+	return true;
+}
+
+TESTCASE(index) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int i, keys[1001];
+	unsigned int generation;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	for (i=0; i<500; ++i)
+		ytree_insert(&db, i, ytree_new_int((i * 7) % 1000));
+
+	ytree_index_init(1, &db, NULL);
+
+	for (i=500; i<1000; ++i)
+		ytree_insert(&db, i, ytree_new_int((i * 7) % 1000));
+
+	keys[0] = 0;
+	test_assert(ytree_index_range(&db, 100, 199, &collect_keys, keys) == 100);
+	for (i=1; i<=keys[0]; ++i) {
+		record_t *record = ytree_find(&db, keys[i]);
+		test_assert(record->value._int >= 100 && record->value._int <= 199);
+		free(record);
+	}
+
+	/* Value 100 belongs to key 300 */
+	ytree_delete(&db, 300);
+	test_assert(ytree_incr(&db, 1, 93));
+
+	keys[0] = 0;
+	test_assert(ytree_index_range(&db, 100, 199, &collect_keys, keys) == 100);
+	test_assert(ytree_index_range(&db, 7, 7, &collect_keys, keys) == 0);
+
+	generation = db->index->generation;
+	ytree_purge(&db);
+	test_assert(ytree_index_range(&db, 0, 1000, &collect_keys, keys) == 0);
+	test_assert(db->index->keys == 0 && db->index->generation != generation);
+
+	/* The index is usable again after the purge */
+	ytree_insert(&db, 1, ytree_new_int(150));
+	keys[0] = 0;
+	test_assert(ytree_index_range(&db, 100, 199, &collect_keys, keys) == 1);
+	test_assert(db->index->keys == 1);
+
+	ytree_db_close(&db);
+
+	ytree_db_init(2, &db, &env);
+	ytree_index_init(3, &db, &extract_size);
+
+	valuepair_t value;
+	value.data = "somval";
+	value.size = sizeof("somval");
+
+	ytree_insert(&db, 1, ytree_new_record(&value));
+	ytree_insert(&db, 2, ytree_new_int(7));
+
+	keys[0] = 0;
+	test_assert(ytree_index_range(&db, 0, 6, &collect_keys, keys) == 0);
+	test_assert(ytree_index_range(&db, 7, 7, &collect_keys, keys) == 1);
+	test_assert(keys[1] == 1);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(batch) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_batch_t *batch = NULL;
+	ytree_stats_t stats;
+	ytree_histogram_t hist;
+	int i, free_back;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_batch_init(&batch, &env);
+
+	for (i=0; i<100; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	for (i=1000; i>=0; i-=2)
+		ytree_batch_insert(&batch, i, ytree_new_int(-i));
+	for (i=1; i<100; i+=2)
+		ytree_batch_delete(&batch, i);
+
+	/* Same key in order of addition */
+	ytree_batch_delete(&batch, 2000);
+	ytree_batch_insert(&batch, 2000, ytree_new_int(1));
+	ytree_batch_delete(&batch, 2000);
+	ytree_batch_insert(&batch, 2000, ytree_new_int(2));
+
+	test_assert(ytree_count(&db) == 100);
+	test_assert(ytree_batch_commit(&db, &batch));
+
+	/* Even keys below 100 existed already */
+	test_assert(ytree_count(&db) == 50 + 451 + 1);
+	for (i=0; i<100; i+=2) {
+		record_t *record = ytree_find(&db, i);
+		test_assert(record->value._int == i);
+		free(record);
+	}
+
+	record_t *record = ytree_find(&db, 1000);
+	test_assert(record->value._int == -1000);
+	free(record);
+
+	record = ytree_find(&db, 2000);
+	test_assert(record->value._int == 2);
+	free(record);
+
+	test_assert(ytree_batch_commit(&db, &batch));
+	test_assert(ytree_count(&db) == 502);
+
+	/* Records of ignored inserts take no heap space */
+	ytree_stats_reset(&db);
+	ytree_latency_enable(&db, true);
+	free_back = env->free_back;
+	for (i=0; i<100; i+=2)
+		ytree_batch_insert(&batch, i, ytree_new_data("ignored", 8));
+	ytree_batch_delete(&batch, 4);
+	ytree_batch_insert(&batch, 4, ytree_new_int(44));
+	test_assert(ytree_batch_commit(&db, &batch));
+	test_assert(env->free_back == free_back - (int)(sizeof(enum datatype) + sizeof(int)));
+
+	record = ytree_find(&db, 4);
+	test_assert(record->value._int == 44);
+	free(record);
+	record = ytree_find(&db, 6);
+	test_assert(record->value._int == 6);
+	free(record);
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.batch_commits == 1 && stats.batch_ops == 52);
+	test_assert(stats.records_written == 1);
+	ytree_latency(&db, LAT_BATCH, &hist);
+	test_assert(hist.count == 1);
+
+	/* Empty commits are timed but not counted */
+	test_assert(ytree_batch_commit(&db, &batch));
+	ytree_stats(&db, &stats);
+	test_assert(stats.batch_commits == 1);
+	ytree_latency(&db, LAT_BATCH, &hist);
+	test_assert(hist.count == 2);
+
+	ytree_batch_close(&batch);
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(memory) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	char word[64];
+	int i;
+
+	ytree_env_init(NULL, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	test_assert(env->pdb == NULL);
+
+	/* Spans many pages */
+	for (i=0; i<5000; ++i) {
+		snprintf(word, sizeof(word), "word-%d", i);
+		ytree_insert(&db, i, ytree_new_data(word, strlen(word) + 1));
+	}
+
+	test_assert(ytree_count(&db) == 5000);
+	test_assert(access(DATABASENAME, F_OK) != 0);
+
+	for (i=0; i<5000; i+=7) {
+		record_t *record = ytree_find(&db, i);
+		snprintf(word, sizeof(word), "word-%d", i);
+		test_assert(record != NULL);
+		test_assert(!strcmp(record->value._data, word));
+		free(record);
+	}
+
+	for (i=0; i<5000; i+=2)
+		ytree_delete(&db, i);
+
+	test_assert(ytree_count(&db) == 2500);
+	test_assert(ytree_find(&db, 42) == NULL);
+
+	ytree_purge_background(&db);
+	test_assert(ytree_db_empty(&db));
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(stats) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_stats_t stats;
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.descents == 0);
+	test_assert(stats.records_written == 0);
+
+	for (i=0; i<1000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.records_written == 1000);
+	test_assert(stats.bytes_written == 1000 * (sizeof(enum datatype) + sizeof(int)));
+	test_assert(stats.leaf_splits > 0);
+	test_assert(stats.internal_splits > 0);
+	test_assert(stats.root_changes == (uint64_t)ytree_height(&db) + 1);
+	test_assert(stats.comparisons > 0);
+	test_assert(stats.bytes_logical == 1000 * 2 * sizeof(int));
+	test_assert(stats.io.writes > 1000);
+	test_assert(stats.io.bytes_written > stats.bytes_written);
+	test_assert(stats.io.pages_written >= stats.io.writes);
+	test_assert(stats.write_amplification > 1.0);
+
+	ytree_stats_reset(&db);
+
+	for (i=0; i<10; ++i)
+		free(ytree_find(&db, i));
+	test_assert(ytree_incr(&db, 5, 1));
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.descents == 11);
+	test_assert(stats.records_read == 11);
+	test_assert(stats.records_written == 1);
+	test_assert(stats.leaf_splits == 0);
+	test_assert(stats.io.reads == 22);
+	test_assert(stats.io.writes == 1);
+	test_assert(stats.io.bytes_written == sizeof(enum datatype) + sizeof(int));
+	test_assert(stats.io.seeks > 0);
+	test_assert(stats.io.fsyncs == 0);
+
+	for (i=0; i<1000; ++i)
+		ytree_delete(&db, i);
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.coalesces > 0);
+	test_assert(stats.redistributions > 0);
+
+	ytree_stats_reset(&db);
+	ytree_stats(&db, &stats);
+	test_assert(stats.coalesces == 0);
+	test_assert(stats.descents == 0);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(latency) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_histogram_t hist, merged;
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	/* Off by default */
+	ytree_insert(&db, -1, ytree_new_int(-1));
+	ytree_latency(&db, LAT_INSERT, &hist);
+	test_assert(hist.count == 0);
+
+	ytree_latency_enable(&db, true);
+
+	for (i=0; i<1000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+	for (i=0; i<500; ++i)
+		free(ytree_find(&db, i));
+	for (i=0; i<100; ++i)
+		ytree_delete(&db, i);
+
+	ytree_latency(&db, LAT_INSERT, &hist);
+	test_assert(hist.count == 1000);
+	test_assert(hist.min <= hist.max);
+
+	uint64_t p50 = ytree_histogram_percentile(&hist, 50.0);
+	uint64_t p99 = ytree_histogram_percentile(&hist, 99.0);
+	uint64_t p100 = ytree_histogram_percentile(&hist, 100.0);
+	test_assert(p50 > 0);
+	test_assert(p50 <= p99);
+	test_assert(p99 <= p100);
+
+	memcpy(&merged, &hist, sizeof(ytree_histogram_t));
+	ytree_latency(&db, LAT_FIND, &hist);
+	test_assert(hist.count == 500);
+	ytree_histogram_merge(&merged, &hist);
+	test_assert(merged.count == 1500);
+
+	ytree_latency(&db, LAT_DELETE, &hist);
+	test_assert(hist.count == 100);
+
+	ytree_latency_enable(&db, false);
+	free(ytree_find(&db, 900));
+	ytree_latency(&db, LAT_FIND, &hist);
+	test_assert(hist.count == 500);
+
+	ytree_latency_reset(&db);
+	ytree_latency(&db, LAT_INSERT, &hist);
+	test_assert(hist.count == 0);
+	test_assert(ytree_histogram_percentile(&hist, 99.0) == 0);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+static size_t traced[TRACE_MAX];
+
+static void count_event(const trace_event_t *event, void *ctx) {
+	traced[event->type]++;
+	if (event->type == TRACE_WRITE)
+		*(size_t *)ctx += event->size;
+}
+
+TESTCASE(trace) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_batch_t *batch = NULL;
+	size_t written = 0;
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_trace(&env, count_event, &written);
+
+	for (i=0; i<500; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	test_assert(traced[TRACE_LEAF_SPLIT] > 0);
+	test_assert(traced[TRACE_INTERNAL_SPLIT] > 0);
+	test_assert(traced[TRACE_ROOT_CHANGE] == (size_t)ytree_height(&db) + 1);
+	test_assert(traced[TRACE_WRITE] >= 500);
+	test_assert(written >= 500 * (sizeof(enum datatype) + sizeof(int)));
+
+	free(ytree_find(&db, 42));
+	test_assert(traced[TRACE_READ] > 0);
+
+	for (i=0; i<500; ++i)
+		ytree_delete(&db, i);
+
+	test_assert(traced[TRACE_COALESCE] > 0);
+	test_assert(traced[TRACE_REDISTRIBUTE] > 0);
+
+	ytree_batch_init(&batch, &env);
+	ytree_batch_insert(&batch, 1, ytree_new_int(1));
+	test_assert(ytree_batch_commit(&db, &batch));
+	test_assert(traced[TRACE_FSYNC] == 1);
+	ytree_batch_close(&batch);
+
+	/* Removed hook sees nothing */
+	ytree_trace(&env, NULL, NULL);
+	ytree_insert(&db, 2, ytree_new_int(2));
+	test_assert(traced[TRACE_FSYNC] == 1);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(shape) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_shape_t shape;
+	char line[64];
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	ytree_shape(&db, &shape);
+	test_assert(shape.nodes == 0);
+
+	for (i=0; i<1000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+
+	ytree_shape(&db, &shape);
+	test_assert(shape.height == ytree_height(&db));
+	test_assert(shape.keys == 1000);
+	test_assert(shape.levels[0].nodes == 1);
+	test_assert(shape.levels[shape.height].keys == 1000);
+	test_assert(shape.chain_leaves == shape.levels[shape.height].nodes);
+	test_assert(shape.chain_ordered);
+	test_assert(shape.heap_near + shape.heap_far == 999);
+
+	uint64_t nodes = 0;
+	for (i=0; i<=shape.height; ++i)
+		nodes += shape.levels[i].nodes;
+	test_assert(nodes == shape.nodes);
+
+	FILE *fp = tmpfile();
+	ytree_dump(&db, fp, DUMP_JSON);
+	rewind(fp);
+	test_assert(fgets(line, sizeof(line), fp) && line[0] == '{');
+	fclose(fp);
+
+	fp = tmpfile();
+	ytree_dump(&db, fp, DUMP_DOT);
+	rewind(fp);
+	test_assert(fgets(line, sizeof(line), fp) && !strncmp(line, "digraph", 7));
+	fclose(fp);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+TESTCASE(search) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	int keys[512];
+	int i, n, kernel, order;
+	enum cpu_level level;
+
+	/* Every kernel agrees with the linear scan */
+	for (n=0; n<512; ++n) {
+		search_fn linear = ytree_search_kernel(SEARCH_LINEAR);
+		bool agree = true;
+
+		for (i=0; i<n; ++i)
+			keys[i] = (i ? keys[i-1] : -100) + 1 + rand() % 4;
+
+		for (kernel=0; kernel<SEARCH_MAX; ++kernel) {
+			search_fn fn = ytree_search_kernel(kernel);
+			if (!fn)
+				continue;
+			for (i=-101; i<=(n ? keys[n-1] : -100) + 1; ++i)
+				if (fn(keys, n, i) != linear(keys, n, i))
+					agree = false;
+		}
+		test_assert(agree);
+	}
+
+	/* Trees find all keys whichever kernel is selected */
+	for (order=3; order<=100; order+=97) {
+		bool found = true;
+
+		ytree_env_init(NULL, &env, 0);
+		ytree_db_init(0, &db, &env);
+		ytree_order(&db, order);
+		test_assert(db->search == ytree_search_kernel(ytree_search_select(order)));
+
+		for (i=0; i<2000; i+=2)
+			ytree_insert(&db, i, ytree_new_int(i));
+
+		for (i=-1; i<2001; ++i) {
+			record_t *record = ytree_find(&db, i);
+			if ((record != NULL) != (i >= 0 && i < 2000 && !(i % 2)))
+				found = false;
+			free(record);
+		}
+		test_assert(found);
+
+		ytree_db_close(&db);
+		ytree_env_close(&env);
+	}
+
+	/* Forced down to scalar only the portable kernels remain */
+	level = ytree_cpu_level();
+	test_assert(ytree_cpu_set(CPU_SCALAR) == CPU_SCALAR);
+	test_assert(ytree_search_kernel(SEARCH_LINEAR) && ytree_search_kernel(SEARCH_BRANCHLESS));
+	test_assert(!ytree_search_kernel(SEARCH_SIMD) && !ytree_search_kernel(SEARCH_AVX512));
+	test_assert(ytree_search_select(8) == SEARCH_LINEAR);
+	test_assert(ytree_search_select(100) == SEARCH_BRANCHLESS);
+
+	ytree_env_init(NULL, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_order(&db, 8);
+	test_assert(db->search == ytree_search_kernel(SEARCH_LINEAR));
+	for (i=0; i<500; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+	for (i=0; i<500; ++i) {
+		record_t *record = ytree_find(&db, i);
+		test_assert(record && record->value._int == i);
+		free(record);
+	}
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+
+	test_assert(ytree_cpu_set(level) == level);
+	test_assert(ytree_cpu_set(CPU_AVX512) >= level);
+	ytree_cpu_set(level);
+}
+
+static bool keep_value(record_t *record, void *ctx) {
+	return true;
+}
+
+TESTCASE(capture) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	capture_header_t header;
+	capture_event_t event;
+	ytree_batch_t *batch = NULL;
+	db_t *indexed = NULL;
+	int counts[CAPTURE_MAX] = {0};
+	int schemas[3] = {0};
+	int i, sum = 0, events = 0;
+
+	ytree_env_init(NULL, &env, 0);
+	ytree_db_init(0, &db, &env);
+	ytree_front_cache(&db, 64);
+	ytree_db_init(1, &indexed, &env);
+	indexed->flags |= DB_FLAG_SMALL;
+	ytree_order(&indexed, 300);
+	ytree_index_init(2, &indexed, NULL);
+
+	test_assert(ytree_capture_start(&env, "__capture.bin"));
+	test_assert(!ytree_capture_start(&env, "__capture.bin"));
+
+	for (i=0; i<5000; ++i)
+		ytree_insert(&db, i, ytree_new_int(i));
+	for (i=0; i<100; ++i)
+		free(ytree_find(&db, i));
+	ytree_range(&db, 10, 19, sum_values, &sum);
+	ytree_incr(&db, 1, 2.5);
+	ytree_update(&db, 2, keep_value, NULL);
+	ytree_delete(&db, 3);
+	ytree_find_all(&db, 5, sum_values, &sum);
+	ytree_delete_value(&db, 6, ytree_new_int(6));
+
+	ytree_batch_init(&batch, &env);
+	ytree_batch_insert(&batch, 7000, ytree_new_int(1));
+	ytree_batch_insert(&batch, 7001, ytree_new_int(2));
+	ytree_batch_delete(&batch, 8);
+	test_assert(ytree_batch_commit(&db, &batch));
+	test_assert(ytree_batch_commit(&db, &batch));
+	ytree_batch_close(&batch);
+
+	/* Index maintenance is not captured on its own */
+	for (i=0; i<10; ++i)
+		ytree_insert(&indexed, i, ytree_new_int(i % 3));
+	for (i=0; i<5; ++i)
+		ytree_delete(&indexed, i);
+	ytree_incr(&indexed, 5, 1);
+	test_assert(ytree_index_range(&indexed, 0, 2, sum_values, &sum) == 4);
+
+	test_assert(ytree_capture_stop(&env));
+	test_assert(!ytree_capture_stop(&env));
+
+	/* Not captured once stopped */
+	ytree_delete(&db, 4);
+
+	FILE *fp = fopen("__capture.bin", "rb");
+	test_assert(fp);
+	test_assert(fread(&header, sizeof(capture_header_t), 1, fp) == 1);
+	test_assert(!memcmp(header.magic, CAPTURE_MAGIC, 8));
+	test_assert(header.event_size == sizeof(capture_event_t));
+
+	while (fread(&event, sizeof(capture_event_t), 1, fp) == 1) {
+		test_assert(event.schema_id < 3);
+		test_assert(event.order == (event.schema_id ? 300 : 4));
+		counts[event.op]++;
+		schemas[event.schema_id]++;
+		events++;
+		if (event.op == CAPTURE_RANGE) {
+			test_assert(event.key == 10);
+			test_assert(event.arg == 10);
+		}
+		if (event.op == CAPTURE_BATCH_COMMIT)
+			test_assert(event.arg == (counts[CAPTURE_BATCH_COMMIT] == 1 ? 3 : 0));
+		if (event.op == CAPTURE_SETUP) {
+			test_assert(event.key == (event.schema_id ? 2 : -1));
+			test_assert(event.arg == (event.schema_id ? 0 : 64));
+			test_assert(event.value_type == (event.schema_id ? DB_FLAG_SMALL : 0));
+		}
+		if (event.op == CAPTURE_INDEX_RANGE) {
+			test_assert(event.schema_id == 1);
+			test_assert(event.arg == 4);
+		}
+	}
+	fclose(fp);
+	unlink("__capture.bin");
+
+	test_assert(events == 5130);
+	test_assert(schemas[0] == 5112);
+	test_assert(schemas[1] == 18);
+	test_assert(schemas[2] == 0);
+	test_assert(counts[CAPTURE_INSERT] == 5010);
+	test_assert(counts[CAPTURE_FIND] == 100);
+	test_assert(counts[CAPTURE_DELETE] == 6);
+	test_assert(counts[CAPTURE_FIND_ALL] == 1);
+	test_assert(counts[CAPTURE_DELETE_VALUE] == 1);
+	test_assert(counts[CAPTURE_BATCH_INSERT] == 2);
+	test_assert(counts[CAPTURE_BATCH_DELETE] == 1);
+	test_assert(counts[CAPTURE_BATCH_COMMIT] == 2);
+	test_assert(counts[CAPTURE_INDEX_RANGE] == 1);
+	test_assert(counts[CAPTURE_SETUP] == 2);
+
+	ytree_db_close(&indexed);
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
+
+/*
+ * Allocator that keeps the block and size in
+ * front of each allocation, and checks the sizes
+ * passed on release.
+ */
+struct counting_allocator {
+	size_t live;
+	int allocs;
+	int aligned;
+	int wrong_size;
+};
+
+static void *counting_alloc_aligned(size_t alignment, size_t size, void *ctx) {
+	struct counting_allocator *counter = (struct counting_allocator *)ctx;
+	uint8_t *block = (uint8_t *)malloc(size + alignment + 2 * sizeof(size_t));
+	uintptr_t ptr = ((uintptr_t)block + 2 * sizeof(size_t) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+	((size_t *)ptr)[-1] = size;
+	((uint8_t **)ptr)[-2] = block;
+	memset((void *)ptr, 0xa5, size);
+	counter->live += size;
+	counter->allocs++;
+	return (void *)ptr;
+}
+
+static void *counting_alloc(size_t size, void *ctx) {
+	return counting_alloc_aligned(sizeof(size_t), size, ctx);
+}
+
+static void *counting_alloc_line(size_t alignment, size_t size, void *ctx) {
+	struct counting_allocator *counter = (struct counting_allocator *)ctx;
+	counter->aligned++;
+	return counting_alloc_aligned(alignment, size, ctx);
+}
+
+static void counting_free(void *ptr, void *ctx) {
+	struct counting_allocator *counter = (struct counting_allocator *)ctx;
+	counter->live -= ((size_t *)ptr)[-1];
+	free(((uint8_t **)ptr)[-2]);
+}
+
+static void counting_free_sized(void *ptr, size_t size, void *ctx) {
+	struct counting_allocator *counter = (struct counting_allocator *)ctx;
+	if (((size_t *)ptr)[-1] != size)
+		counter->wrong_size++;
+	counting_free(ptr, ctx);
+}
+
+static bool grow_value(record_t *record, void *ctx) {
+	record->value._data = ctx;
+	record->value_size = strlen((char *)ctx) + 1;
+	return true;
+}
+
+TESTCASE(allocator) {
+	struct counting_allocator counter;
+	env_t *env = NULL;
+	db_t *db = NULL;
+	record_t *record;
+	ytree_batch_t *batch = NULL;
+	char data[] = "the quick brown fox";
+	char longer[] = "jumps over the lazy dog twice";
+	int i, allocs;
+
+	memset(&counter, 0, sizeof(counter));
+	ytree_env_init(NULL, &env, DB_FLAG_DUPLICATE);
+	test_assert(ytree_set_allocator(&env, counting_alloc, counting_free, &counter));
+	test_assert(ytree_set_allocator_hints(&env, counting_free_sized, counting_alloc_line));
+	test_assert(counter.live > 0);
+
+	ytree_db_init(0, &db, &env);
+	ytree_order(&db, 5);
+
+	/* Memory of the open database came from the hooks */
+	test_assert(!ytree_set_allocator(&env, NULL, NULL, NULL));
+	test_assert(!ytree_set_allocator_hints(&env, NULL, NULL));
+
+	/* Splits, posting lists and values that change size */
+	for (i=0; i<400; ++i)
+		ytree_insert(&db, i, ytree_new_data(data, sizeof(data)));
+	for (i=0; i<400; i+=4)
+		ytree_insert(&db, i, ytree_new_data(data, sizeof(data)));
+	for (i=0; i<400; i+=3)
+		test_assert(ytree_update(&db, i, grow_value, longer));
+	test_assert(counter.aligned > 0);
+	test_assert((uintptr_t)db->root->keys % 64 == 0);
+
+	record = ytree_find(&db, 3);
+	test_assert(record && !strcmp((char *)record->value._data, longer));
+	ytree_free_record(&env, record);
+
+	/* Records and batches of the environment */
+	allocs = counter.allocs;
+	ytree_batch_init(&batch, &env);
+	for (i=400; i<600; ++i) {
+		record = ytree_make_record(&env, DT_DATA, 0, 0, 0, data, sizeof(data));
+		test_assert(record->value._data != data && !strcmp((char *)record->value._data, data));
+		ytree_batch_insert(&batch, i, record);
+		ytree_free_record(&env, record);
+	}
+	test_assert(ytree_batch_commit(&db, &batch));
+	ytree_batch_close(&batch);
+	test_assert(counter.allocs - allocs > 400);
+
+	for (i=0; i<600; i+=2)
+		ytree_delete(&db, i);
+	ytree_latency_enable(&db, true);
+	ytree_purge(&db);
+	test_assert(ytree_db_empty(&db));
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+
+	test_assert(counter.live == 0);
+	test_assert(counter.wrong_size == 0);
+}
+
+static bool same_record(record_t *a, record_t *b) {
+	if (!a || !b)
+		return a == b;
+	if (a->value_type != b->value_type)
+		return false;
+	if (a->value_type == DT_DATA)
+		return a->value_size == b->value_size && !memcmp(a->value._data, b->value._data, a->value_size);
+	return a->value._int == b->value._int;
+}
+
+TESTCASE(front) {
+	env_t *env[2] = {NULL, NULL};
+	db_t *db[2] = {NULL, NULL};
+	ytree_stats_t stats;
+	size_t evicted = traced[TRACE_EVICT], written = 0;
+	char data[] = "value";
+	char longer[] = "a value that no longer fits";
+	bool agree = true;
+	int i, j;
+
+	for (j=0; j<2; ++j) {
+		ytree_env_init(NULL, &env[j], DB_FLAG_DUPLICATE);
+		ytree_db_init(0, &db[j], &env[j]);
+		ytree_order(&db[j], 4);
+	}
+	ytree_front_cache(&db[0], 16);
+	ytree_trace(&env[0], count_event, &written);
+
+	/* Same operations on both, the cached one must agree */
+	srand(7);
+	for (i=0; i<20000; ++i) {
+		int key = rand() % 8 ? rand() % 24 : rand() % 400;
+		int op = rand() % 10;
+		record_t *found[2];
+
+		for (j=0; j<2; ++j) {
+			switch (op) {
+				case 0:
+					ytree_delete(&db[j], key);
+					break;
+				case 1:
+					ytree_update(&db[j], key, grow_value, longer);
+					break;
+				case 2:
+					ytree_insert(&db[j], key, ytree_new_data(data, sizeof(data)));
+					break;
+				case 3:
+					ytree_delete_value(&db[j], key, ytree_new_data(data, sizeof(data)));
+					break;
+				case 4:
+					ytree_insert(&db[j], key, ytree_new_int(key));
+					break;
+				default:
+					break;
+			}
+		}
+
+		key = rand() % 8 ? rand() % 24 : rand() % 400;
+		for (j=0; j<2; ++j)
+			found[j] = ytree_find(&db[j], key);
+		if (!same_record(found[0], found[1]))
+			agree = false;
+		free(found[0]);
+		free(found[1]);
+	}
+	test_assert(agree);
+
+	ytree_stats(&db[0], &stats);
+	test_assert(stats.front_hits > 0 && stats.front_misses > 0);
+	test_assert(stats.front_evictions > 0);
+	test_assert(traced[TRACE_EVICT] - evicted == stats.front_evictions);
+
+	/* Purged keys are gone from the cache as well */
+	ytree_purge(&db[0]);
+	test_assert(!ytree_find(&db[0], 1) && !ytree_find(&db[0], 2));
+
+	for (j=0; j<2; ++j) {
+		ytree_db_close(&db[j]);
+		ytree_env_close(&env[j]);
+	}
+}
+
+TESTCASE(small) {
+	env_t *env[2] = {NULL, NULL};
+	db_t *db[2] = {NULL, NULL};
+	ytree_batch_t *batch = NULL;
+	char data[] = "value";
+	bool agree = true;
+	int i, j, round;
+
+	ytree_env_init(NULL, &env[0], DB_FLAG_DUPLICATE | DB_FLAG_SMALL);
+	ytree_env_init(NULL, &env[1], DB_FLAG_DUPLICATE);
+	for (j=0; j<2; ++j) {
+		ytree_db_init(0, &db[j], &env[j]);
+		ytree_order(&db[j], 4);
+	}
+
+	/* Grow past a single leaf and shrink back, twice */
+	srand(11);
+	for (round=0; round<2; ++round) {
+		for (i=0; i<600; ++i) {
+			int key = rand() % 2000;
+
+			for (j=0; j<2; ++j) {
+				if (i % 7) {
+					ytree_insert(&db[j], key, ytree_new_int(key));
+				} else {
+					ytree_batch_init(&batch, &env[j]);
+					ytree_batch_insert(&batch, key, ytree_new_data(data, sizeof(data)));
+					ytree_batch_insert(&batch, key + 1, ytree_new_int(key));
+					ytree_batch_commit(&db[j], &batch);
+					ytree_batch_close(&batch);
+				}
+			}
+
+			if (i == 100)
+				test_assert(ytree_height(&db[0]) == 0);
+		}
+		test_assert(ytree_height(&db[0]) > 0);
+
+		/* Keep every fiftieth key, few enough for a single leaf */
+		for (i=0; i<2001; ++i) {
+			record_t *found[2];
+
+			for (j=0; j<2; ++j)
+				found[j] = ytree_find(&db[j], i);
+			if (!same_record(found[0], found[1]))
+				agree = false;
+			free(found[0]);
+			free(found[1]);
+
+			if (i % 50)
+				for (j=0; j<2; ++j)
+					ytree_delete(&db[j], i);
+		}
+		test_assert(ytree_height(&db[0]) == 0);
+		test_assert(ytree_count(&db[0]) == ytree_count(&db[1]));
+	}
+	test_assert(agree);
+
+	/* Without room for small nodes the tree order is used */
+	ytree_purge(&db[0]);
+	ytree_order(&db[0], 300);
+	for (i=0; i<1000; ++i)
+		ytree_insert(&db[0], i, ytree_new_int(i));
+	test_assert(ytree_height(&db[0]) == 1);
+
+	for (j=0; j<2; ++j) {
+		ytree_db_close(&db[j]);
+		ytree_env_close(&env[j]);
+	}
+}
+
+TESTCASE(radix) {
+	env_t *env[2] = {NULL, NULL};
+	db_t *db[2] = {NULL, NULL};
+	ytree_stats_t stats;
+	bool agree = true;
+	int i, j, phase;
+
+	for (j=0; j<2; ++j) {
+		ytree_env_init(NULL, &env[j], 0);
+		ytree_db_init(0, &db[j], &env[j]);
+		ytree_order(&db[j], 4);
+	}
+	ytree_radix_table(&db[0], 256);
+
+	/* Write and read phases over dense and sparse keys */
+	srand(5);
+	for (phase=0; phase<8; ++phase) {
+		int span = phase % 2 ? RAND_MAX : 3000;
+
+		for (i=0; i<3000; ++i) {
+			int key = rand() % span - span / 2;
+
+			for (j=0; j<2; ++j) {
+				if (phase % 4 == 3)
+					ytree_delete(&db[j], key);
+				else
+					ytree_insert(&db[j], key, ytree_new_int(key));
+			}
+		}
+
+		for (i=0; i<6000; ++i) {
+			int key = rand() % span - span / 2;
+			record_t *found[2];
+
+			for (j=0; j<2; ++j)
+				found[j] = ytree_find(&db[j], key);
+			if (!same_record(found[0], found[1]))
+				agree = false;
+			free(found[0]);
+			free(found[1]);
+		}
+		test_assert(ytree_count(&db[0]) == ytree_count(&db[1]));
+	}
+	test_assert(agree);
+
+	ytree_stats(&db[0], &stats);
+	test_assert(stats.radix_hits > 0 && stats.radix_rebuilds > 0);
+
+	/* Purged tree is not descended through the table */
+	ytree_purge(&db[0]);
+	test_assert(!ytree_find(&db[0], 1));
+	ytree_insert(&db[0], 1, ytree_new_int(1));
+	test_assert(ytree_find(&db[0], 1));
+
+	for (j=0; j<2; ++j) {
+		ytree_db_close(&db[j]);
+		ytree_env_close(&env[j]);
+	}
+}
+
+TESTCASE(explain) {
+	env_t *env = NULL;
+	db_t *db = NULL;
+	ytree_explain_t explain;
+	ytree_stats_t stats;
+	int i;
+
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &db, &env);
+
+	test_assert(!ytree_explain(&db, 1, &explain));
+	test_assert(explain.levels == 0);
+
+	for (i=0; i<1000; i+=2)
+		ytree_insert(&db, i, ytree_new_int(i));
+	ytree_stats_reset(&db);
+
+	test_assert(ytree_explain(&db, 500, &explain));
+	test_assert(explain.levels == ytree_height(&db) + 1);
+	test_assert(explain.level[explain.levels - 1].leaf);
+	test_assert(!explain.level[0].leaf);
+	test_assert(explain.level[0].comparisons > 0);
+	test_assert(explain.level[0].cache_lines > 0);
+	test_assert(explain.record_bytes == sizeof(enum datatype) + sizeof(int));
+	test_assert(!strcmp(explain.record_source, "file"));
+	test_assert(explain.kernel != NULL);
+
+	test_assert(!ytree_explain(&db, 501, &explain));
+	test_assert(explain.levels == ytree_height(&db) + 1);
+	test_assert(explain.level[explain.levels - 1].index == -1);
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.descents == 0);
+	test_assert(!strcmp(explain.entry, "root"));
+
+	/* Lookups start lower once the radix table is built */
+	ytree_radix_table(&db, 64);
+	test_assert(ytree_explain(&db, 500, &explain));
+	test_assert(!strcmp(explain.entry, "root"));
+	for (i=0; i<1000; ++i)
+		free(ytree_find(&db, i));
+	ytree_stats_reset(&db);
+
+	test_assert(ytree_explain(&db, 500, &explain));
+	test_assert(!strcmp(explain.entry, "radix"));
+	test_assert(explain.levels < ytree_height(&db) + 1);
+	test_assert(explain.level[explain.levels - 1].leaf);
+	test_assert(((node_t *)explain.level[explain.levels - 1].node)->keys[explain.level[explain.levels - 1].index] == 500);
+
+	ytree_stats(&db, &stats);
+	test_assert(stats.radix_hits == 0 && stats.radix_rebuilds == 0);
+
+	ytree_db_close(&db);
+	ytree_env_close(&env);
+}
 
 int main(int agrc, char *argv[]) {
 
@@ -162,6 +1366,26 @@ int main(int agrc, char *argv[]) {
 	CALLTEST(find);
 	CALLTEST(delete);
 	CALLTEST(purge);
+	CALLTEST(purge_step);
+	CALLTEST(purge_release);
+	CALLTEST(incr);
+	CALLTEST(cas);
+	CALLTEST(update);
+	CALLTEST(duplicate);
+	CALLTEST(index);
+	CALLTEST(batch);
+	CALLTEST(memory);
+	CALLTEST(stats);
+	CALLTEST(latency);
+	CALLTEST(trace);
+	CALLTEST(shape);
+	CALLTEST(search);
+	CALLTEST(capture);
+	CALLTEST(explain);
+	CALLTEST(allocator);
+	CALLTEST(front);
+	CALLTEST(small);
+	CALLTEST(radix);
 
 	printf("All tests OK\nReport:\n  Cases:\t%d\n  Assertions:\t%d\n", cases, assertions);
 
@@ -0,0 +1,511 @@
+/*
+ * -----------------------------  ycsb.c  ------------------------------
+ *
+ * Copyright (c) 2016, Yorick de Wid <yorick17 at outlook dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * YCSB style workload driver. Loads the database and runs the
+ * core workloads A to F against the public API from a number of
+ * threads. The tree itself is not thread safe, so all threads
+ * share the database behind a single mutex.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ytree.h"
+#include "bench.h"
+
+#define DATABASENAME "__ycsb.ydb"
+
+#define MAX_THREADS 64
+
+enum ycsb_op {
+	OP_READ,
+	OP_UPDATE,
+	OP_INSERT,
+	OP_SCAN,
+	OP_RMW,
+	OP_MAX,
+};
+
+static const char *op_names[] = {
+	"read",
+	"update",
+	"insert",
+	"scan",
+	"rmw",
+};
+
+/*
+ * Operation mix of a workload in percent,
+ * indexed by enum ycsb_op.
+ */
+struct workload {
+	char name;
+	int mix[OP_MAX];
+	bool latest;			// Request recently inserted keys
+};
+
+static const struct workload workloads[] = {
+	{'a', {50, 50, 0, 0, 0}, false},	// Update heavy
+	{'b', {95, 5, 0, 0, 0}, false},		// Read mostly
+	{'c', {100, 0, 0, 0, 0}, false},	// Read only
+	{'d', {95, 0, 5, 0, 0}, true},		// Read latest
+	{'e', {0, 0, 5, 95, 0}, false},		// Short ranges
+	{'f', {50, 0, 0, 0, 50}, false},	// Read-modify-write
+};
+
+/*
+ * Driver configuration.
+ */
+struct config {
+	const struct workload *workload;
+	int dist;				// Key distribution, -1 for the workload default
+	int records;			// Records loaded before the run
+	int operations;			// Operations in the run phase
+	int warmup;				// Operations before measuring
+	int threads;
+	int record_size;		// Bytes per record
+	int scan_length;		// Maximum records per scan
+	int order;
+	uint64_t seed;
+	const char *capture;	// Capture file or NULL
+	int front;				// Front cache entries, 0 for none
+};
+
+/*
+ * State shared by all threads.
+ */
+struct shared {
+	struct config *config;
+	pthread_mutex_t lock;
+	db_t *db;
+	int key_count;			// Keys 0 to key_count - 1 exist
+	struct bench_zipf zipf;
+};
+
+/*
+ * Per thread state, latencies are
+ * merged after the run.
+ */
+struct worker {
+	pthread_t thread;
+	struct shared *shared;
+	uint64_t state;
+	uint64_t cursor;		// Position of the sequential distributions
+	int operations;
+	int warmup;
+	char *buffer;
+	struct bench_latency latency[OP_MAX];
+};
+
+struct scan_ctx {
+	int remaining;
+};
+
+static bool scan_visit(int key, record_t *record, void *ctx) {
+	struct scan_ctx *scan = (struct scan_ctx *)ctx;
+	return --scan->remaining > 0;
+}
+
+/* Overwrite the record in place, size is unchanged */
+static bool update_field(record_t *record, void *ctx) {
+	struct worker *worker = (struct worker *)ctx;
+
+	if (record->value_type != DT_DATA)
+		return false;
+
+	memcpy(record->value._data, worker->buffer, record->value_size);
+	return true;
+}
+
+static void fill_buffer(struct worker *worker) {
+	int i, size = worker->shared->config->record_size;
+
+	for (i = 0; i < size; ++i)
+		worker->buffer[i] = 'a' + bench_rand(&worker->state) % 26;
+}
+
+/*
+ * Pick an existing key. The zipfian and latest
+ * distributions are computed over the loaded
+ * records, latest counts back from the newest key.
+ */
+static int next_key(struct worker *worker, int dist, bool latest, int key_count) {
+	struct shared *shared = worker->shared;
+	uint64_t rank;
+
+	switch (dist) {
+		case DIST_SEQUENTIAL:
+			return worker->cursor++ % key_count;
+		case DIST_REVERSE:
+			return key_count - 1 - worker->cursor++ % key_count;
+		case DIST_ZIPFIAN:
+			rank = bench_zipf_next(&shared->zipf, &worker->state);
+			if (latest)
+				return rank < (uint64_t)key_count ? key_count - 1 - (int)rank : 0;
+			return (int)bench_scramble(rank, key_count);
+		default:
+			break;
+	}
+
+	return (int)(bench_rand(&worker->state) % key_count);
+}
+
+static enum ycsb_op next_op(struct worker *worker) {
+	const struct workload *workload = worker->shared->config->workload;
+	int roll = bench_rand(&worker->state) % 100;
+	int op;
+
+	for (op = 0; op < OP_MAX; ++op) {
+		if (roll < workload->mix[op])
+			return op;
+		roll -= workload->mix[op];
+	}
+
+	return OP_READ;
+}
+
+static void do_op(struct worker *worker, enum ycsb_op op, bool measure) {
+	struct shared *shared = worker->shared;
+	struct config *config = shared->config;
+	struct scan_ctx scan;
+	record_t *record;
+	uint64_t t;
+	int key;
+
+	/* Without a distribution the workload default applies */
+	int dist = config->dist >= 0 ? config->dist : DIST_ZIPFIAN;
+	bool latest = config->dist < 0 && config->workload->latest;
+
+	if (op == OP_UPDATE || op == OP_INSERT || op == OP_RMW)
+		fill_buffer(worker);
+
+	if (op == OP_SCAN)
+		scan.remaining = 1 + bench_rand(&worker->state) % config->scan_length;
+
+	t = bench_now();
+	pthread_mutex_lock(&shared->lock);
+
+	switch (op) {
+		case OP_READ:
+			key = next_key(worker, dist, latest, shared->key_count);
+			record = ytree_find(&shared->db, key);
+			free(record);
+			break;
+		case OP_UPDATE:
+			key = next_key(worker, dist, latest, shared->key_count);
+			ytree_update(&shared->db, key, update_field, worker);
+			break;
+		case OP_INSERT:
+			key = shared->key_count++;
+			record = ytree_new_data(worker->buffer, config->record_size);
+			ytree_insert(&shared->db, key, record);
+			free(record);
+			break;
+		case OP_SCAN:
+			key = next_key(worker, dist, latest, shared->key_count);
+			ytree_range(&shared->db, key, shared->key_count - 1, scan_visit, &scan);
+			break;
+		case OP_RMW:
+			key = next_key(worker, dist, latest, shared->key_count);
+			record = ytree_find(&shared->db, key);
+			free(record);
+			ytree_update(&shared->db, key, update_field, worker);
+			break;
+		default:
+			break;
+	}
+
+	pthread_mutex_unlock(&shared->lock);
+
+	if (measure)
+		bench_latency_add(&worker->latency[op], bench_now() - t);
+}
+
+static void *worker_run(void *arg) {
+	struct worker *worker = (struct worker *)arg;
+	int i;
+
+	for (i = 0; i < worker->warmup; ++i)
+		do_op(worker, next_op(worker), false);
+
+	for (i = 0; i < worker->operations; ++i)
+		do_op(worker, next_op(worker), true);
+
+	return NULL;
+}
+
+/* Insert the initial records in hashed order */
+static void load(struct shared *shared) {
+	struct config *config = shared->config;
+	struct bench_latency lat;
+	uint64_t state = config->seed;
+	char *buffer = (char *)malloc(config->record_size);
+	int *keys = bench_keys_load(DIST_UNIFORM, config->records, config->seed);
+	int i, j;
+
+	if (!buffer) {
+		perror("Record buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_latency_init(&lat, config->records);
+	lat.start = bench_now();
+
+	for (i = 0; i < config->records; ++i) {
+		for (j = 0; j < config->record_size; ++j)
+			buffer[j] = 'a' + bench_rand(&state) % 26;
+
+		record_t *record = ytree_new_data(buffer, config->record_size);
+
+		uint64_t t = bench_now();
+		ytree_insert(&shared->db, keys[i], record);
+		bench_latency_add(&lat, bench_now() - t);
+
+		free(record);
+	}
+
+	lat.elapsed = bench_now() - lat.start;
+	shared->key_count = config->records;
+
+	printf("  \"load\": ");
+	bench_latency_json(stdout, "insert", &lat);
+	printf(",\n");
+
+	bench_latency_free(&lat);
+	free(keys);
+	free(buffer);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -w <a-f>\tWorkload (default a)\n"
+		"  -d <dist>\tKey distribution: sequential,uniform,zipfian,reverse (default zipfian)\n"
+		"  -n <count>\tRecords to load (default 100000)\n"
+		"  -c <count>\tOperations to run (default 100000)\n"
+		"  -W <count>\tWarm-up operations (default 10000)\n"
+		"  -t <count>\tThreads (default 1)\n"
+		"  -r <bytes>\tRecord size (default 100)\n"
+		"  -l <count>\tMaximum scan length (default 100)\n"
+		"  -o <order>\tTree order (default 32)\n"
+		"  -s <seed>\tRandom seed (default 1)\n"
+		"  -C <file>\tCapture all operations for ytree_replay\n"
+		"  -F <count>\tFront cache entries for hot keys (default none)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	struct config config = {
+		.workload = &workloads[0],
+		.dist = -1,
+		.records = 100000,
+		.operations = 100000,
+		.warmup = 10000,
+		.threads = 1,
+		.record_size = 100,
+		.scan_length = 100,
+		.order = 32,
+		.seed = 1,
+	};
+	struct worker workers[MAX_THREADS];
+	struct shared shared;
+	ytree_stats_t stats;
+	env_t *env = NULL;
+	int opt, i, op;
+	size_t total = 0;
+
+	while ((opt = getopt(argc, argv, "w:d:n:c:W:t:r:l:o:s:C:F:h")) != -1) {
+		switch (opt) {
+			case 'w':
+				if (optarg[0] < 'a' || optarg[0] > 'f' || optarg[1])
+					usage(argv[0]);
+				config.workload = &workloads[optarg[0] - 'a'];
+				break;
+			case 'd':
+				config.dist = bench_dist_parse(optarg);
+				if (config.dist < 0)
+					usage(argv[0]);
+				break;
+			case 'n':
+				config.records = atoi(optarg);
+				break;
+			case 'c':
+				config.operations = atoi(optarg);
+				break;
+			case 'W':
+				config.warmup = atoi(optarg);
+				break;
+			case 't':
+				config.threads = atoi(optarg);
+				break;
+			case 'r':
+				config.record_size = atoi(optarg);
+				break;
+			case 'l':
+				config.scan_length = atoi(optarg);
+				break;
+			case 'o':
+				config.order = atoi(optarg);
+				break;
+			case 's':
+				config.seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'C':
+				config.capture = optarg;
+				break;
+			case 'F':
+				config.front = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (config.records < 1 || config.operations < 0 || config.warmup < 0
+		|| config.threads < 1 || config.threads > MAX_THREADS
+		|| config.record_size < 1 || config.scan_length < 1
+		|| config.order < 3 || config.order > 100 || config.front < 0)
+		usage(argv[0]);
+
+	memset(&shared, 0, sizeof(struct shared));
+	shared.config = &config;
+	pthread_mutex_init(&shared.lock, NULL);
+	bench_zipf_init(&shared.zipf, config.records, 0.99);
+
+	unlink(DATABASENAME);
+	ytree_env_init(DATABASENAME, &env, 0);
+	ytree_db_init(0, &shared.db, &env);
+	ytree_order(&shared.db, config.order);
+	ytree_front_cache(&shared.db, config.front);
+
+	if (config.capture && !ytree_capture_start(&env, config.capture)) {
+		perror("Capture");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("{\"workload\": \"%c\", \"distribution\": \"%s\", \"records\": %d, \"operations\": %d, "
+		"\"threads\": %d, \"record_size\": %d, \"order\": %d, \"front\": %d,\n",
+		config.workload->name,
+		config.dist >= 0 ? bench_dist_names[config.dist] : (config.workload->latest ? "latest" : "zipfian"),
+		config.records, config.operations, config.threads, config.record_size, config.order, config.front);
+
+	load(&shared);
+
+	ytree_stats(&shared.db, &stats);
+	printf("  \"load_io\": ");
+	bench_io_json(stdout, &stats);
+	printf(",\n");
+	ytree_stats_reset(&shared.db);
+
+	/* Run phase, operations are split over the threads */
+	for (i = 0; i < config.threads; ++i) {
+		struct worker *worker = &workers[i];
+
+		memset(worker, 0, sizeof(struct worker));
+		worker->shared = &shared;
+		worker->state = config.seed * 0x9E3779B97F4A7C15ull + i + 1;
+		worker->operations = config.operations / config.threads + (i < config.operations % config.threads);
+		worker->warmup = config.warmup / config.threads;
+		worker->buffer = (char *)malloc(config.record_size);
+		if (!worker->buffer) {
+			perror("Record buffer");
+			exit(EXIT_FAILURE);
+		}
+
+		for (op = 0; op < OP_MAX; ++op)
+			bench_latency_init(&worker->latency[op], 0);
+	}
+
+	uint64_t start = bench_now();
+
+	for (i = 0; i < config.threads; ++i)
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+
+	for (i = 0; i < config.threads; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	uint64_t elapsed = bench_now() - start;
+
+	/* Merge the latencies per operation */
+	printf("  \"run\": [\n");
+	for (op = 0; op < OP_MAX; ++op) {
+		struct bench_latency merged;
+
+		if (!config.workload->mix[op])
+			continue;
+
+		bench_latency_init(&merged, 0);
+		for (i = 0; i < config.threads; ++i) {
+			size_t j;
+			for (j = 0; j < workers[i].latency[op].count; ++j)
+				bench_latency_add(&merged, workers[i].latency[op].samples[j]);
+		}
+
+		merged.elapsed = elapsed;
+		total += merged.count;
+
+		printf("    ");
+		bench_latency_json(stdout, op_names[op], &merged);
+		bench_latency_free(&merged);
+
+		int next;
+		for (next = op + 1; next < OP_MAX && !config.workload->mix[next]; ++next);
+		printf(next < OP_MAX ? ",\n" : "\n");
+	}
+
+	ytree_stats(&shared.db, &stats);
+	printf("  ], \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"key_count\": %d,\n  \"io\": ",
+		elapsed / 1e9, elapsed ? total / (elapsed / 1e9) : 0.0, shared.key_count);
+	bench_io_json(stdout, &stats);
+	printf(",\n  \"front_hits\": %llu, \"front_misses\": %llu, \"front_evictions\": %llu}\n",
+		(unsigned long long)stats.front_hits, (unsigned long long)stats.front_misses,
+		(unsigned long long)stats.front_evictions);
+
+	for (i = 0; i < config.threads; ++i) {
+		for (op = 0; op < OP_MAX; ++op)
+			bench_latency_free(&workers[i].latency[op]);
+		free(workers[i].buffer);
+	}
+
+	if (config.capture && !ytree_capture_stop(&env)) {
+		perror("Capture");
+		exit(EXIT_FAILURE);
+	}
+
+	ytree_db_close(&shared.db);
+	ytree_env_close(&env);
+	unlink(DATABASENAME);
+	pthread_mutex_destroy(&shared.lock);
+
+	return 0;
+}
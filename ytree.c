@@ -49,11 +49,24 @@
  * - Persistent extension
  */
 
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#endif
 #include "ytree.h"
 
 /* Algorithm version */
@@ -75,6 +88,43 @@
 #define MIN_ORDER 3
 #define MAX_ORDER 100
 
+/* Assumed cache line size for the explain output */
+#define CACHE_LINE 64
+
+/*
+ * Largest orders searched with a vector scan,
+ * or with the plain scan when the CPU has none.
+ */
+#define SEARCH_SIMD_ORDER	256
+#define SEARCH_LINEAR_ORDER	16
+
+/*
+ * Orders a small database leaf grows through,
+ * doubling from the first to the last, and the
+ * number of keys at which a tree is turned
+ * back into a single leaf.
+ */
+#define SMALL_MIN_ORDER		16
+#define SMALL_MAX_ORDER		SEARCH_SIMD_ORDER
+#define SMALL_DEMOTE_KEYS	(SMALL_MAX_ORDER / 4)
+
+/*
+ * Number of nodes reclaimed per step by the
+ * background purge, and the number of objects
+ * handed to the release hooks at once.
+ */
+#define PURGE_BUDGET	256
+#define RELEASE_BATCH	64
+
+/*
+ * A duplicated key keeps the offsets of its
+ * values in a posting list. Up to POSTING_INLINE
+ * offsets are stored as is, larger lists are a
+ * chain of blocks holding varint encoded deltas.
+ */
+#define POSTING_INLINE	8
+#define POSTING_BLOCK	120
+
 /* 
  * Database index algorithm.
  */
@@ -105,6 +155,41 @@ struct schema {
 	uint16_t order;							// Tree order (B+Tree only)
 };
 
+/*
+ * Block of delta compressed offsets. The
+ * offsets in a posting list are kept sorted
+ * so the deltas are small and positive.
+ */
+struct posting_block {
+	struct posting_block *next;				// Next block in the chain
+	uint32_t first;							// First offset in the block
+	uint16_t count;							// Number of offsets in the block
+	uint16_t size;							// Bytes used in deltas
+	uint8_t deltas[POSTING_BLOCK];			// Varint encoded deltas
+};
+
+/*
+ * Values of a duplicated key. The leaf stores
+ * the posting list in the record pointer and
+ * the lowest offset in the offset pointer.
+ */
+struct posting {
+	uint32_t count;							// Number of values
+	uint32_t offsets[POSTING_INLINE];		// Sorted offsets while small
+	struct posting_block *head;				// Block chain when large
+};
+
+/*
+ * Position in a posting list.
+ */
+struct posting_cursor {
+	struct posting *posting;				// List being walked
+	struct posting_block *block;			// Current block or NULL if inline
+	uint32_t index;							// Index in list or block
+	uint32_t pos;							// Byte position in block
+	uint32_t value;							// Last returned offset
+};
+
 /*
  * Database environment.
  * Storage only.
@@ -134,12 +219,11 @@ void (*release_callback)(void *) = NULL;
  * ********************************/
 
 /* Helpers */
-static int path_to_root(node_t *root, node_t *child);
-static node_t *find_leaf(node_t *root, int key);
+static node_t *find_leaf(db_t **db, int key);
+static node_t *find_leaf_bounded(db_t **db, int key, int *upper, bool *bounded);
 
 /* Search */
 static record_t *ytree_get(db_t **db, int key);// pub
-static int find_range(db_t **db, int key_start, int key_end, int *returned_keys, void *returned_pointers[]); 
 
 /* Insertion */
 static node_t *make_node_raw(db_t **db, bool is_leaf);
@@ -151,17 +235,44 @@ static void insert_into_node_after_splitting(db_t **db, node_t * parent, int lef
 static void insert_into_parent(db_t **db, node_t * left, int key, node_t * right);
 static void insert_into_new_root(db_t **db, node_t * left, int key, node_t * right);
 static void start_new_tree(db_t **db, int key, uint32_t offset);
+static void insert_record(db_t **db, int key, record_t *pointer);
 
 /* Deletion */
+static void free_node(env_t *env, node_t *node);
 static node_t *adjust_root(db_t **db);
 static node_t *coalesce_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime);
 static node_t *redistribute_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime_index, int k_prime);
 static node_t *delete_entry(db_t **db, node_t *n, int key, void *pointer);
+static bool delete_value(db_t **db, int key, record_t *value);
+
+/* Small databases */
+static void small_reset(db_t **db);
+static node_t *small_grow(db_t **db, int key);
+static void small_shrink(db_t **db);
 
 uint32_t db_write_record(db_t **db, record_t *record);
+static void db_rewrite_record(db_t **db, uint32_t offset, record_t *record);
+static size_t record_disk_size(record_t *record);
+static void env_write_record(env_t *env, uint32_t offset, record_t *record);
 record_t *db_read_record(db_t **db, uint32_t offset);
+static record_t *env_read_record(env_t *env, uint32_t offset);
+static record_t *alloc_record(env_t *env, size_t size);
+static size_t record_alloc_size(record_t *record);
+static void env_free_record(env_t *env, record_t *record);
+static void env_alloc_page(env_t *env, unsigned int n);
+static uint32_t env_reserve(env_t *env, size_t size);
+static size_t record_serialize(record_t *record, uint8_t *out);
+static bool env_sync(env_t *env);
+static bool env_pwrite(env_t *env, uint32_t offset, const void *buffer, size_t size);
+static bool env_pread(env_t *env, uint32_t offset, void *buffer, size_t size);
+static size_t env_size(env_t *env);
+#ifndef _WIN32
+static record_t *db_pread_record(env_t *env, int fd, uint32_t offset);
+#endif
 
+static bool find_slot(db_t **db, int key, node_t **leaf, int *index);
 static uint32_t find_value(db_t **db, int key);
+static unsigned int front_entries(db_t **db);
 
 /* ********************************
  * HELPERS
@@ -179,1290 +290,4619 @@ static int cut(int length) {
 		return length/2 + 1;
 }
 
-static bool file_exist(const char *filename) {
-    struct stat st;
-    return stat(filename, &st) == 0;
-}
-
-/* ********************************
- * OUTPUT [DEBUG ONLY]
- * ********************************/
-
-#ifdef DEBUG
-
 /*
- * Prints the bottom row of keys
- * of the tree (with their respective
- * pointers, if the verbose_output flag is set.
+ * FIFO of nodes linked through node->next,
+ * used to walk the tree in level order.
  */
-void ytree_print_leaves(db_t **db) {
-	int i;
-	node_t *c = (*db)->root;
-	if (!(*db)->root) {
-		printf("Empty tree.\n");
-		return;
-	}
-
-	/* Find leftmost leave */
-	while (!c->is_leaf)
-		c = c->pointers[0];
+struct node_queue {
+	node_t *head;
+	node_t *tail;
+};
 
-	while (true) {
-		for (i = 0; i < c->num_keys; ++i) {
-			if (verbose_output)
-				printf("%x ", (unsigned int)(uintptr_t)c->pointers[i]);
-			printf("%d ", c->keys[i]);
-		}
-		if (verbose_output)
-			printf("%x ", (unsigned int)(uintptr_t)c->pointers[(*db)->order - 1]);
-		if (c->pointers[(*db)->order - 1] != NULL) {
-			printf(" | ");
-			c = c->pointers[(*db)->order - 1];
-		} else
-			break;
-	}
+static void queue_init(struct node_queue *queue) {
+	queue->head = NULL;
+	queue->tail = NULL;
+}
 
-	printf("\n");
+static void enqueue(struct node_queue *queue, node_t *node) {
+	node->next = NULL;
+	if (queue->tail)
+		queue->tail->next = node;
+	else
+		queue->head = node;
+	queue->tail = node;
 }
 
-/*
- * Find the datatype in the record
- * and print the corresponding
- * value to screen
- */
-void ytree_print_value(record_t *record) {
-	switch (record->value_type) {
-		case DT_CHAR:
-			printf("%c\n", record->value._char);
-			break;
-		case DT_INT:
-			printf("%d\n", record->value._int);
-			break;
-		case DT_FLOAT:
-			printf("%f\n", record->value._float);
-			break;
-		case DT_DATA:
-			printf("%p\n", record->value._data);
-			break;
-	}
+static node_t *dequeue(struct node_queue *queue) {
+	node_t *n = queue->head;
+	queue->head = n->next;
+	if (!queue->head)
+		queue->tail = NULL;
+	n->next = NULL;
+	return n;
 }
 
-/* The queue is used to print the tree in
- * level order, starting from the root
- * printing each entire rank on a separate
- * line, finishing with the leaves.
- */
-static void enqueue(node_t **queue, node_t *new_node) {
-	node_t *c;
-	if (!*queue) {
-		*queue = new_node;
-		(*queue)->next = NULL;
-	} else {
-		c = *queue;
-		while (c->next != NULL) {
-			c = c->next;
-		}
-		c->next = new_node;
-		new_node->next = NULL;
-	}
+/* Monotonic time in nanoseconds */
+static uint64_t clock_ns(void) {
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000ull / CLOCKS_PER_SEC);
+#endif
 }
 
 /*
- * Helper function for printing the
- * tree. See print_tree.
+ * Zeroed memory from the allocator of the
+ * environment, or from calloc without one.
  */
-static node_t *dequeue(node_t **queue) {
-	node_t *n = *queue;
-	*queue = (*queue)->next;
-	n->next = NULL;
-	return n;
+static void *env_alloc(env_t *env, size_t size) {
+	void *ptr;
+
+	if (!env->allocator.alloc)
+		return calloc(1, size);
+
+	ptr = env->allocator.alloc(size, env->allocator.ctx);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
 }
 
 /*
- * Prints the B+Tree in the command
- * line in level (rank) order, with the 
- * keys in each node and the '|' symbol
- * to separate nodes.
- * With the verbose_output flag set.
- * the values of the pointers corresponding
- * to the keys also appear next to their respective
- * keys, in hexadecimal notation.
+ * Memory starting on a cache line, if the
+ * allocator can provide it. Without an aligned
+ * hook this is a plain allocation.
  */
-void ytree_print_tree(db_t **db) {
-	int i = 0;
-	int rank = 0;
-	int new_rank = 0;
-
-	if (!(*db)->root) {
-		printf("Empty tree\n");
-		return;
-	}
+static void *env_alloc_aligned(env_t *env, size_t size) {
+	void *ptr;
 
-	node_t *queue = NULL;
-	enqueue(&queue, (*db)->root);
-	while (queue) {
-		node_t *n = dequeue(&queue);
-		if (n->parent != NULL && n == n->parent->pointers[0]) {
-			new_rank = path_to_root((*db)->root, n);
-			if (new_rank != rank) {
-				rank = new_rank;
-				printf("\n");
-			}
-		}
-		// if (verbose_output) 
-		// 	printf("(%x)", (unsigned int)(uintptr_t)n);
-		for (i = 0; i < n->num_keys; i++) {
-			// if (verbose_output)
-			// 	printf("%x ", (unsigned int)(uintptr_t)n->pointers[i]);
-			printf("%d ", n->keys[i]);
-		}
+	if (!env->allocator.alloc_aligned)
+		return env_alloc(env, size);
 
-		if (!n->is_leaf)
-			for (i = 0; i <= n->num_keys; i++)
-				enqueue(&queue, n->pointers[i]);
-		// if (verbose_output) {
-		// 	if (n->is_leaf) 
-		// 		printf("%x ", (unsigned int)(uintptr_t)n->pointers[4 - 1]);
-		// 	else
-		// 		printf("%x ", (unsigned int)(uintptr_t)n->pointers[n->num_keys]);
-		// }
-		printf("| ");
-	}
-	printf("\n");
+	size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	ptr = env->allocator.alloc_aligned(CACHE_LINE, size, env->allocator.ctx);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
 }
 
-/* public?
- * Finds the record under a given key and prints an
- * appropriate message to stdout.
+/*
+ * Release memory of the given size, which
+ * must be the size it was allocated with.
  */
-void find_and_print(db_t **db, int key, bool verbose) {
-	record_t *record = ytree_get(db, key);
-	if (!record) {
-		printf("Key: %d  Record: NULL\n", key);
+static void env_free(env_t *env, void *ptr, size_t size) {
+	if (!ptr)
 		return;
-	}
 
-	printf("Key: %d  Record: ", key);
-	ytree_print_value(record);
+	if (!env->allocator.alloc)
+		free(ptr);
+	else if (env->allocator.release_sized)
+		env->allocator.release_sized(ptr, size, env->allocator.ctx);
+	else
+		env->allocator.release(ptr, env->allocator.ctx);
 }
 
-/* public?
- * Finds and prints the keys, pointers, and values within a range
- * of keys between key_start and key_end, including both bounds.
- */
-void find_and_print_range(db_t **db, int key_start, int key_end, bool verbose) {
-	int i;
-	int array_size = key_end - key_start + 1;
-	int *returned_keys = (int *)malloc(array_size);
-	void **returned_pointers = malloc(array_size);
-	int num_found = find_range(db, key_start, key_end, returned_keys, returned_pointers);
-	if (num_found) {
-		for (i = 0; i < num_found; i++) {
-			printf("Key: %d  Record: ", returned_keys[i]);
-			ytree_print_value((record_t *)returned_pointers[i]);
-		}
-	} else {
-		printf("None found\n");
-	}
-
-	free(returned_keys);
+static void env_free_aligned(env_t *env, void *ptr, size_t size) {
+	if (env->allocator.alloc_aligned)
+		size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+	env_free(env, ptr, size);
 }
 
-#endif // DEBUG
-
 /*
- * Utility function to give the height
- * of the tree, which length in number of edges
- * of the path from the root to any leaf.
+ * Grow or shrink an allocation. The allocator
+ * has no resize, so a new block is copied.
+ * Memory past the old size is not zeroed.
  */
-int ytree_height(db_t **db) {
-	int h = 0;
+static void *env_realloc(env_t *env, void *ptr, size_t old_size, size_t size) {
+	void *grown;
 
-	if (!(*db)->root) {
-		return 0;
-	}
+	if (!env->allocator.alloc)
+		return realloc(ptr, size);
 
-	node_t *c = (*db)->root;
-	while (!c->is_leaf) {
-		c = c->pointers[0];
-		h++;
+	grown = env->allocator.alloc(size, env->allocator.ctx);
+	if (grown && ptr) {
+		memcpy(grown, ptr, old_size < size ? old_size : size);
+		env_free(env, ptr, old_size);
 	}
+	return grown;
+}
 
-	return h;
+static bool file_exist(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0;
 }
 
-/* Return number of keys */
-int ytree_count(db_t **db) {
-	int count = 0;
-	node_t *c = (*db)->root;
-	if (!(*db)->root)
-		return count;
+/* ********************************
+ * SEARCH KERNELS
+ * ********************************/
 
-	/* Find leftmost leave */
-	while (!c->is_leaf)
-		c = c->pointers[0];
+static int search_linear(const int *keys, int n, int key) {
+	int i = 0;
+	while (i < n && key >= keys[i])
+		++i;
+	return i;
+}
 
-	while (true) {
-		count += c->num_keys;
-		if (c->pointers[(*db)->order - 1] != NULL)
-			c = c->pointers[(*db)->order - 1];
+static int search_binary(const int *keys, int n, int key) {
+	int low = 0, high = n;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (key >= keys[mid])
+			low = mid + 1;
 		else
-			break;
+			high = mid;
 	}
-
-	return count;
+	return low;
 }
 
 /*
- * Database version number
- * returned as string.
+ * Binary search without a data dependent branch,
+ * the step is taken with a conditional move.
  */
-const char *ytree_version() {
-	return VERSION;
-}
+static int search_branchless(const int *keys, int n, int key) {
+	const int *base = keys;
 
-/* TODO: check index type == btree
- * Set B+Tree order, this is only valid for
- * a B+Tree structure, and is otherwise ignored.
- * Order can only be set if the tree is empty.
- * The order determines the maximum and minimum
- * number of entries (keys and pointers) in any
- * node.  Every node has at most order - 1 keys and
- * at least (roughly speaking) half that number.
- * Every leaf has as many pointers to data as keys,
- * and every internal node has one more pointer
- * to a subtree than the number of keys.
- * This global variable is initialized to the
- * default value.
- */
-void ytree_order(db_t **db, unsigned int order) {
-	if (!(*db)->root) {
-		(*db)->order = order;
-	}
-}
+	if (!n)
+		return 0;
 
-/*
- * Utility function to give the length in edges
- * of the path from any node to the root.
- */
-static int path_to_root(node_t *root, node_t *child) {
-	int length = 0;
-	node_t *c = child;
-	while (c != root) {
-		c = c->parent;
-		length++;
+	while (n > 1) {
+		int half = n / 2;
+		base = (base[half - 1] <= key) ? base + half : base;
+		n -= half;
 	}
-	return length;
+	return (int)(base - keys) + (*base <= key);
 }
 
+#ifdef CPU_DISPATCH
 /*
- * Finds keys and their pointers, if present, in the range specified
- * by key_start and key_end, inclusive. Places these in the arrays
- * returned_keys and returned_pointers, and returns the number of
- * entries found.
+ * Linear scan comparing four keys at a time.
+ * The keys are sorted, so the first lane that
+ * holds a greater key is the child index.
  */
-static int find_range(db_t **db, int key_start, int key_end, int *returned_keys, void **returned_pointers) {
-	int i, num_found = 0;
-	node_t *n = find_leaf((*db)->root, key_start);
-	if (!n)
-		return 0;
-
-	assert(returned_keys);
-	assert(returned_pointers);
-
-	for (i = 0; i < n->num_keys && n->keys[i] < key_start; ++i);
-	if (i == n->num_keys)
-		return 0;
+__attribute__((target("sse2")))
+static int search_simd(const int *keys, int n, int key) {
+	__m128i needle = _mm_set1_epi32(key);
+	int i = 0;
 
-	while (n != NULL) {
-		for (; i < n->num_keys && n->keys[i] <= key_end; ++i) {
-			returned_keys[num_found] = n->keys[i];
-			returned_pointers[num_found] = n->pointers[i];
-			num_found++;
-		}
-		n = n->pointers[(*db)->order - 1];
-		i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(keys + i));
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, needle)));
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
 
-	return num_found;
+	while (i < n && key >= keys[i])
+		++i;
+
+	return i;
 }
 
-/* TODO: remove prints
- * Traces the path from the root to a leaf, searching
- * by key. Displays information about the path
- * if the verbose flag is set.
- * Returns the leaf containing the given key.
- */
-static node_t *find_leaf(node_t *root, int key) {
+/* Same scan, eight keys at a time */
+__attribute__((target("avx2")))
+static int search_avx2(const int *keys, int n, int key) {
+	__m256i needle = _mm256_set1_epi32(key);
 	int i = 0;
-	node_t *c = root;
-	if (!c)
-		return NULL;
-
-	while (!c->is_leaf) {
-		// if (verbose) {
-		// 	printf("[");
-		// 	for (i = 0; i < c->num_keys - 1; ++i)
-		// 		printf("%d ", c->keys[i]);
-		// 	printf("%d] ", c->keys[i]);
-		// }
-
-		i = 0;
-		while (i < c->num_keys) {
-			if (key >= c->keys[i])
-				++i;
-			else
-				break;
-		}
-		
-		// if (verbose)
-		// 	printf("%d ->\n", i);
 
-		c = (node_t *)c->pointers[i];
+	for (; i + 8 <= n; i += 8) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)(keys + i));
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(block, needle)));
+		if (mask)
+			return i + __builtin_ctz(mask);
 	}
 
-	// if (verbose) {
-	// 	printf("Leaf [");
-	// 	for (i = 0; i < c->num_keys - 1; i++)
-	// 		printf("%d ", c->keys[i]);
-	// 	printf("%d] ->\n", c->keys[i]);
-	// }
+	while (i < n && key >= keys[i])
+		++i;
 
-	return c;
+	return i;
 }
 
-/* TODO: to be removed
- * Finds and returns the record to which
- * a key refers.
+/*
+ * Sixteen keys at a time. The tail is read with
+ * a masked load, lanes past the end never match.
  */
-record_t *ytree_find(db_t **db, int key) {
+__attribute__((target("avx512f")))
+static int search_avx512(const int *keys, int n, int key) {
+	__m512i needle = _mm512_set1_epi32(key);
 	int i = 0;
-	node_t *c = find_leaf((*db)->root, key);
-	if (!c)
-		return NULL;
 
-	for (i = 0; i < c->num_keys; ++i)
-		if (c->keys[i] == key)
-			break;
+	for (; i < n; i += 16) {
+		__mmask16 valid = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+		__m512i block = _mm512_maskz_loadu_epi32(valid, keys + i);
+		unsigned int mask = _mm512_mask_cmpgt_epi32_mask(valid, block, needle);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
 
-	if (i == c->num_keys) 
-		return NULL;
-	
-	return (record_t *)c->pointers[i];
+	return n;
 }
+#else
+/* Never selected, the CPU level stays scalar */
+#define search_simd search_linear
+#define search_avx2 search_linear
+#define search_avx512 search_linear
+#endif
 
-/* TODO: rename, read recod
- * Finds and returns the record to which
- * a key refers.
- */
-static uint32_t find_value(db_t **db, int key) {
-	int i = 0;
-	node_t *c = find_leaf((*db)->root, key);
-	if (!c)
-		return 0;
+static const search_fn search_kernels[SEARCH_MAX] = {
+	search_linear,
+	search_binary,
+	search_branchless,
+	search_simd,
+	search_avx2,
+	search_avx512,
+};
 
-	for (i = 0; i < c->num_keys; ++i)
-		if (c->keys[i] == key)
-			break;
+static const char *search_names[SEARCH_MAX] = {
+	"linear",
+	"binary",
+	"branchless",
+	"simd",
+	"avx2",
+	"avx512",
+};
 
-	if (i == c->num_keys) 
-		return 0;
-	
-	return c->_pointers[i];
+/* Instruction set a kernel needs */
+static const enum cpu_level search_levels[SEARCH_MAX] = {
+	CPU_SCALAR,
+	CPU_SCALAR,
+	CPU_SCALAR,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_AVX512,
+};
+
+static const char *cpu_names[CPU_MAX] = {
+	"scalar",
+	"sse2",
+	"avx2",
+	"avx512",
+};
+
+/* Level in use, CPU_MAX until detected */
+static enum cpu_level cpu_level = CPU_MAX;
+
+/* Highest level the processor and the OS support */
+static enum cpu_level cpu_supported(void) {
+#ifdef CPU_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return CPU_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return CPU_SSE2;
+#endif
+	return CPU_SCALAR;
 }
 
 /*
- *
+ * Detect the level once. YTREE_CPU in the
+ * environment names a lower level to use.
  */
-record_t *ytree_get(db_t **db, int key) {
-	/*
-	 * XXX
-	 */
-	uint32_t offset = find_value(db, key);
-	if (!offset) {
-		return NULL;
+static enum cpu_level cpu_current(void) {
+	if (cpu_level == CPU_MAX) {
+		enum cpu_level level = cpu_supported();
+		const char *force = getenv("YTREE_CPU");
+		int i;
+
+		if (force) {
+			for (i = 0; i < CPU_MAX; ++i)
+				if (!strcmp(force, cpu_names[i]) && i < level)
+					level = i;
+		}
+
+		cpu_level = level;
 	}
 
-	/*
-	 * Read record from page.
-	 */
-	return db_read_record(db, offset);
+	return cpu_level;
 }
 
-/* ********************************
- * INSERTION
- * ********************************/
+enum cpu_level ytree_cpu_level() {
+	return cpu_current();
+}
 
-/* 
- * Creates a new record to hold the value
- * to which a key refers.
+/*
+ * Use a lower instruction set level, or return to
+ * the highest supported one. Databases bind their
+ * kernel when created or when the order changes.
  */
-record_t *make_record(enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize) {
-	record_t *new_record = (record_t *)calloc(1, sizeof(record_t));
-	if (!new_record) {
-		perror("Record creation");
-		exit(EXIT_FAILURE);
-	} else {
-		switch (type) {
-			case DT_CHAR:
-				new_record->value._char = c_value;
-				break;
-			case DT_INT:
-				new_record->value._int = i_value;
-				break;
-			case DT_FLOAT:
-				new_record->value._float = f_value;
-				break;
-			case DT_DATA:
-				new_record->value._data = p_value;
-				break;
-		}
-		new_record->value_type = type;
-		new_record->value_size = vsize;
-	}
+enum cpu_level ytree_cpu_set(enum cpu_level level) {
+	enum cpu_level supported = cpu_supported();
 
-	return new_record;
+	cpu_level = level < supported ? level : supported;
+	return cpu_level;
 }
 
-/*
- * Create a new record using valuepair. This 
- * is compatible with other databases.
- */
-record_t *ytree_new_record(valuepair_t *pair) {
-	return make_record(DT_DATA, 0, 0, 0, pair->data, pair->size);
+const char *ytree_cpu_name(enum cpu_level level) {
+	assert(level < CPU_MAX);
+	return cpu_names[level];
 }
 
-/* TODO */
-int ytree_record_size(record_t *record) {
-	switch (record->value_type) {
-		case DT_CHAR:
-			return sizeof(char);
-		case DT_INT:
-			return sizeof(int);
-		case DT_FLOAT:
-			return sizeof(float);
-		case DT_DATA:
-			return record->value_size;
-	}
+/* Kernel function, or NULL if the CPU level lacks it */
+search_fn ytree_search_kernel(enum search_kernel kernel) {
+	assert(kernel < SEARCH_MAX);
+	if (search_levels[kernel] > cpu_current())
+		return NULL;
 
-	return 0;
+	return search_kernels[kernel];
+}
+
+const char *ytree_search_name(enum search_kernel kernel) {
+	assert(kernel < SEARCH_MAX);
+	return search_names[kernel];
 }
 
 /*
- * Creates a new general node, which can be adapted
- * to serve as either a leaf or an internal node.
+ * Kernel used for nodes of the given order, as
+ * measured by searchbench. The widest vector scan
+ * the CPU level allows wins on all but page sized
+ * nodes. Without one the plain scan wins on small
+ * nodes, and binary search once a node spans more
+ * than a few cache lines.
  */
-static node_t *make_node_raw(db_t **db, bool is_leaf) {
-	node_t *new_node = (node_t *)calloc(1, sizeof(node_t));
-	if (!new_node) {
-		perror("Node creation.");
-		exit(EXIT_FAILURE);
+enum search_kernel ytree_search_select(int order) {
+	enum cpu_level level = cpu_current();
+
+	if (order <= SEARCH_SIMD_ORDER) {
+		if (level >= CPU_AVX512)
+			return SEARCH_AVX512;
+		if (level >= CPU_AVX2)
+			return SEARCH_AVX2;
+		if (level >= CPU_SSE2)
+			return SEARCH_SIMD;
 	}
+	if (order <= SEARCH_LINEAR_ORDER)
+		return SEARCH_LINEAR;
 
-	new_node->keys = calloc(((*db)->order - 1), sizeof(int));
-	if (!new_node->keys) {
-		perror("New node keys array.");
-		exit(EXIT_FAILURE);
-	}
+	return SEARCH_BRANCHLESS;
+}
 
-	/* TODO remove */
-	new_node->pointers = calloc((*db)->order, sizeof(void *));
-	if (!new_node->pointers) {
-		perror("New node pointers array.");
-		exit(EXIT_FAILURE);
-	}
+/*
+ * Keys examined by a search that returned
+ * index i, for the operation counters.
+ */
+static int search_cost(db_t **db, int n, int i) {
+	int probes = 0;
 
-	new_node->_pointers = calloc((*db)->order, sizeof(uint32_t));
-	if (!new_node->_pointers) {
-		perror("New node pointers array.");
-		exit(EXIT_FAILURE);
+	if ((*db)->search == search_binary || (*db)->search == search_branchless) {
+		while (n) {
+			n >>= 1;
+			probes++;
+		}
+		return probes;
 	}
 
-	new_node->is_leaf = is_leaf;
-	new_node->num_keys = 0;
-	new_node->parent = NULL;
-	new_node->next = NULL;
-	return new_node;
+	return i < n ? i + 1 : i;
 }
 
-/* 
- * Creates a new leaf by creating a node
- * and then adapting it appropriately.
- */
-#define make_leaf(d) make_node_raw(d,true)
-#define make_node(d) make_node_raw(d,false)
+/* ********************************
+ * TRACING
+ * ********************************/
 
-/* Helper function used in insert_into_parent
- * to find the index of the parent's pointer to 
- * the node to the left of the key to be inserted.
+#ifdef YTREE_TRACE
+static void trace_emit(env_t *env, enum trace_type type, int schema_id, int key, uint32_t offset, size_t size) {
+	trace_event_t event;
+
+	event.type = type;
+	event.schema_id = schema_id;
+	event.key = key;
+	event.offset = offset;
+	event.size = (uint32_t)size;
+
+	env->trace(&event, env->trace_ctx);
+}
+
+#define TRACE_DB(db, type, key) \
+	do { if ((*db)->env->trace) trace_emit((*db)->env, type, (*db)->schema_id, key, 0, 0); } while (0)
+#define TRACE_IO(env, type, offset, size) \
+	do { if ((env)->trace) trace_emit(env, type, -1, 0, offset, size); } while (0)
+#else
+#define TRACE_DB(db, type, key) ((void)0)
+#define TRACE_IO(env, type, offset, size) ((void)0)
+#endif
+
+/*
+ * Register the trace hook of the environment,
+ * NULL removes it. Without YTREE_TRACE no
+ * events are emitted.
  */
-static int get_left_index(node_t *parent, node_t *left) {
-	int left_index = 0;
-	while (left_index <= parent->num_keys && parent->pointers[left_index] != left)
-		left_index++;
+void ytree_trace(env_t **env, hook_trace fn, void *ctx) {
+	(*env)->trace = fn;
+	(*env)->trace_ctx = ctx;
+}
 
-	return left_index;
+/* ********************************
+ * LATENCY
+ * ********************************/
+
+/*
+ * Current time in ticks. On x86 this is the
+ * time stamp counter, elsewhere nanoseconds.
+ */
+static inline uint64_t latency_now(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+#elif !defined(_WIN32)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000ull / CLOCKS_PER_SEC);
+#endif
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static double tick_ns;
+#endif
+
 /*
- * Inserts a new pointer to a record and its corresponding
- * key into a leaf.
- * Returns the altered leaf.
+ * Measure the time stamp counter against the
+ * monotonic clock over 10ms, once per process.
+ * Called when timing is first enabled, so no
+ * reader of a histogram waits for it.
  */
-static void insert_into_leaf(node_t *leaf, int key, uint32_t offset) {
-	int i, insertion_point;
+static void latency_calibrate(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	uint64_t anchor, anchor_ns, ns;
 
-	insertion_point = 0;
-	while (insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key)
-		insertion_point++;
+	if (tick_ns)
+		return;
 
-	for (i = leaf->num_keys; i > insertion_point; i--) {
-		leaf->keys[i] = leaf->keys[i - 1];
-		leaf->pointers[i] = leaf->pointers[i - 1];
-		leaf->_pointers[i] = leaf->_pointers[i - 1];
-	}
+	anchor = latency_now();
+	anchor_ns = clock_ns();
+	while ((ns = clock_ns()) - anchor_ns < 10000000ull);
 
-	leaf->keys[insertion_point] = key;
-	leaf->pointers[insertion_point] = 0;
-	leaf->_pointers[insertion_point] = offset;
-	leaf->num_keys++;
+	tick_ns = (double)(ns - anchor_ns) / (double)(latency_now() - anchor);
+#endif
 }
 
-/* 
- * Inserts a new key and pointer
- * to a new record into a leaf so as to exceed
- * the tree's order, causing the leaf to be split
- * in half.
- */
-static void insert_into_leaf_after_splitting(db_t **db, node_t *leaf, int key, uint32_t offset) {
-	node_t *new_leaf = make_leaf(db);
+/* Nanoseconds per tick */
+static double latency_tick_ns(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return tick_ns ? tick_ns : 1.0;
+#else
+	return 1.0;
+#endif
+}
 
-	int *temp_keys = (int *)calloc((*db)->order, sizeof(int));
-	if (!temp_keys) {
-		perror("Temporary keys array.");
-		exit(EXIT_FAILURE);
-	}
+/* Position of the highest bit set */
+static inline int latency_log2(uint64_t value) {
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(value);
+#else
+	int e = 0;
+	while (value >>= 1)
+		++e;
+	return e;
+#endif
+}
 
-	/* TODO remove */
-	void **temp_pointers = calloc((*db)->order, sizeof(void *));
-	if (!temp_pointers) {
-		perror("Temporary pointers array.");
-		exit(EXIT_FAILURE);
-	}
+/* Bucket holding the value */
+static inline int histogram_bucket(uint64_t value) {
+	if (value < (1u << HIST_SUB_BITS))
+		return (int)value;
 
-	uint32_t *temp__pointers = calloc((*db)->order, sizeof(uint32_t));
-	if (!temp__pointers) {
-		perror("Temporary _pointers array.");
-		exit(EXIT_FAILURE);
-	}
+	int e = latency_log2(value);
+	if (e > HIST_MAX_EXP)
+		return HIST_BUCKETS - 1;
 
-	int insertion_index = 0;
-	while (insertion_index < (*db)->order - 1 && leaf->keys[insertion_index] < key)
-		insertion_index++;
+	int sub = (int)(value >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
 
-	int i, j;
-	for (i = 0, j = 0; i < leaf->num_keys; i++, j++) {
-		if (j == insertion_index)
-			j++;
-		temp_keys[j] = leaf->keys[i];
-		temp_pointers[j] = leaf->pointers[i];
-		temp__pointers[j] = leaf->_pointers[i];
-	}
+/* Largest value that falls in the bucket */
+static uint64_t histogram_bucket_high(int bucket) {
+	if (bucket < (1 << HIST_SUB_BITS))
+		return bucket;
 
-	temp_keys[insertion_index] = key;
-	temp_pointers[insertion_index] = 0;//pointer;
-	temp__pointers[insertion_index] = offset;
+	int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+	uint64_t low = ((1ull << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
 
-	leaf->num_keys = 0;
+	return low + (1ull << (e - HIST_SUB_BITS)) - 1;
+}
 
-	int split = cut((*db)->order - 1);
+static inline void histogram_record(ytree_histogram_t *hist, uint64_t value) {
+	hist->counts[histogram_bucket(value)]++;
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+}
 
-	for (i = 0; i < split; i++) {
-		leaf->pointers[i] = temp_pointers[i];
-		leaf->_pointers[i] = temp__pointers[i];
-		leaf->keys[i] = temp_keys[i];
-		leaf->num_keys++;
-	}
+/*
+ * Start and end of a timed operation. Start
+ * returns zero when timing is off.
+ */
+static inline uint64_t latency_begin(db_t **db) {
+	return (*db)->timing ? latency_now() : 0;
+}
 
-	for (i = split, j = 0; i < (*db)->order; i++, j++) {
-		new_leaf->pointers[j] = temp_pointers[i];
-		new_leaf->_pointers[j] = temp__pointers[i];
-		new_leaf->keys[j] = temp_keys[i];
-		new_leaf->num_keys++;
+static inline void latency_end(db_t **db, enum latency_op op, uint64_t start) {
+	if (start)
+		histogram_record(&(*db)->latency[op], latency_now() - start);
+}
+
+/*
+ * Turn latency recording on or off. The
+ * histograms are kept when turned off. The
+ * first call that enables timing in a process
+ * takes 10ms to calibrate the clock.
+ */
+void ytree_latency_enable(db_t **db, bool enable) {
+	if (enable && !(*db)->latency) {
+		(*db)->latency = (ytree_histogram_t *)env_alloc((*db)->env, LAT_MAX * sizeof(ytree_histogram_t));
+		if (!(*db)->latency) {
+			perror("Latency histograms");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	free(temp_pointers);
-	free(temp_keys);
+	if (enable)
+		latency_calibrate();
 
-	/* Create the sequence chain */
-	new_leaf->pointers[(*db)->order - 1] = leaf->pointers[(*db)->order - 1];
-	new_leaf->_pointers[(*db)->order - 1] = leaf->_pointers[(*db)->order - 1];
-	leaf->pointers[(*db)->order - 1] = new_leaf;
-	//leaf->pointers_[(*db)->order - 1] = ? TODO
+	(*db)->timing = enable;
+}
 
-	for (i = leaf->num_keys; i < (*db)->order - 1; i++) {
-		leaf->pointers[i] = NULL;
-		leaf->_pointers[i] = 0;
-	}
-	for (i = new_leaf->num_keys; i < (*db)->order - 1; i++) {
-		new_leaf->pointers[i] = NULL;
-		new_leaf->_pointers[i] = 0;
+/* Copy the histogram of an operation */
+void ytree_latency(db_t **db, enum latency_op op, ytree_histogram_t *hist) {
+	assert(op < LAT_MAX);
+
+	if (!(*db)->latency) {
+		memset(hist, 0, sizeof(ytree_histogram_t));
+		return;
 	}
 
-	new_leaf->parent = leaf->parent;
+	*hist = (*db)->latency[op];
+}
 
-	insert_into_parent(db, leaf, new_leaf->keys[0], new_leaf);
+void ytree_latency_reset(db_t **db) {
+	if ((*db)->latency)
+		memset((*db)->latency, 0, LAT_MAX * sizeof(ytree_histogram_t));
 }
 
 /*
- * Inserts a new key and pointer to a node
- * into a node into which these can fit
- * without violating the B+Tree properties.
+ * Latency in nanoseconds below which the given
+ * percentage of samples fall. The result is the
+ * upper bound of the bucket holding that sample.
  */
-static void insert_into_node(db_t **db, node_t *n, int left_index, int key, node_t *right) {
+uint64_t ytree_histogram_percentile(ytree_histogram_t *hist, double percentile) {
+	uint64_t rank, seen = 0;
 	int i;
-	for (i = n->num_keys; i > left_index; i--) {
-		n->pointers[i + 1] = n->pointers[i];
-		n->_pointers[i + 1] = n->_pointers[i];
-		n->keys[i] = n->keys[i - 1];
+
+	if (!hist->count)
+		return 0;
+
+	rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > hist->count)
+		rank = hist->count;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen >= rank)
+			break;
 	}
 
-	n->pointers[left_index + 1] = right;
-	n->keys[left_index] = key;
-	n->num_keys++;
+	uint64_t value = histogram_bucket_high(i);
+	if (value > hist->max)
+		value = hist->max;
+	if (value < hist->min)
+		value = hist->min;
+
+	return (uint64_t)(value * latency_tick_ns());
 }
 
+/* Add all samples of src to dst */
+void ytree_histogram_merge(ytree_histogram_t *dst, ytree_histogram_t *src) {
+	int i;
 
-/*
- * Inserts a new key and pointer to a node
- * into a node, causing the node's size to exceed
- * the order, and causing the node to split into two.
- */
+	if (!src->count)
+		return;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->counts[i] += src->counts[i];
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+}
+
+/* ********************************
+ * OUTPUT [DEBUG ONLY]
+ * ********************************/
+
+#ifdef DEBUG
+
+/*
+ * Prints the bottom row of keys
+ * of the tree (with their respective
+ * pointers, if the verbose_output flag is set.
+ */
+void ytree_print_leaves(db_t **db) {
+	int i;
+	node_t *c = (*db)->root;
+	if (!(*db)->root) {
+		printf("Empty tree.\n");
+		return;
+	}
+
+	/* Find leftmost leave */
+	while (!c->is_leaf)
+		c = c->pointers[0];
+
+	while (true) {
+		for (i = 0; i < c->num_keys; ++i) {
+			if (verbose_output)
+				printf("%x ", (unsigned int)(uintptr_t)c->pointers[i]);
+			printf("%d ", c->keys[i]);
+		}
+		if (verbose_output)
+			printf("%x ", (unsigned int)(uintptr_t)c->pointers[(*db)->order - 1]);
+		if (c->pointers[(*db)->order - 1] != NULL) {
+			printf(" | ");
+			c = c->pointers[(*db)->order - 1];
+		} else
+			break;
+	}
+
+	printf("\n");
+}
+
+/*
+ * Find the datatype in the record
+ * and print the corresponding
+ * value to screen
+ */
+void ytree_print_value(record_t *record) {
+	switch (record->value_type) {
+		case DT_CHAR:
+			printf("%c\n", record->value._char);
+			break;
+		case DT_INT:
+			printf("%d\n", record->value._int);
+			break;
+		case DT_FLOAT:
+			printf("%f\n", record->value._float);
+			break;
+		case DT_DATA:
+			printf("%p\n", record->value._data);
+			break;
+	}
+}
+
+/*
+ * Prints the tree in level order, each
+ * level on a separate line, finishing
+ * with the leaves.
+ */
+void ytree_print_tree(db_t **db) {
+	struct node_queue queue;
+	int i, remaining = 1, next_level = 0;
+
+	if (!(*db)->root) {
+		printf("Empty tree\n");
+		return;
+	}
+
+	queue_init(&queue);
+	enqueue(&queue, (*db)->root);
+	while (queue.head) {
+		node_t *n = dequeue(&queue);
+
+		for (i = 0; i < n->num_keys; i++)
+			printf("%d ", n->keys[i]);
+
+		if (!n->is_leaf) {
+			for (i = 0; i <= n->num_keys; i++)
+				enqueue(&queue, n->pointers[i]);
+			next_level += n->num_keys + 1;
+		}
+
+		printf("| ");
+
+		/* Last node of the level */
+		if (!--remaining && queue.head) {
+			printf("\n");
+			remaining = next_level;
+			next_level = 0;
+		}
+	}
+	printf("\n");
+}
+
+/* public?
+ * Finds the record under a given key and prints an
+ * appropriate message to stdout.
+ */
+void find_and_print(db_t **db, int key, bool verbose) {
+	if (verbose) {
+		ytree_explain_t explain;
+		int i;
+
+		ytree_explain(db, key, &explain);
+		printf("Start at %s\n", explain.entry);
+		for (i = 0; i < explain.levels; ++i) {
+			ytree_explain_level_t *level = &explain.level[i];
+			printf("%s %p  keys %d  -> %d  cmp %d  lines %d  %llu ns\n",
+				level->leaf ? "Leaf" : "Node", level->node, level->num_keys, level->index,
+				level->comparisons, level->cache_lines, (unsigned long long)level->ns);
+		}
+		if (explain.found)
+			printf("Record @%u  %u bytes from %s  %llu ns\n", explain.offset, explain.record_bytes,
+				explain.record_source, (unsigned long long)explain.record_ns);
+	}
+
+	record_t *record = ytree_get(db, key);
+	if (!record) {
+		printf("Key: %d  Record: NULL\n", key);
+		return;
+	}
+
+	printf("Key: %d  Record: ", key);
+	ytree_print_value(record);
+}
+
+static bool print_range_value(int key, record_t *record, void *ctx) {
+	printf("Key: %d  Record: ", key);
+	ytree_print_value(record);
+	return true;
+}
+
+/* public?
+ * Finds and prints the keys, pointers, and values within a range
+ * of keys between key_start and key_end, including both bounds.
+ */
+void find_and_print_range(db_t **db, int key_start, int key_end, bool verbose) {
+	if (!ytree_range(db, key_start, key_end, &print_range_value, NULL))
+		printf("None found\n");
+}
+
+#endif // DEBUG
+
+/* ********************************
+ * CAPTURE
+ * ********************************/
+
+/* Events buffered per thread before a write */
+#define CAPTURE_BUFFER_EVENTS 4096
+
+struct capture_buffer {
+	capture_event_t events[CAPTURE_BUFFER_EVENTS];
+	size_t count;
+	uint16_t thread;
+	struct capture_buffer *next;
+};
+
+/*
+ * Capture of all API calls of an environment.
+ * Every thread fills its own buffer, the file is
+ * only locked when a full buffer is written out.
+ */
+struct capture {
+	FILE *fp;
+	uint64_t start;
+	unsigned int run;
+	uint16_t threads;
+	bool failed;
+	struct capture_buffer *buffers;
+#ifndef _WIN32
+	pthread_key_t key;
+	pthread_mutex_t lock;
+#endif
+};
+
+static void capture_lock(struct capture *capture) {
+#ifndef _WIN32
+	pthread_mutex_lock(&capture->lock);
+#endif
+}
+
+static void capture_unlock(struct capture *capture) {
+#ifndef _WIN32
+	pthread_mutex_unlock(&capture->lock);
+#endif
+}
+
+/* Write out the events of the buffer, the capture must be locked */
+static void capture_flush(struct capture *capture, struct capture_buffer *buffer) {
+	if (buffer->count && fwrite(buffer->events, sizeof(capture_event_t), buffer->count, capture->fp) != buffer->count)
+		capture->failed = true;
+	buffer->count = 0;
+}
+
+/* Buffer of the calling thread, created on first use */
+static struct capture_buffer *capture_buffer(env_t *env, struct capture *capture) {
+	struct capture_buffer *buffer;
+
+#ifndef _WIN32
+	buffer = (struct capture_buffer *)pthread_getspecific(capture->key);
+#else
+	buffer = capture->buffers;
+#endif
+	if (buffer)
+		return buffer;
+
+	buffer = (struct capture_buffer *)env_alloc(env, sizeof(struct capture_buffer));
+	if (!buffer) {
+		perror("Capture buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	capture_lock(capture);
+	buffer->thread = capture->threads++;
+	buffer->next = capture->buffers;
+	capture->buffers = buffer;
+	capture_unlock(capture);
+
+#ifndef _WIN32
+	pthread_setspecific(capture->key, buffer);
+#endif
+	return buffer;
+}
+
+/* Captures started, tells the runs apart */
+static unsigned int capture_runs;
+
+static void capture_event(db_t **db, struct capture *capture, enum capture_op op, int key, int32_t arg, uint8_t value_type) {
+	struct capture_buffer *buffer = capture_buffer((*db)->env, capture);
+	capture_event_t *event = &buffer->events[buffer->count++];
+
+	event->timestamp = clock_ns() - capture->start;
+	event->key = key;
+	event->arg = arg;
+	event->thread = buffer->thread;
+	event->schema_id = (uint16_t)(*db)->schema_id;
+	event->order = (uint16_t)(*db)->tree_order;
+	event->op = (uint8_t)op;
+	event->value_type = value_type;
+
+	if (buffer->count == CAPTURE_BUFFER_EVENTS) {
+		capture_lock(capture);
+		capture_flush(capture, buffer);
+		capture_unlock(capture);
+	}
+}
+
+/*
+ * Record the settings of the database that
+ * replay needs to recreate it: the flags, the
+ * schema of its index and the front cache.
+ */
+static void capture_setup(db_t **db) {
+	struct capture *capture = (*db)->env->capture;
+
+	(*db)->capture_run = capture->run;
+	capture_event(db, capture, CAPTURE_SETUP, (*db)->index ? (*db)->index->schema_id : -1,
+		(int32_t)front_entries(db), (uint8_t)(*db)->flags);
+}
+
+static void capture_record(db_t **db, enum capture_op op, int key, int32_t arg, enum datatype type) {
+	struct capture *capture = (*db)->env->capture;
+
+	if ((*db)->capture_run != capture->run)
+		capture_setup(db);
+
+	capture_event(db, capture, op, key, arg, (uint8_t)type);
+}
+
+#define CAPTURE(db, op, key, arg, type) \
+	do { if ((*db)->env->capture) capture_record(db, op, key, arg, type); } while (0)
+
+/*
+ * Record every API call on the databases of the
+ * environment to the file at path. Returns false
+ * if the file cannot be created or a capture is
+ * already running.
+ */
+bool ytree_capture_start(env_t **env, const char *path) {
+	capture_header_t header;
+	struct capture *capture;
+
+	if ((*env)->capture)
+		return false;
+
+	capture = (struct capture *)env_alloc(*env, sizeof(struct capture));
+	if (!capture)
+		return false;
+
+	capture->fp = fopen(path, "wb");
+	if (!capture->fp) {
+		env_free(*env, capture, sizeof(struct capture));
+		return false;
+	}
+
+	memset(&header, 0, sizeof(capture_header_t));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	header.event_size = sizeof(capture_event_t);
+	if (fwrite(&header, sizeof(capture_header_t), 1, capture->fp) != 1) {
+		fclose(capture->fp);
+		env_free(*env, capture, sizeof(struct capture));
+		return false;
+	}
+
+#ifndef _WIN32
+	pthread_key_create(&capture->key, NULL);
+	pthread_mutex_init(&capture->lock, NULL);
+#endif
+	capture->start = clock_ns();
+	capture->run = ++capture_runs;
+	(*env)->capture = capture;
+	return true;
+}
+
+/*
+ * Write out the buffers of all threads and close
+ * the capture file. Events are grouped per thread,
+ * readers sort them on timestamp. Returns false if
+ * any event could not be written. No thread may
+ * be calling into the environment.
+ */
+bool ytree_capture_stop(env_t **env) {
+	struct capture *capture = (*env)->capture;
+	bool written;
+
+	if (!capture)
+		return false;
+
+	(*env)->capture = NULL;
+	while (capture->buffers) {
+		struct capture_buffer *next = capture->buffers->next;
+		capture_flush(capture, capture->buffers);
+		env_free(*env, capture->buffers, sizeof(struct capture_buffer));
+		capture->buffers = next;
+	}
+
+	written = !capture->failed && !fclose(capture->fp);
+
+#ifndef _WIN32
+	pthread_key_delete(capture->key);
+	pthread_mutex_destroy(&capture->lock);
+#endif
+	env_free(*env, capture, sizeof(struct capture));
+	return written;
+}
+
+/* ********************************
+ * FRONT CACHE
+ * ********************************/
+
+/*
+ * Two way set associative cache of hot keys in
+ * front of the tree. An entry maps a key to the
+ * offset of its record, so nodes can split, merge
+ * and move underneath it. The entry of a key is
+ * dropped whenever its value moves or is removed.
+ * The most recent way of a set is kept first,
+ * sets are 16 bytes so four share a cache line.
+ */
+#define FRONT_WAYS		2
+#define FRONT_MIN_SETS	2
+
+struct front_set {
+	int keys[FRONT_WAYS];
+	uint32_t offsets[FRONT_WAYS];			// Zero for an empty way
+};
+
+struct front_cache {
+	unsigned int sets;						// Number of sets, a power of two
+	unsigned int shift;						// Hash shift selecting the set
+	struct front_set set[];
+};
+
+static struct front_set *front_set_of(struct front_cache *front, int key) {
+	return &front->set[((uint32_t)key * 0x9E3779B1u) >> front->shift];
+}
+
+/* Offset of the record of key, or zero on a miss */
+static uint32_t front_lookup(db_t **db, int key) {
+	struct front_set *set = front_set_of((*db)->front, key);
+
+	if (set->offsets[0] && set->keys[0] == key) {
+		(*db)->stats.front_hits++;
+		return set->offsets[0];
+	}
+
+	if (set->offsets[1] && set->keys[1] == key) {
+		uint32_t offset = set->offsets[1];
+
+		set->keys[1] = set->keys[0];
+		set->offsets[1] = set->offsets[0];
+		set->keys[0] = key;
+		set->offsets[0] = offset;
+		(*db)->stats.front_hits++;
+		return offset;
+	}
+
+	(*db)->stats.front_misses++;
+	return 0;
+}
+
+/* Add a key after a miss, evicting the older way */
+static void front_fill(db_t **db, int key, uint32_t offset) {
+	struct front_set *set = front_set_of((*db)->front, key);
+
+	if (set->offsets[1]) {
+		(*db)->stats.front_evictions++;
+		TRACE_DB(db, TRACE_EVICT, set->keys[1]);
+	}
+
+	set->keys[1] = set->keys[0];
+	set->offsets[1] = set->offsets[0];
+	set->keys[0] = key;
+	set->offsets[0] = offset;
+}
+
+/* Drop the entry of key, if cached */
+static void front_invalidate(db_t **db, int key) {
+	struct front_set *set;
+
+	if (!(*db)->front)
+		return;
+
+	set = front_set_of((*db)->front, key);
+	if (set->offsets[0] && set->keys[0] == key) {
+		set->keys[0] = set->keys[1];
+		set->offsets[0] = set->offsets[1];
+		set->offsets[1] = 0;
+	} else if (set->offsets[1] && set->keys[1] == key) {
+		set->offsets[1] = 0;
+	}
+}
+
+static void front_clear(db_t **db) {
+	if ((*db)->front)
+		memset((*db)->front->set, 0, (*db)->front->sets * sizeof(struct front_set));
+}
+
+/* Entries the cache holds, zero without one */
+static unsigned int front_entries(db_t **db) {
+	return (*db)->front ? (*db)->front->sets * FRONT_WAYS : 0;
+}
+
+static size_t front_size(struct front_cache *front) {
+	return sizeof(struct front_cache) + front->sets * sizeof(struct front_set);
+}
+
+/*
+ * Put a cache of about entries hot keys in front
+ * of point lookups, rounded up to a power of two.
+ * Zero removes the cache. Only ytree_find uses it,
+ * a hit reads the record without a descent.
+ */
+void ytree_front_cache(db_t **db, unsigned int entries) {
+	unsigned int sets = FRONT_MIN_SETS, shift = 32 - 1;
+
+	if ((*db)->front) {
+		env_free((*db)->env, (*db)->front, front_size((*db)->front));
+		(*db)->front = NULL;
+	}
+
+	if (!entries)
+		return;
+
+	while (sets * FRONT_WAYS < entries && sets < (1u << 30)) {
+		sets <<= 1;
+		shift--;
+	}
+
+	(*db)->front = (struct front_cache *)env_alloc((*db)->env, sizeof(struct front_cache) + sets * sizeof(struct front_set));
+	if (!(*db)->front) {
+		perror("Front cache");
+		exit(EXIT_FAILURE);
+	}
+
+	(*db)->front->sets = sets;
+	(*db)->front->shift = shift;
+}
+
+/* ********************************
+ * RADIX TABLE
+ * ********************************/
+
+/*
+ * Table of subtree roots over the key span of
+ * the tree. The span from the lowest to the
+ * highest key is cut into buckets on the high
+ * bits of the key offset, and each bucket points
+ * at the deepest node that all its keys descend
+ * through. Descents start there instead of at the
+ * root. Every restructure makes the table stale,
+ * it is rebuilt once the tree went unchanged for
+ * as many descents as the table has buckets, and
+ * sized for the number of keys at that time. While
+ * the tree keeps splitting it is not rebuilt.
+ */
+#define RADIX_MIN_SIZE	16
+
+struct radix_table {
+	unsigned int generation;				// Tree generation the table was built for
+	unsigned int seen;						// Tree generation last seen when stale
+	unsigned int stale;						// Descents since the tree last changed
+	unsigned int capacity;					// Most buckets, a power of two
+	unsigned int size;						// Buckets in use, a power of two
+	unsigned int shift;						// Offset bits below the bucket
+	int low;								// Lowest key at the last build
+	int high;								// Highest key at the last build
+	node_t *start[];
+};
+
+static void radix_build(db_t **db) {
+	struct radix_table *radix = (*db)->radix;
+	node_t *root = (*db)->root;
+	node_t *c = root;
+	unsigned int size = RADIX_MIN_SIZE, b;
+	uint32_t span;
+
+	while (!c->is_leaf)
+		c = c->pointers[0];
+	radix->low = c->keys[0];
+
+	for (c = root; !c->is_leaf; c = c->pointers[c->num_keys]);
+	radix->high = c->keys[c->num_keys - 1];
+
+	/* Bucket for about every leaf */
+	while (size < radix->capacity && size < (unsigned int)(*db)->keys / ((*db)->order - 1))
+		size <<= 1;
+
+	span = (uint32_t)((int64_t)radix->high - radix->low);
+	radix->size = size;
+	for (radix->shift = 0; (span >> radix->shift) >= size; radix->shift++);
+
+	for (b = 0; b < size; ++b) {
+		int64_t lo = (int64_t)radix->low + ((int64_t)b << radix->shift);
+		int64_t hi = lo + ((int64_t)1 << radix->shift) - 1;
+
+		if (lo > radix->high) {
+			radix->start[b] = root;
+			continue;
+		}
+		if (hi > radix->high)
+			hi = radix->high;
+
+		c = root;
+		while (!c->is_leaf) {
+			int i = (*db)->search(c->keys, c->num_keys, (int)lo);
+			if (i != (*db)->search(c->keys, c->num_keys, (int)hi))
+				break;
+			c = (node_t *)c->pointers[i];
+		}
+		radix->start[b] = c;
+	}
+
+	radix->generation = (*db)->generation;
+	radix->stale = 0;
+	(*db)->stats.radix_rebuilds++;
+}
+
+/* Node to start the descent for key from */
+/* Bucket of a key within the span of the table */
+static inline unsigned int radix_bucket(struct radix_table *radix, int key) {
+	return (uint32_t)((int64_t)key - radix->low) >> radix->shift;
+}
+
+static node_t *radix_start(db_t **db, int key) {
+	struct radix_table *radix = (*db)->radix;
+
+	if (radix->generation != (*db)->generation) {
+		if (radix->seen != (*db)->generation) {
+			radix->seen = (*db)->generation;
+			radix->stale = 0;
+		}
+		if (++radix->stale < radix->size)
+			return (*db)->root;
+		radix_build(db);
+	}
+
+	if (key < radix->low || key > radix->high)
+		return (*db)->root;
+
+	(*db)->stats.radix_hits++;
+	return radix->start[radix_bucket(radix, key)];
+}
+
+static size_t radix_size(struct radix_table *radix) {
+	return sizeof(struct radix_table) + radix->capacity * sizeof(node_t *);
+}
+
+/*
+ * Start descents from a table of at most entries
+ * subtree roots, rounded up to a power of two.
+ * Zero removes the table. The table follows the
+ * key span and the number of keys, and skips the
+ * top levels of lookups, inserts and deletes.
+ */
+void ytree_radix_table(db_t **db, unsigned int entries) {
+	unsigned int capacity = RADIX_MIN_SIZE;
+
+	if ((*db)->radix) {
+		env_free((*db)->env, (*db)->radix, radix_size((*db)->radix));
+		(*db)->radix = NULL;
+	}
+
+	if (!entries)
+		return;
+
+	while (capacity < entries && capacity < (1u << 24))
+		capacity <<= 1;
+
+	(*db)->radix = (struct radix_table *)env_alloc((*db)->env, sizeof(struct radix_table) + capacity * sizeof(node_t *));
+	if (!(*db)->radix) {
+		perror("Radix table");
+		exit(EXIT_FAILURE);
+	}
+
+	(*db)->radix->capacity = capacity;
+	(*db)->radix->size = RADIX_MIN_SIZE;
+	(*db)->radix->generation = (*db)->generation - 1;
+}
+
+/* ********************************
+ * ANALYSIS
+ * ********************************/
+
+/*
+ * Walk the tree once in level order and collect
+ * the nodes and fill per level, then follow the
+ * leaf chain for its ordering and locality.
+ */
+void ytree_shape(db_t **db, ytree_shape_t *shape) {
+	struct node_queue queue;
+	int i, level = 0, remaining = 1, next_level = 0;
+	int capacity = (*db)->order - 1;
+
+	memset(shape, 0, sizeof(ytree_shape_t));
+	shape->order = (*db)->order;
+	shape->chain_ordered = true;
+	if (!(*db)->root)
+		return;
+
+	queue_init(&queue);
+	enqueue(&queue, (*db)->root);
+	while (queue.head) {
+		node_t *n = dequeue(&queue);
+		int slot = level < SHAPE_MAX_LEVELS ? level : SHAPE_MAX_LEVELS - 1;
+		int fill = n->num_keys * SHAPE_FILL_BUCKETS / capacity;
+
+		shape->nodes++;
+		shape->levels[slot].nodes++;
+		shape->levels[slot].keys += n->num_keys;
+		shape->levels[slot].fill[fill < SHAPE_FILL_BUCKETS ? fill : SHAPE_FILL_BUCKETS - 1]++;
+
+		if (n->is_leaf) {
+			shape->keys += n->num_keys;
+		} else {
+			for (i = 0; i <= n->num_keys; i++)
+				enqueue(&queue, n->pointers[i]);
+			next_level += n->num_keys + 1;
+		}
+
+		if (!--remaining) {
+			remaining = next_level;
+			next_level = 0;
+			if (queue.head)
+				level++;
+		}
+	}
+	shape->height = level;
+
+	/* Leftmost leaf */
+	node_t *c = (*db)->root;
+	while (!c->is_leaf)
+		c = c->pointers[0];
+
+	uint64_t gaps = 0;
+	bool first = true;
+	int last_key = 0;
+	uint32_t last_offset = 0;
+	for (; c; c = c->pointers[(*db)->order - 1]) {
+		node_t *next = c->pointers[(*db)->order - 1];
+
+		shape->chain_leaves++;
+		if (next)
+			gaps += (uintptr_t)next > (uintptr_t)c ? (uintptr_t)next - (uintptr_t)c : (uintptr_t)c - (uintptr_t)next;
+
+		for (i = 0; i < c->num_keys; ++i) {
+			if (!first) {
+				uint32_t distance = c->_pointers[i] > last_offset ? c->_pointers[i] - last_offset : last_offset - c->_pointers[i];
+
+				if (c->keys[i] <= last_key)
+					shape->chain_ordered = false;
+				if (distance < (*db)->env->page_size)
+					shape->heap_near++;
+				else
+					shape->heap_far++;
+			}
+			first = false;
+			last_key = c->keys[i];
+			last_offset = c->_pointers[i];
+		}
+	}
+
+	if (shape->chain_leaves > 1)
+		shape->chain_gap_bytes = gaps / (shape->chain_leaves - 1);
+}
+
+static void dump_json(db_t **db, FILE *fp) {
+	struct node_queue queue;
+	ytree_shape_t shape;
+	uint64_t id = 0, child = 1;
+	int i, j;
+
+	ytree_shape(db, &shape);
+
+	fprintf(fp, "{\"order\": %d, \"height\": %d, \"nodes\": %llu, \"keys\": %llu, \"levels\": [",
+		shape.order, shape.height, (unsigned long long)shape.nodes, (unsigned long long)shape.keys);
+	for (i = 0; (*db)->root && i <= shape.height && i < SHAPE_MAX_LEVELS; ++i) {
+		fprintf(fp, "%s{\"nodes\": %llu, \"keys\": %llu, \"fill\": [", i ? ", " : "",
+			(unsigned long long)shape.levels[i].nodes, (unsigned long long)shape.levels[i].keys);
+		for (j = 0; j < SHAPE_FILL_BUCKETS; ++j)
+			fprintf(fp, "%s%llu", j ? ", " : "", (unsigned long long)shape.levels[i].fill[j]);
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "], \"chain\": {\"leaves\": %llu, \"ordered\": %s, \"gap_bytes\": %llu, "
+		"\"heap_near\": %llu, \"heap_far\": %llu}, \"tree\": [",
+		(unsigned long long)shape.chain_leaves, shape.chain_ordered ? "true" : "false",
+		(unsigned long long)shape.chain_gap_bytes,
+		(unsigned long long)shape.heap_near, (unsigned long long)shape.heap_far);
+
+	/*
+	 * Node ids follow the level order, the children
+	 * of a node have consecutive ids.
+	 */
+	if ((*db)->root) {
+		queue_init(&queue);
+		enqueue(&queue, (*db)->root);
+	}
+
+	while ((*db)->root && queue.head) {
+		node_t *n = dequeue(&queue);
+
+		fprintf(fp, "%s\n{\"id\": %llu, \"leaf\": %s, \"keys\": [", id ? "," : "",
+			(unsigned long long)id, n->is_leaf ? "true" : "false");
+		for (i = 0; i < n->num_keys; ++i)
+			fprintf(fp, "%s%d", i ? ", " : "", n->keys[i]);
+		fprintf(fp, "]");
+
+		if (!n->is_leaf) {
+			fprintf(fp, ", \"children\": [");
+			for (i = 0; i <= n->num_keys; ++i) {
+				fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)child++);
+				enqueue(&queue, n->pointers[i]);
+			}
+			fprintf(fp, "]");
+		}
+
+		fprintf(fp, "}");
+		id++;
+	}
+
+	fprintf(fp, "]}\n");
+}
+
+static void dump_dot(db_t **db, FILE *fp) {
+	struct node_queue queue;
+	int i;
+
+	fprintf(fp, "digraph ytree {\n\tnode [shape=record];\n");
+
+	if ((*db)->root) {
+		queue_init(&queue);
+		enqueue(&queue, (*db)->root);
+	}
+
+	/* Nodes are named by address so chain edges are exact */
+	while ((*db)->root && queue.head) {
+		node_t *n = dequeue(&queue);
+
+		fprintf(fp, "\tn%lx [label=\"", (unsigned long)(uintptr_t)n);
+		for (i = 0; i < n->num_keys; ++i)
+			fprintf(fp, "%s%d", i ? "|" : "", n->keys[i]);
+		fprintf(fp, "\"];\n");
+
+		if (n->is_leaf) {
+			node_t *next = n->pointers[(*db)->order - 1];
+			if (next)
+				fprintf(fp, "\tn%lx -> n%lx [style=dashed];\n",
+					(unsigned long)(uintptr_t)n, (unsigned long)(uintptr_t)next);
+		} else {
+			for (i = 0; i <= n->num_keys; ++i) {
+				fprintf(fp, "\tn%lx -> n%lx;\n",
+					(unsigned long)(uintptr_t)n, (unsigned long)(uintptr_t)n->pointers[i]);
+				enqueue(&queue, n->pointers[i]);
+			}
+		}
+	}
+
+	fprintf(fp, "}\n");
+}
+
+/*
+ * Write the tree structure to fp as JSON,
+ * including the shape, or as Graphviz DOT
+ * with the leaf chain as dashed edges.
+ */
+void ytree_dump(db_t **db, FILE *fp, enum dump_format format) {
+	switch (format) {
+		case DUMP_JSON:
+			dump_json(db, fp);
+			break;
+		case DUMP_DOT:
+			dump_dot(db, fp);
+			break;
+	}
+}
+
+/* Cache lines spanned by size bytes at p */
+static int cache_lines(const void *p, size_t size) {
+	uintptr_t first = (uintptr_t)p / CACHE_LINE;
+	uintptr_t last = ((uintptr_t)p + (size ? size : 1) - 1) / CACHE_LINE;
+
+	return (int)(last - first + 1);
+}
+
+/*
+ * Cache lines of the keys a search returning
+ * index i has touched. Scans read the keys up to
+ * the first larger one, binary searches probe one
+ * key per step and share the last line or so.
+ */
+static int search_lines(db_t **db, node_t *n, int i) {
+	int examined = search_cost(db, n->num_keys, i);
+
+	if ((*db)->search == search_binary || (*db)->search == search_branchless) {
+		int lines = cache_lines(n->keys, n->num_keys * sizeof(int));
+		return examined < lines ? examined : lines;
+	}
+
+	return cache_lines(n->keys, examined * sizeof(int));
+}
+
+/*
+ * Describe the lookup of key, level by level
+ * from where the descent starts to the leaf, and
+ * the read of its record. The descent starts at
+ * the entry of the radix table when the table is
+ * current for the tree and covers the key, as a
+ * lookup would, otherwise at the root. A stale
+ * table is not rebuilt. Nothing is added to the
+ * operation counters of the database. Returns
+ * true if the key exists. Nodes always live in
+ * memory, the record comes from the file or the
+ * memory image of the environment.
+ */
+bool ytree_explain(db_t **db, int key, ytree_explain_t *out) {
+	ytree_explain_level_t *level = NULL;
+	struct radix_table *radix = (*db)->radix;
+	node_t *c = (*db)->root;
+	int i;
+
+	memset(out, 0, sizeof(ytree_explain_t));
+	out->key = key;
+	for (i = 0; i < SEARCH_MAX; ++i)
+		if (search_kernels[i] == (*db)->search)
+			out->kernel = search_names[i];
+	out->record_source = (*db)->env->pdb ? "file" : "memory";
+	out->entry = "root";
+
+	if (c && radix && radix->generation == (*db)->generation && key >= radix->low && key <= radix->high) {
+		c = radix->start[radix_bucket(radix, key)];
+		out->entry = "radix";
+	}
+
+	while (c && out->levels < EXPLAIN_MAX_LEVELS) {
+		uint64_t start = clock_ns();
+
+		level = &out->level[out->levels++];
+
+		i = (*db)->search(c->keys, c->num_keys, key);
+		level->ns = clock_ns() - start;
+		level->node = c;
+		level->leaf = c->is_leaf;
+		level->num_keys = c->num_keys;
+		level->comparisons = search_cost(db, c->num_keys, i);
+		level->cache_lines = cache_lines(c, sizeof(node_t)) + search_lines(db, c, i);
+
+		if (c->is_leaf) {
+			out->found = i && c->keys[i - 1] == key;
+			level->index = out->found ? i - 1 : -1;
+			if (out->found)
+				level->cache_lines += cache_lines(&c->_pointers[i - 1], sizeof(uint32_t));
+			break;
+		}
+
+		level->index = i;
+		level->cache_lines += cache_lines(&c->pointers[i], sizeof(void *));
+		c = (node_t *)c->pointers[i];
+	}
+
+	if (out->found) {
+		uint64_t start = clock_ns();
+		record_t *record;
+
+		out->offset = ((node_t *)level->node)->_pointers[level->index];
+		record = env_read_record((*db)->env, out->offset);
+		out->record_ns = clock_ns() - start;
+		if (record) {
+			out->record_bytes = (uint32_t)record_disk_size(record);
+			env_free_record((*db)->env, record);
+		}
+	}
+
+	for (i = 0; i < out->levels; ++i)
+		out->total_ns += out->level[i].ns;
+	out->total_ns += out->record_ns;
+
+	return out->found;
+}
+
+/*
+ * Utility function to give the height
+ * of the tree, which length in number of edges
+ * of the path from the root to any leaf.
+ */
+int ytree_height(db_t **db) {
+	int h = 0;
+
+	if (!(*db)->root) {
+		return 0;
+	}
+
+	node_t *c = (*db)->root;
+	while (!c->is_leaf) {
+		c = c->pointers[0];
+		h++;
+	}
+
+	return h;
+}
+
+/* Return number of keys */
+int ytree_count(db_t **db) {
+	int count = 0;
+	node_t *c = (*db)->root;
+	if (!(*db)->root)
+		return count;
+
+	/* Find leftmost leave */
+	while (!c->is_leaf)
+		c = c->pointers[0];
+
+	while (true) {
+		count += c->num_keys;
+		if (c->pointers[(*db)->order - 1] != NULL)
+			c = c->pointers[(*db)->order - 1];
+		else
+			break;
+	}
+
+	return count;
+}
+
+/*
+ * Database version number
+ * returned as string.
+ */
+const char *ytree_version() {
+	return VERSION;
+}
+
+/*
+ * Copy the operation counters of the database
+ * into stats. Work done on the secondary index
+ * is added to the counters of its database. The
+ * storage counters cover the whole environment.
+ */
+void ytree_stats(db_t **db, ytree_stats_t *stats) {
+	*stats = (*db)->stats;
+	stats->io = (*db)->env->io;
+	if (stats->bytes_logical)
+		stats->write_amplification = (double)stats->io.bytes_written / stats->bytes_logical;
+
+	if (!(*db)->index)
+		return;
+
+	ytree_stats_t index;
+	ytree_stats(&(*db)->index, &index);
+
+	stats->descents += index.descents;
+	stats->comparisons += index.comparisons;
+	stats->leaf_splits += index.leaf_splits;
+	stats->internal_splits += index.internal_splits;
+	stats->coalesces += index.coalesces;
+	stats->redistributions += index.redistributions;
+	stats->root_changes += index.root_changes;
+	stats->records_written += index.records_written;
+	stats->records_read += index.records_read;
+	stats->bytes_written += index.bytes_written;
+	stats->bytes_read += index.bytes_read;
+}
+
+/*
+ * Zero all operation counters, and the
+ * storage counters of the environment.
+ */
+void ytree_stats_reset(db_t **db) {
+	memset(&(*db)->stats, 0, sizeof(ytree_stats_t));
+	memset(&(*db)->env->io, 0, sizeof(ytree_io_t));
+	if ((*db)->index)
+		ytree_stats_reset(&(*db)->index);
+}
+
+/* TODO: check index type == btree
+ * Set B+Tree order, this is only valid for
+ * a B+Tree structure, and is otherwise ignored.
+ * Order can only be set if the tree is empty.
+ * The order determines the maximum and minimum
+ * number of entries (keys and pointers) in any
+ * node.  Every node has at most order - 1 keys and
+ * at least (roughly speaking) half that number.
+ * Every leaf has as many pointers to data as keys,
+ * and every internal node has one more pointer
+ * to a subtree than the number of keys.
+ * This global variable is initialized to the
+ * default value.
+ */
+void ytree_order(db_t **db, unsigned int order) {
+	if (!(*db)->root) {
+		(*db)->tree_order = order;
+		small_reset(db);
+	}
+}
+
+/* TODO: remove prints
+ * Traces the path from the root to a leaf, searching
+ * by key. Displays information about the path
+ * if the verbose flag is set.
+ * Returns the leaf containing the given key.
+ */
+static node_t *find_leaf(db_t **db, int key) {
+	int i = 0;
+	node_t *c = (*db)->root;
+	if (!c)
+		return NULL;
+
+	if ((*db)->radix)
+		c = radix_start(db, key);
+
+	(*db)->stats.descents++;
+
+	while (!c->is_leaf) {
+		i = (*db)->search(c->keys, c->num_keys, key);
+		(*db)->stats.comparisons += search_cost(db, c->num_keys, i);
+		c = (node_t *)c->pointers[i];
+	}
+
+	return c;
+}
+
+/*
+ * Same as find_leaf, but also returns the upper
+ * bound of the keys routed to the leaf. Every key
+ * below the bound descends to the same leaf as
+ * long as the tree is not restructured.
+ */
+static node_t *find_leaf_bounded(db_t **db, int key, int *upper, bool *bounded) {
+	int i = 0;
+	node_t *c = (*db)->root;
+
+	*bounded = false;
+	if (!c)
+		return NULL;
+
+	(*db)->stats.descents++;
+	while (!c->is_leaf) {
+		i = (*db)->search(c->keys, c->num_keys, key);
+		(*db)->stats.comparisons += search_cost(db, c->num_keys, i);
+
+		if (i < c->num_keys && (!*bounded || c->keys[i] < *upper)) {
+			*upper = c->keys[i];
+			*bounded = true;
+		}
+
+		c = (node_t *)c->pointers[i];
+	}
+
+	return c;
+}
+
+/*
+ * Finds and returns the record to which
+ * a key refers. The record is read back from
+ * the record heap and is owned by the caller,
+ * who releases it with ytree_free_record.
+ */
+record_t *ytree_find(db_t **db, int key) {
+	uint64_t start = latency_begin(db);
+	record_t *record = ytree_get(db, key);
+
+	CAPTURE(db, CAPTURE_FIND, key, 0, 0);
+	latency_end(db, LAT_FIND, start);
+	return record;
+}
+
+/*
+ * Finds the leaf holding a key and the index
+ * of the key within that leaf. Returns false
+ * if the key is not in the tree.
+ */
+static bool find_slot(db_t **db, int key, node_t **leaf, int *index) {
+	int i = 0;
+	node_t *c = find_leaf(db, key);
+	if (!c)
+		return false;
+
+	i = (*db)->search(c->keys, c->num_keys, key);
+	(*db)->stats.comparisons += search_cost(db, c->num_keys, i);
+
+	if (!i || c->keys[i - 1] != key)
+		return false;
+
+	*leaf = c;
+	*index = i - 1;
+	return true;
+}
+
+/* TODO: rename, read recod
+ * Finds and returns the record to which
+ * a key refers.
+ */
+static uint32_t find_value(db_t **db, int key) {
+	node_t *leaf;
+	int index;
+
+	if (!find_slot(db, key, &leaf, &index))
+		return 0;
+
+	return leaf->_pointers[index];
+}
+
+/*
+ *
+ */
+record_t *ytree_get(db_t **db, int key) {
+	uint32_t offset = 0;
+
+	if ((*db)->front)
+		offset = front_lookup(db, key);
+
+	if (!offset) {
+		offset = find_value(db, key);
+		if (!offset)
+			return NULL;
+
+		if ((*db)->front)
+			front_fill(db, key, offset);
+	}
+
+	/*
+	 * Read record from page.
+	 */
+	return db_read_record(db, offset);
+}
+
+/* ********************************
+ * POSTING LISTS
+ * ********************************/
+
+/*
+ * Encode as many sorted offsets as fit
+ * into a new block. The number of offsets
+ * consumed is returned in used.
+ */
+static struct posting_block *posting_encode(env_t *env, uint32_t *offsets, int n, int *used) {
+	struct posting_block *block = (struct posting_block *)env_alloc(env, sizeof(struct posting_block));
+	if (!block) {
+		perror("Posting block creation");
+		exit(EXIT_FAILURE);
+	}
+
+	int i;
+	block->first = offsets[0];
+	block->count = 1;
+	for (i = 1; i < n; ++i) {
+		uint8_t buffer[5];
+		int len = 0;
+		uint32_t delta = offsets[i] - offsets[i - 1];
+
+		do {
+			buffer[len] = delta & 0x7f;
+			delta >>= 7;
+			if (delta)
+				buffer[len] |= 0x80;
+			len++;
+		} while (delta);
+
+		if (block->size + len > POSTING_BLOCK)
+			break;
+
+		memcpy(block->deltas + block->size, buffer, len);
+		block->size += len;
+		block->count++;
+	}
+
+	*used = i;
+	return block;
+}
+
+/*
+ * Decode all offsets of a block into
+ * out. Returns the number of offsets.
+ */
+static int posting_decode(struct posting_block *block, uint32_t *out) {
+	uint32_t pos = 0;
+	int i;
+
+	out[0] = block->first;
+	for (i = 1; i < block->count; ++i) {
+		uint32_t delta = 0;
+		int shift = 0;
+		uint8_t byte;
+
+		do {
+			byte = block->deltas[pos++];
+			delta |= (uint32_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+
+		out[i] = out[i - 1] + delta;
+	}
+
+	return block->count;
+}
+
+/*
+ * Encode sorted offsets into a chain of blocks
+ * terminated by tail. Returns the first block.
+ */
+static struct posting_block *posting_chain(env_t *env, uint32_t *offsets, int n, struct posting_block *tail) {
+	struct posting_block *head = NULL, **link = &head;
+	int i = 0;
+
+	while (i < n) {
+		int used;
+		*link = posting_encode(env, offsets + i, n - i, &used);
+		link = &(*link)->next;
+		i += used;
+	}
+
+	*link = tail;
+	return head;
+}
+
+static void posting_free(env_t *env, struct posting *posting) {
+	struct posting_block *block = posting->head;
+	while (block) {
+		struct posting_block *next = block->next;
+		env_free(env, block, sizeof(struct posting_block));
+		block = next;
+	}
+
+	env_free(env, posting, sizeof(struct posting));
+}
+
+/* 
+ * Lowest offset in the posting list.
+ */
+static uint32_t posting_first(struct posting *posting) {
+	return posting->head ? posting->head->first : posting->offsets[0];
+}
+
+/*
+ * Return the next offset of the posting list in
+ * offset. Returns false at the end of the list.
+ */
+static bool posting_next(struct posting_cursor *cursor, uint32_t *offset) {
+	struct posting *posting = cursor->posting;
+
+	if (!posting->head) {
+		if (cursor->index >= posting->count)
+			return false;
+
+		*offset = posting->offsets[cursor->index++];
+		return true;
+	}
+
+	if (!cursor->block) {
+		cursor->block = posting->head;
+		cursor->index = 0;
+		cursor->pos = 0;
+	} else if (cursor->index >= cursor->block->count) {
+		if (!cursor->block->next)
+			return false;
+
+		cursor->block = cursor->block->next;
+		cursor->index = 0;
+		cursor->pos = 0;
+	}
+
+	if (cursor->index == 0) {
+		cursor->value = cursor->block->first;
+	} else {
+		uint32_t delta = 0;
+		int shift = 0;
+		uint8_t byte;
+
+		do {
+			byte = cursor->block->deltas[cursor->pos++];
+			delta |= (uint32_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+
+		cursor->value += delta;
+	}
+
+	cursor->index++;
+	*offset = cursor->value;
+	return true;
+}
+
+static void posting_cursor_init(struct posting_cursor *cursor, struct posting *posting) {
+	memset(cursor, 0, sizeof(struct posting_cursor));
+	cursor->posting = posting;
+}
+
+/*
+ * Find the block in which offset belongs, which
+ * is the last block starting at or before it.
+ */
+static struct posting_block **posting_find_block(struct posting *posting, uint32_t offset) {
+	struct posting_block **link = &posting->head;
+	while ((*link)->next && (*link)->next->first <= offset)
+		link = &(*link)->next;
+
+	return link;
+}
+
+/*
+ * Add an offset to the posting list. Once the
+ * inline array is full the list is converted to
+ * a block chain. Only the block receiving the
+ * offset is encoded again.
+ */
+static void posting_add(env_t *env, struct posting *posting, uint32_t offset) {
+	uint32_t offsets[POSTING_BLOCK + 2];
+	int i, n;
+
+	if (!posting->head) {
+		n = posting->count;
+		for (i = n; i > 0 && posting->offsets[i - 1] > offset; --i)
+			if (n < POSTING_INLINE)
+				posting->offsets[i] = posting->offsets[i - 1];
+
+		if (n < POSTING_INLINE) {
+			posting->offsets[i] = offset;
+			posting->count++;
+			return;
+		}
+
+		memcpy(offsets, posting->offsets, i * sizeof(uint32_t));
+		offsets[i] = offset;
+		memcpy(offsets + i + 1, posting->offsets + i, (n - i) * sizeof(uint32_t));
+		posting->head = posting_chain(env, offsets, n + 1, NULL);
+		posting->count++;
+		return;
+	}
+
+	struct posting_block **link = posting_find_block(posting, offset);
+	struct posting_block *block = *link;
+
+	n = posting_decode(block, offsets);
+	for (i = n; i > 0 && offsets[i - 1] > offset; --i)
+		offsets[i] = offsets[i - 1];
+	offsets[i] = offset;
+
+	*link = posting_chain(env, offsets, n + 1, block->next);
+	env_free(env, block, sizeof(struct posting_block));
+	posting->count++;
+}
+
+/*
+ * Remove an offset from the posting list. The
+ * chain is turned back into the inline array
+ * when it becomes small enough.
+ */
+static void posting_remove(env_t *env, struct posting *posting, uint32_t offset) {
+	uint32_t offsets[POSTING_BLOCK + 2];
+	int i, n;
+
+	if (!posting->head) {
+		for (i = 0; i < (int)posting->count && posting->offsets[i] != offset; ++i);
+		if (i == (int)posting->count)
+			return;
+
+		for (++i; i < (int)posting->count; ++i)
+			posting->offsets[i - 1] = posting->offsets[i];
+		posting->count--;
+		return;
+	}
+
+	struct posting_block **link = posting_find_block(posting, offset);
+	struct posting_block *block = *link;
+
+	n = posting_decode(block, offsets);
+	for (i = 0; i < n && offsets[i] != offset; ++i);
+	if (i == n)
+		return;
+
+	for (++i; i < n; ++i)
+		offsets[i - 1] = offsets[i];
+
+	*link = posting_chain(env, offsets, n - 1, block->next);
+	env_free(env, block, sizeof(struct posting_block));
+	posting->count--;
+
+	if (posting->count <= POSTING_INLINE) {
+		struct posting_cursor cursor;
+		uint32_t value;
+
+		posting_cursor_init(&cursor, posting);
+		for (n = 0; posting_next(&cursor, &value); ++n)
+			offsets[n] = value;
+
+		block = posting->head;
+		while (block) {
+			struct posting_block *next = block->next;
+			env_free(env, block, sizeof(struct posting_block));
+			block = next;
+		}
+
+		posting->head = NULL;
+		memcpy(posting->offsets, offsets, n * sizeof(uint32_t));
+	}
+}
+
+/*
+ * Add a value to the key in the leaf slot,
+ * creating the posting list if needed.
+ */
+static void slot_add_value(env_t *env, node_t *leaf, int index, uint32_t offset) {
+	struct posting *posting = (struct posting *)leaf->pointers[index];
+
+	if (!posting) {
+		posting = (struct posting *)env_alloc(env, sizeof(struct posting));
+		if (!posting) {
+			perror("Posting creation");
+			exit(EXIT_FAILURE);
+		}
+
+		posting_add(env, posting, leaf->_pointers[index]);
+		leaf->pointers[index] = posting;
+	}
+
+	posting_add(env, posting, offset);
+	leaf->_pointers[index] = posting_first(posting);
+}
+
+/*
+ * Remove a value from the key in the leaf slot.
+ * A list with a single value left is folded
+ * back into the slot.
+ */
+static void slot_remove_value(env_t *env, node_t *leaf, int index, uint32_t offset) {
+	struct posting *posting = (struct posting *)leaf->pointers[index];
+
+	posting_remove(env, posting, offset);
+	leaf->_pointers[index] = posting_first(posting);
+
+	if (posting->count == 1) {
+		posting_free(env, posting);
+		leaf->pointers[index] = NULL;
+	}
+}
+
+/*
+ * Point the slot at a moved value.
+ */
+static void slot_move_value(env_t *env, node_t *leaf, int index, uint32_t from, uint32_t to) {
+	if (!leaf->pointers[index]) {
+		leaf->_pointers[index] = to;
+		return;
+	}
+
+	slot_remove_value(env, leaf, index, from);
+	slot_add_value(env, leaf, index, to);
+}
+
+/*
+ * Call fn for every value of the key. Values
+ * are read in heap order after a single descent.
+ * Returns the number of values visited.
+ */
+static int find_all(db_t **db, int key, hook_visit fn, void *ctx) {
+	struct posting_cursor cursor;
+	node_t *leaf;
+	int index, visited = 0;
+	uint32_t offset;
+
+	assert(fn);
+
+	if (!find_slot(db, key, &leaf, &index))
+		return 0;
+
+	if (!leaf->pointers[index]) {
+		record_t *record = db_read_record(db, leaf->_pointers[index]);
+		if (!record)
+			return 0;
+
+		fn(key, record, ctx);
+		env_free_record((*db)->env, record);
+		return 1;
+	}
+
+	posting_cursor_init(&cursor, (struct posting *)leaf->pointers[index]);
+	while (posting_next(&cursor, &offset)) {
+		record_t *record = db_read_record(db, offset);
+		if (!record)
+			continue;
+
+		visited++;
+		bool more = fn(key, record, ctx);
+		env_free_record((*db)->env, record);
+		if (!more)
+			break;
+	}
+
+	return visited;
+}
+
+int ytree_find_all(db_t **db, int key, hook_visit fn, void *ctx) {
+	int visited = find_all(db, key, fn, ctx);
+
+	CAPTURE(db, CAPTURE_FIND_ALL, key, visited, 0);
+	return visited;
+}
+
+/*
+ * Call fn for every key in the range key_start to
+ * key_end inclusive, in key order, with its record.
+ * All values of a duplicated key are visited. The
+ * walk starts with one descent and then follows
+ * the leaf chain. Returns the number of records
+ * visited.
+ */
+static int find_range(db_t **db, int key_start, int key_end, hook_visit fn, void *ctx) {
+	int i, visited = 0;
+
+	assert(fn);
+
+	node_t *n = find_leaf(db, key_start);
+	if (!n)
+		return 0;
+
+	for (i = 0; i < n->num_keys && n->keys[i] < key_start; ++i);
+
+	for (; n; n = n->pointers[(*db)->order - 1], i = 0) {
+		for (; i < n->num_keys; ++i) {
+			struct posting *posting = (struct posting *)n->pointers[i];
+			struct posting_cursor cursor;
+			uint32_t offset = n->_pointers[i];
+
+			if (n->keys[i] > key_end)
+				return visited;
+
+			if (posting)
+				posting_cursor_init(&cursor, posting);
+
+			while (!posting || posting_next(&cursor, &offset)) {
+				record_t *record = db_read_record(db, offset);
+				if (record) {
+					bool more = fn(n->keys[i], record, ctx);
+					env_free_record((*db)->env, record);
+					visited++;
+					if (!more)
+						return visited;
+				}
+
+				if (!posting)
+					break;
+			}
+		}
+	}
+
+	return visited;
+}
+
+int ytree_range(db_t **db, int key_start, int key_end, hook_visit fn, void *ctx) {
+	uint64_t start = latency_begin(db);
+	int visited = find_range(db, key_start, key_end, fn, ctx);
+
+	CAPTURE(db, CAPTURE_RANGE, key_start, visited, 0);
+	latency_end(db, LAT_RANGE, start);
+	return visited;
+}
+
+/* ********************************
+ * SECONDARY INDEX
+ * ********************************/
+
+/*
+ * Extract the indexed value from a record.
+ * Without an extractor, integer and character
+ * values are indexed as is. Returns false if
+ * the record is not indexed.
+ */
+static bool index_key(db_t **db, record_t *record, int *value) {
+	if (!(*db)->index)
+		return false;
+
+	if ((*db)->extract)
+		return (*db)->extract(record, value);
+
+	switch (record->value_type) {
+		case DT_CHAR:
+			*value = record->value._char;
+			return true;
+		case DT_INT:
+			*value = record->value._int;
+			return true;
+		default:
+			break;
+	}
+
+	return false;
+}
+
+/*
+ * The index maps each value to the primary
+ * keys holding it, as a duplicated key.
+ */
+static void index_put(db_t **db, int key, int value) {
+	record_t primary;
+
+	memset(&primary, 0, sizeof(record_t));
+	primary.value_type = DT_INT;
+	primary.value._int = key;
+	insert_record(&(*db)->index, value, &primary);
+}
+
+static void index_drop(db_t **db, int key, int value) {
+	record_t primary;
+
+	memset(&primary, 0, sizeof(record_t));
+	primary.value_type = DT_INT;
+	primary.value._int = key;
+	delete_value(&(*db)->index, value, &primary);
+}
+
+static void index_record(db_t **db, int key, record_t *record) {
+	int value;
+	if (index_key(db, record, &value))
+		index_put(db, key, value);
+}
+
+static void unindex_record(db_t **db, int key, record_t *record) {
+	int value;
+	if (index_key(db, record, &value))
+		index_drop(db, key, value);
+}
+
+/*
+ * Declare a secondary index on the record values
+ * of the database, stored in schema slot index.
+ * Values are taken from the record by extract,
+ * or used as is if extract is NULL. Existing
+ * records are indexed right away.
+ */
+void ytree_index_init(short index, db_t **db, hook_extract extract) {
+	node_t *c = (*db)->root;
+	int i;
+
+	assert(index != (*db)->schema_id);
+	assert(!(*db)->index);
+
+	ytree_db_init(index, &(*db)->index, &(*db)->env);
+	ytree_order(&(*db)->index, (*db)->tree_order);
+	(*db)->index->flags |= DB_FLAG_DUPLICATE;
+	(*db)->extract = extract;
+
+	if ((*db)->env->capture)
+		capture_setup(db);
+
+	if (!c)
+		return;
+
+	while (!c->is_leaf)
+		c = c->pointers[0];
+
+	for (; c; c = c->pointers[(*db)->order - 1]) {
+		for (i = 0; i < c->num_keys; ++i) {
+			struct posting *posting = (struct posting *)c->pointers[i];
+			struct posting_cursor cursor;
+			uint32_t offset = c->_pointers[i];
+
+			if (posting)
+				posting_cursor_init(&cursor, posting);
+
+			while (!posting || posting_next(&cursor, &offset)) {
+				record_t *record = db_read_record(db, offset);
+				if (record) {
+					index_record(db, c->keys[i], record);
+					env_free_record((*db)->env, record);
+				}
+
+				if (!posting)
+					break;
+			}
+		}
+	}
+}
+
+/*
+ * Turns index entries into the primary key
+ * and indexed value for ytree_index_range.
+ */
+struct index_visit {
+	hook_visit fn;							// User callback
+	void *ctx;								// User context
+};
+
+static bool index_range_visit(int value, record_t *primary, void *ctx) {
+	struct index_visit *visit = (struct index_visit *)ctx;
+	record_t record;
+
+	memset(&record, 0, sizeof(record_t));
+	record.value_type = DT_INT;
+	record.value._int = value;
+
+	return visit->fn(primary->value._int, &record, visit->ctx);
+}
+
+/*
+ * Call fn with the primary key of every record
+ * whose indexed value is in the range value_start
+ * to value_end inclusive, in value order. The
+ * record passed holds the indexed value. Timed
+ * and captured as a range of the database itself.
+ * Returns the number of keys visited.
+ */
+int ytree_index_range(db_t **db, int value_start, int value_end, hook_visit fn, void *ctx) {
+	struct index_visit visit;
+	uint64_t start;
+	int visited;
+
+	assert(fn);
+
+	if (!(*db)->index)
+		return 0;
+
+	start = latency_begin(db);
+	visit.fn = fn;
+	visit.ctx = ctx;
+	visited = find_range(&(*db)->index, value_start, value_end, &index_range_visit, &visit);
+
+	CAPTURE(db, CAPTURE_INDEX_RANGE, value_start, visited, 0);
+	latency_end(db, LAT_RANGE, start);
+	return visited;
+}
+
+/* ********************************
+ * INSERTION
+ * ********************************/
+
+/*
+ * Set the value of a new record.
+ */
+static void record_set(record_t *record, enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize) {
+	switch (type) {
+		case DT_CHAR:
+			record->value._char = c_value;
+			break;
+		case DT_INT:
+			record->value._int = i_value;
+			break;
+		case DT_FLOAT:
+			record->value._float = f_value;
+			break;
+		case DT_DATA:
+			record->value._data = p_value;
+			break;
+	}
+	record->value_type = type;
+	record->value_size = vsize;
+}
+
+/* 
+ * Creates a new record to hold the value
+ * to which a key refers. The record comes from
+ * calloc and is released with free, as it is
+ * not tied to an environment. Data is referenced,
+ * not copied.
+ */
+record_t *make_record(enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize) {
+	record_t *new_record = (record_t *)calloc(1, sizeof(record_t));
+	if (!new_record) {
+		perror("Record creation");
+		exit(EXIT_FAILURE);
+	}
+
+	record_set(new_record, type, c_value, i_value, f_value, p_value, vsize);
+	return new_record;
+}
+
+/*
+ * Creates a new record from the allocator of
+ * the environment, released with ytree_free_record.
+ * Data is copied into the record.
+ */
+record_t *ytree_make_record(env_t **env, enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize) {
+	record_t *new_record = alloc_record(*env, type == DT_DATA ? vsize : 0);
+
+	record_set(new_record, type, c_value, i_value, f_value, new_record + 1, vsize);
+	if (type == DT_DATA && vsize)
+		memcpy(new_record + 1, p_value, vsize);
+	return new_record;
+}
+
+/*
+ * Create a new record using valuepair. This 
+ * is compatible with other databases.
+ */
+record_t *ytree_new_record(valuepair_t *pair) {
+	return make_record(DT_DATA, 0, 0, 0, pair->data, pair->size);
+}
+
+/* TODO */
+int ytree_record_size(record_t *record) {
+	switch (record->value_type) {
+		case DT_CHAR:
+			return sizeof(char);
+		case DT_INT:
+			return sizeof(int);
+		case DT_FLOAT:
+			return sizeof(float);
+		case DT_DATA:
+			return record->value_size;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates a new general node, which can be adapted
+ * to serve as either a leaf or an internal node.
+ */
+static node_t *make_node_raw(db_t **db, bool is_leaf) {
+	env_t *env = (*db)->env;
+	node_t *new_node = (node_t *)env_alloc(env, sizeof(node_t));
+	if (!new_node) {
+		perror("Node creation.");
+		exit(EXIT_FAILURE);
+	}
+
+	new_node->keys = env_alloc_aligned(env, ((*db)->order - 1) * sizeof(int));
+	if (!new_node->keys) {
+		perror("New node keys array.");
+		exit(EXIT_FAILURE);
+	}
+
+	/* TODO remove */
+	new_node->pointers = env_alloc(env, (*db)->order * sizeof(void *));
+	if (!new_node->pointers) {
+		perror("New node pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	new_node->_pointers = env_alloc(env, (*db)->order * sizeof(uint32_t));
+	if (!new_node->_pointers) {
+		perror("New node pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	new_node->is_leaf = is_leaf;
+	new_node->order = (*db)->order;
+	new_node->num_keys = 0;
+	new_node->parent = NULL;
+	new_node->next = NULL;
+	return new_node;
+}
+
+/* Release the key and pointer arrays of a node */
+static void free_node_arrays(env_t *env, node_t *node) {
+	env_free_aligned(env, node->keys, (node->order - 1) * sizeof(int));
+	env_free(env, node->pointers, node->order * sizeof(void *));
+	env_free(env, node->_pointers, node->order * sizeof(uint32_t));
+}
+
+/*
+ * Release a node and its
+ * key and pointer arrays.
+ */
+static void free_node(env_t *env, node_t *node) {
+	free_node_arrays(env, node);
+	env_free(env, node, sizeof(node_t));
+}
+
+/* 
+ * Creates a new leaf by creating a node
+ * and then adapting it appropriately.
+ */
+#define make_leaf(d) make_node_raw(d,true)
+#define make_node(d) make_node_raw(d,false)
+
+/* Helper function used in insert_into_parent
+ * to find the index of the parent's pointer to 
+ * the node to the left of the key to be inserted.
+ */
+static int get_left_index(node_t *parent, node_t *left) {
+	int left_index = 0;
+	while (left_index <= parent->num_keys && parent->pointers[left_index] != left)
+		left_index++;
+
+	return left_index;
+}
+
+/*
+ * Inserts a new pointer to a record and its corresponding
+ * key into a leaf.
+ * Returns the altered leaf.
+ */
+static void insert_into_leaf(node_t *leaf, int key, uint32_t offset) {
+	int i, insertion_point;
+
+	insertion_point = 0;
+	while (insertion_point < leaf->num_keys && leaf->keys[insertion_point] < key)
+		insertion_point++;
+
+	for (i = leaf->num_keys; i > insertion_point; i--) {
+		leaf->keys[i] = leaf->keys[i - 1];
+		leaf->pointers[i] = leaf->pointers[i - 1];
+		leaf->_pointers[i] = leaf->_pointers[i - 1];
+	}
+
+	leaf->keys[insertion_point] = key;
+	leaf->pointers[insertion_point] = 0;
+	leaf->_pointers[insertion_point] = offset;
+	leaf->num_keys++;
+}
+
+/* 
+ * Inserts a new key and pointer
+ * to a new record into a leaf so as to exceed
+ * the tree's order, causing the leaf to be split
+ * in half.
+ */
+static void insert_into_leaf_after_splitting(db_t **db, node_t *leaf, int key, uint32_t offset) {
+	node_t *new_leaf = make_leaf(db);
+
+	(*db)->generation++;
+	(*db)->stats.leaf_splits++;
+	TRACE_DB(db, TRACE_LEAF_SPLIT, key);
+
+	int *temp_keys = (int *)env_alloc((*db)->env, (*db)->order * sizeof(int));
+	if (!temp_keys) {
+		perror("Temporary keys array.");
+		exit(EXIT_FAILURE);
+	}
+
+	/* TODO remove */
+	void **temp_pointers = env_alloc((*db)->env, (*db)->order * sizeof(void *));
+	if (!temp_pointers) {
+		perror("Temporary pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t *temp__pointers = env_alloc((*db)->env, (*db)->order * sizeof(uint32_t));
+	if (!temp__pointers) {
+		perror("Temporary _pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	int insertion_index = 0;
+	while (insertion_index < (*db)->order - 1 && leaf->keys[insertion_index] < key)
+		insertion_index++;
+
+	int i, j;
+	for (i = 0, j = 0; i < leaf->num_keys; i++, j++) {
+		if (j == insertion_index)
+			j++;
+		temp_keys[j] = leaf->keys[i];
+		temp_pointers[j] = leaf->pointers[i];
+		temp__pointers[j] = leaf->_pointers[i];
+	}
+
+	temp_keys[insertion_index] = key;
+	temp_pointers[insertion_index] = 0;//pointer;
+	temp__pointers[insertion_index] = offset;
+
+	leaf->num_keys = 0;
+
+	int split = cut((*db)->order - 1);
+
+	for (i = 0; i < split; i++) {
+		leaf->pointers[i] = temp_pointers[i];
+		leaf->_pointers[i] = temp__pointers[i];
+		leaf->keys[i] = temp_keys[i];
+		leaf->num_keys++;
+	}
+
+	for (i = split, j = 0; i < (*db)->order; i++, j++) {
+		new_leaf->pointers[j] = temp_pointers[i];
+		new_leaf->_pointers[j] = temp__pointers[i];
+		new_leaf->keys[j] = temp_keys[i];
+		new_leaf->num_keys++;
+	}
+
+	env_free((*db)->env, temp_pointers, (*db)->order * sizeof(void *));
+	env_free((*db)->env, temp__pointers, (*db)->order * sizeof(uint32_t));
+	env_free((*db)->env, temp_keys, (*db)->order * sizeof(int));
+
+	/* Create the sequence chain */
+	new_leaf->pointers[(*db)->order - 1] = leaf->pointers[(*db)->order - 1];
+	new_leaf->_pointers[(*db)->order - 1] = leaf->_pointers[(*db)->order - 1];
+	leaf->pointers[(*db)->order - 1] = new_leaf;
+	//leaf->pointers_[(*db)->order - 1] = ? TODO
+
+	for (i = leaf->num_keys; i < (*db)->order - 1; i++) {
+		leaf->pointers[i] = NULL;
+		leaf->_pointers[i] = 0;
+	}
+	for (i = new_leaf->num_keys; i < (*db)->order - 1; i++) {
+		new_leaf->pointers[i] = NULL;
+		new_leaf->_pointers[i] = 0;
+	}
+
+	new_leaf->parent = leaf->parent;
+
+	insert_into_parent(db, leaf, new_leaf->keys[0], new_leaf);
+}
+
+/*
+ * Inserts a new key and pointer to a node
+ * into a node into which these can fit
+ * without violating the B+Tree properties.
+ */
+static void insert_into_node(db_t **db, node_t *n, int left_index, int key, node_t *right) {
+	int i;
+	for (i = n->num_keys; i > left_index; i--) {
+		n->pointers[i + 1] = n->pointers[i];
+		n->_pointers[i + 1] = n->_pointers[i];
+		n->keys[i] = n->keys[i - 1];
+	}
+
+	n->pointers[left_index + 1] = right;
+	n->keys[left_index] = key;
+	n->num_keys++;
+}
+
+
+/*
+ * Inserts a new key and pointer to a node
+ * into a node, causing the node's size to exceed
+ * the order, and causing the node to split into two.
+ */
 static void insert_into_node_after_splitting(db_t **db, node_t *old_node, int left_index, int key, node_t *right) {
 	node_t *child;
 
-	/*
-	 * First create a temporary set of keys and pointers
-	 * to hold everything in order, including
-	 * the new key and pointer, inserted in their
-	 * correct places. 
-	 * Then create a new node and copy half of the 
-	 * keys and pointers to the old node and
-	 * the other half to the new.
+	(*db)->stats.internal_splits++;
+	TRACE_DB(db, TRACE_INTERNAL_SPLIT, key);
+
+	/*
+	 * First create a temporary set of keys and pointers
+	 * to hold everything in order, including
+	 * the new key and pointer, inserted in their
+	 * correct places. 
+	 * Then create a new node and copy half of the 
+	 * keys and pointers to the old node and
+	 * the other half to the new.
+	 */
+	node_t **temp_pointers = env_alloc((*db)->env, ((*db)->order + 1) * sizeof(node_t *));
+	if (!temp_pointers) {
+		perror("Temporary pointers array for splitting nodes.");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t *temp__pointers = env_alloc((*db)->env, ((*db)->order + 1) * sizeof(uint32_t));
+	if (!temp__pointers) {
+		perror("Temporary _pointers array.");
+		exit(EXIT_FAILURE);
+	}
+
+	int *temp_keys = env_alloc((*db)->env, (*db)->order * sizeof(int));
+	if (!temp_keys) {
+		perror("Temporary keys array for splitting nodes.");
+		exit(EXIT_FAILURE);
+	}
+
+	int i, j;
+	for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
+		if (j == left_index + 1) j++;
+		temp_pointers[j] = old_node->pointers[i];
+		temp__pointers[j] = old_node->_pointers[i];
+	}
+
+	for (i = 0, j = 0; i < old_node->num_keys; i++, j++) {
+		if (j == left_index) j++;
+		temp_keys[j] = old_node->keys[i];
+	}
+
+	temp_pointers[left_index + 1] = right;
+	temp_keys[left_index] = key;
+
+	/*
+	 * Create the new node and copy
+	 * half the keys and pointers to the
+	 * old and half to the new.
+	 */  
+	int split = cut((*db)->order);
+	node_t *new_node = make_node(db);
+	old_node->num_keys = 0;
+	for (i = 0; i < split - 1; i++) {
+		old_node->pointers[i] = temp_pointers[i];
+		old_node->_pointers[i] = temp__pointers[i];
+		old_node->keys[i] = temp_keys[i];
+		old_node->num_keys++;
+	}
+	old_node->pointers[i] = temp_pointers[i];
+	old_node->_pointers[i] = temp__pointers[i];
+	int k_prime = temp_keys[split - 1];
+	for (++i, j = 0; i < (*db)->order; i++, j++) {
+		new_node->pointers[j] = temp_pointers[i];
+		new_node->_pointers[j] = temp__pointers[i];
+		new_node->keys[j] = temp_keys[i];
+		new_node->num_keys++;
+	}
+	new_node->pointers[j] = temp_pointers[i];
+	new_node->_pointers[j] = temp__pointers[i];
+	env_free((*db)->env, temp_pointers, ((*db)->order + 1) * sizeof(node_t *));
+	env_free((*db)->env, temp__pointers, ((*db)->order + 1) * sizeof(uint32_t));
+	env_free((*db)->env, temp_keys, (*db)->order * sizeof(int));
+	new_node->parent = old_node->parent;
+	for (i = 0; i <= new_node->num_keys; i++) {
+		child = new_node->pointers[i];
+		child->parent = new_node;
+	}
+
+	/*
+	 * Insert a new key into the parent of the two
+	 * nodes resulting from the split, with
+	 * the old node to the left and the new to the right.
+	 */
+	insert_into_parent(db, old_node, k_prime, new_node);
+}
+
+/* 
+ * Inserts a new node (leaf or internal node) into the B+Tree.
+ * Returns the root of the tree after insertion.
+ */
+static void insert_into_parent(db_t **db, node_t *left, int key, node_t *right) {
+	node_t *parent = left->parent;
+
+	/* 
+	 *Case: new root.
+	 */
+	if (!parent) {
+		insert_into_new_root(db, left, key, right);
+		return;
+	}
+
+	/*
+	 * Case: leaf or node.
+	 * (Remainder of function body.)  
+	 */
+
+	/*
+	 * Find the parent's pointer to the left 
+	 * node.
+	 */
+	int left_index = get_left_index(parent, left);
+
+	/*
+	 * Simple case: the new key fits into the node. 
+	 */
+	if (parent->num_keys < (*db)->order - 1) {
+		insert_into_node(db, parent, left_index, key, right);
+		return;
+	}
+
+	/* 
+	 * Harder case: split a node in order 
+	 * to preserve the B+ tree properties.
+	 */
+	insert_into_node_after_splitting(db, parent, left_index, key, right);
+}
+
+/* 
+ * Creates a new root for two subtrees
+ * and inserts the appropriate key into
+ * the new root.
+ */
+static void insert_into_new_root(db_t **db, node_t *left, int key, node_t *right) {
+	node_t *root = make_node(db);
+	root->keys[0] = key;
+	root->pointers[0] = left;
+	root->pointers[1] = right;
+	root->num_keys++;
+	root->parent = NULL;
+	left->parent = root;
+	right->parent = root;
+	(*db)->root = root;
+	(*db)->stats.root_changes++;
+	TRACE_DB(db, TRACE_ROOT_CHANGE, key);
+}
+
+/*
+ * First insertion:
+ * start a new tree.
+ */
+static void start_new_tree(db_t **db, int key, uint32_t offset) {
+	node_t *root = make_leaf(db);
+	root->keys[0] = key;
+	root->pointers[0] = NULL;
+	root->pointers[(*db)->order - 1] = NULL;
+	root->_pointers[0] = offset;
+	root->_pointers[(*db)->order - 1] = 0;
+	root->parent = NULL;
+	root->num_keys++;
+	(*db)->root = root;
+	(*db)->generation++;
+	(*db)->stats.root_changes++;
+	TRACE_DB(db, TRACE_ROOT_CHANGE, key);
+}
+
+/*
+ * Master insertion function.
+ * Inserts a key and an associated value into
+ * the B+Tree, causing the tree to be adjusted
+ * however necessary to maintain the B+ tree
+ * properties.
+ */
+static void insert_record(db_t **db, int key, record_t *pointer) {
+	assert(pointer);
+
+	/*
+	 * Duplicates are ignored unless the database
+	 * allows them, in which case the value is
+	 * added to the posting list of the key.
+	 */
+	node_t *slot_leaf;
+	int slot_index;
+	if (find_slot(db, key, &slot_leaf, &slot_index)) {
+		if ((*db)->flags & DB_FLAG_DUPLICATE) {
+			slot_add_value((*db)->env, slot_leaf, slot_index, db_write_record(db, pointer));
+			front_invalidate(db, key);
+			index_record(db, key, pointer);
+		}
+		return;
+	}
+
+	/*
+	 * Write record to page.
+	 */
+	uint32_t offset = db_write_record(db, pointer);
+	index_record(db, key, pointer);
+	(*db)->keys++;
+
+	/*
+	 * Case: the tree does not exist yet.
+	 * Start a new tree.
+	 */
+	if (!(*db)->root) {
+		start_new_tree(db, key, offset);
+		return;
+	}
+
+	/* 
+	 * Case: the tree already exists.
+	 * (Rest of function body.)
+	 */
+	node_t *leaf = find_leaf(db, key);
+
+	/*
+	 * Case: small database without room, the leaf
+	 * is widened or the tree is built from it.
+	 */
+	if ((*db)->small && leaf->num_keys == (*db)->order - 1)
+		leaf = small_grow(db, key);
+
+	/* 
+	 *Case: leaf has room for key and offset.
+	 */
+	if (leaf->num_keys < (*db)->order - 1) {
+		insert_into_leaf(leaf, key, offset);
+		return;
+	}
+
+	/*
+	 * Case: leaf must be split.
+	 */
+	insert_into_leaf_after_splitting(db, leaf, key, offset);
+}
+
+void ytree_insert(db_t **db, int key, record_t *pointer) {
+	uint64_t start = latency_begin(db);
+
+	(*db)->stats.bytes_logical += sizeof(int) + ytree_record_size(pointer);
+	CAPTURE(db, CAPTURE_INSERT, key, ytree_record_size(pointer), pointer->value_type);
+	insert_record(db, key, pointer);
+	latency_end(db, LAT_INSERT, start);
+}
+
+/* ********************************
+ * UPDATE
+ * ********************************/
+
+/*
+ * Compare the type and value of two records.
+ */
+static bool record_equal(record_t *a, record_t *b) {
+	if (a->value_type != b->value_type)
+		return false;
+
+	switch (a->value_type) {
+		case DT_CHAR:
+			return a->value._char == b->value._char;
+		case DT_INT:
+			return a->value._int == b->value._int;
+		case DT_FLOAT:
+			return a->value._float == b->value._float;
+		case DT_DATA:
+			return a->value_size == b->value_size
+				&& !memcmp(a->value._data, b->value._data, a->value_size);
+	}
+
+	return false;
+}
+
+/*
+ * Store a new value for the key in the slot.
+ * If it takes as much room in the heap as the
+ * old value it is overwritten in place, else
+ * the new value is appended to the heap and
+ * the leaf is pointed at it.
+ */
+static void update_slot(db_t **db, node_t *leaf, int index, record_t *old, record_t *record) {
+	if (record_disk_size(old) == record_disk_size(record)) {
+		db_rewrite_record(db, leaf->_pointers[index], record);
+		return;
+	}
+
+	slot_move_value((*db)->env, leaf, index, leaf->_pointers[index], db_write_record(db, record));
+	front_invalidate(db, leaf->keys[index]);
+}
+
+/*
+ * Add delta to the value of an integer or float
+ * record in a single descent. Returns false if
+ * the key does not exist or the value is not
+ * numeric.
+ */
+bool ytree_incr(db_t **db, int key, double delta) {
+	node_t *leaf;
+	int index;
+	bool updated = true;
+
+	if ((*db)->env->capture) {
+		float value = (float)delta;
+		int32_t bits;
+
+		memcpy(&bits, &value, sizeof(int32_t));
+		capture_record(db, CAPTURE_INCR, key, bits, DT_FLOAT);
+	}
+
+	if (!find_slot(db, key, &leaf, &index))
+		return false;
+
+	record_t *record = db_read_record(db, leaf->_pointers[index]);
+	if (!record)
+		return false;
+
+	int before;
+	bool indexed = index_key(db, record, &before);
+
+	switch (record->value_type) {
+		case DT_INT:
+			record->value._int += (int)delta;
+			break;
+		case DT_FLOAT:
+			record->value._float += (float)delta;
+			break;
+		default:
+			updated = false;
+			break;
+	}
+
+	if (updated) {
+		db_rewrite_record(db, leaf->_pointers[index], record);
+		(*db)->stats.bytes_logical += sizeof(int) + ytree_record_size(record);
+		if (indexed)
+			index_drop(db, key, before);
+		index_record(db, key, record);
+	}
+
+	env_free_record((*db)->env, record);
+	return updated;
+}
+
+/*
+ * Replace the value of key with record if the
+ * current value equals expected. Returns true
+ * if the value was replaced.
+ */
+bool ytree_cas(db_t **db, int key, record_t *expected, record_t *record) {
+	node_t *leaf;
+	int index;
+	bool swapped = false;
+
+	assert(expected);
+	assert(record);
+
+	CAPTURE(db, CAPTURE_CAS, key, ytree_record_size(record), record->value_type);
+	if (!find_slot(db, key, &leaf, &index))
+		return false;
+
+	record_t *current = db_read_record(db, leaf->_pointers[index]);
+	if (!current)
+		return false;
+
+	if (record_equal(current, expected)) {
+		update_slot(db, leaf, index, current, record);
+		(*db)->stats.bytes_logical += sizeof(int) + ytree_record_size(record);
+		unindex_record(db, key, current);
+		index_record(db, key, record);
+		swapped = true;
+	}
+
+	env_free_record((*db)->env, current);
+	return swapped;
+}
+
+/*
+ * Pass the value of key to fn and store the
+ * record again if fn returns true. The callback
+ * may change the value in place or point the
+ * data at another buffer.
+ */
+bool ytree_update(db_t **db, int key, hook_update fn, void *ctx) {
+	node_t *leaf;
+	int index;
+	bool updated = false;
+
+	assert(fn);
+
+	CAPTURE(db, CAPTURE_UPDATE, key, 0, 0);
+	if (!find_slot(db, key, &leaf, &index))
+		return false;
+
+	record_t *record = db_read_record(db, leaf->_pointers[index]);
+	if (!record)
+		return false;
+
+	int before;
+	bool indexed = index_key(db, record, &before);
+
+	/* The callback may change the size of the value */
+	size_t size = record_disk_size(record);
+	size_t block = record_alloc_size(record);
+	if (fn(record, ctx)) {
+		if (record_disk_size(record) == size) {
+			db_rewrite_record(db, leaf->_pointers[index], record);
+		} else {
+			slot_move_value((*db)->env, leaf, index, leaf->_pointers[index], db_write_record(db, record));
+			front_invalidate(db, key);
+		}
+		(*db)->stats.bytes_logical += sizeof(int) + ytree_record_size(record);
+		if (indexed)
+			index_drop(db, key, before);
+		index_record(db, key, record);
+		updated = true;
+	}
+
+	env_free((*db)->env, record, block);
+	return updated;
+}
+
+/* ********************************
+ * DELETION
+ * ********************************/
+
+/* 
+ * Utility function for deletion. Retrieves
+ * the index of a node's nearest neighbor (sibling)
+ * to the left if one exists.  If not (the node
+ * is the leftmost child), returns -1 to signify
+ * this special case.
+ */
+static int get_neighbor_index(node_t *n) {
+	/* Return the index of the key to the left
+	 * of the pointer in the parent pointing
+	 * to n.  
+	 * If n is the leftmost child, this means
+	 * return -1.
+	 */
+
+	int i;
+	for (i = 0; i <= n->parent->num_keys; ++i)
+		if (n->parent->pointers[i] == n)
+			return i - 1;
+
+	// Error state.
+	printf("Search for nonexistent pointer to node in parent.\n");
+	printf("Node:  %#x\n", (unsigned int)(uintptr_t)n);
+	exit(EXIT_FAILURE);
+}
+
+static node_t *remove_entry_from_node(db_t **db, node_t *n, int key, node_t *pointer) {
+	/* Remove the key and shift other keys accordingly. */
+	int i = 0;
+	while (n->keys[i] != key)
+		i++;
+	int key_index = i;
+	for (++i; i < n->num_keys; i++)
+		n->keys[i - 1] = n->keys[i];
+
+	/*
+	 * In a leaf the pointers are paired with the
+	 * keys, so shift them from the same index. In
+	 * an internal node, search for the child pointer.
+	 */
+	if (n->is_leaf) {
+		for (i = key_index + 1; i < n->num_keys; i++) {
+			n->pointers[i - 1] = n->pointers[i];
+			n->_pointers[i - 1] = n->_pointers[i];
+		}
+	} else {
+		i = 0;
+		while (n->pointers[i] != pointer)
+			i++;
+		for (++i; i < n->num_keys + 1; i++)
+			n->pointers[i - 1] = n->pointers[i];
+	}
+
+	/* One key fewer. */
+	n->num_keys--;
+
+	// Set the other pointers to NULL for tidiness.
+	// A leaf uses the last pointer to point to the next leaf.
+	if (n->is_leaf)
+		for (i = n->num_keys; i < (*db)->order - 1; i++) {
+			n->pointers[i] = NULL;
+			n->_pointers[i] = 0;
+		}
+	else
+		for (i = n->num_keys + 1; i < (*db)->order; i++)
+			n->pointers[i] = NULL;
+
+	return n;
+}
+
+static node_t *adjust_root(db_t **db) {
+	node_t *new_root = NULL;
+
+	/* Case: nonempty root.
+	 * Key and pointer have already been deleted,
+	 * so nothing to be done.
+	 */
+	if ((*db)->root->num_keys > 0)
+		return (*db)->root;
+
+	/* Case: empty root. 
+	 */
+	(*db)->generation++;
+	(*db)->stats.root_changes++;
+	TRACE_DB(db, TRACE_ROOT_CHANGE, 0);
+
+	/*
+	 * If it has a child, promote 
+	 * the first (only) child
+	 * as the new root. If node is leaf
+	 * root becomes empty.
+	 */
+	if (!(*db)->root->is_leaf) {
+		new_root = (*db)->root->pointers[0];
+		new_root->parent = NULL;
+	}
+
+	free_node((*db)->env, (*db)->root);
+
+	return new_root;
+}
+
+/* Coalesces a node that has become
+ * too small after deletion
+ * with a neighboring node that
+ * can accept the additional entries
+ * without exceeding the maximum.
+ */
+static node_t *coalesce_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime) {
+	int i, j, neighbor_insertion_index, n_end;
+	node_t * tmp;
+
+	(*db)->generation++;
+	(*db)->stats.coalesces++;
+	TRACE_DB(db, TRACE_COALESCE, k_prime);
+
+	/* Swap neighbor with node if node is on the
+	 * extreme left and neighbor is to its right.
+	 */
+	if (neighbor_index == -1) {
+		tmp = n;
+		n = neighbor;
+		neighbor = tmp;
+	}
+
+	/* Starting point in the neighbor for copying
+	 * keys and pointers from n.
+	 * Recall that n and neighbor have swapped places
+	 * in the special case of n being a leftmost child.
+	 */
+	neighbor_insertion_index = neighbor->num_keys;
+
+	/* Case:  nonleaf node.
+	 * Append k_prime and the following pointer.
+	 * Append all pointers and keys from the neighbor.
+	 */
+
+	if (!n->is_leaf) {
+
+		/* Append k_prime.
+		 */
+
+		neighbor->keys[neighbor_insertion_index] = k_prime;
+		neighbor->num_keys++;
+
+
+		n_end = n->num_keys;
+
+		for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
+			neighbor->keys[i] = n->keys[j];
+			neighbor->pointers[i] = n->pointers[j];
+			neighbor->num_keys++;
+			n->num_keys--;
+		}
+
+		/* The number of pointers is always
+		 * one more than the number of keys.
+		 */
+
+		neighbor->pointers[i] = n->pointers[j];
+
+		/* All children must now point up to the same parent.
+		 */
+
+		for (i = 0; i < neighbor->num_keys + 1; i++) {
+			tmp = (node_t *)neighbor->pointers[i];
+			tmp->parent = neighbor;
+		}
+	}
+
+	/* In a leaf, append the keys and pointers of
+	 * n to the neighbor.
+	 * Set the neighbor's last pointer to point to
+	 * what had been n's right neighbor.
+	 */
+
+	else {
+		for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
+			neighbor->keys[i] = n->keys[j];
+			neighbor->pointers[i] = n->pointers[j];
+			neighbor->_pointers[i] = n->_pointers[j];
+			neighbor->num_keys++;
+		}
+		neighbor->pointers[(*db)->order - 1] = n->pointers[(*db)->order - 1];
+	}
+
+	(*db)->root = delete_entry(db, n->parent, k_prime, n);
+	free_node((*db)->env, n);
+	return (*db)->root;
+}
+
+
+/* Redistributes entries between two nodes when
+ * one has become too small after deletion
+ * but its neighbor is too big to append the
+ * small node's entries without exceeding the
+ * maximum
+ */
+static node_t *redistribute_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime_index, int k_prime) {  
+	int i;
+	node_t *tmp;
+
+	(*db)->generation++;
+	(*db)->stats.redistributions++;
+	TRACE_DB(db, TRACE_REDISTRIBUTE, k_prime);
+
+	/* Case: n has a neighbor to the left. 
+	 * Pull the neighbor's last key-pointer pair over
+	 * from the neighbor's right end to n's left end.
+	 */
+	if (neighbor_index != -1) {
+		if (!n->is_leaf)
+			n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+
+		for (i = n->num_keys; i > 0; i--) {
+			n->keys[i] = n->keys[i - 1];
+			n->pointers[i] = n->pointers[i - 1];
+			n->_pointers[i] = n->_pointers[i - 1];
+		}
+
+		if (!n->is_leaf) {
+			n->pointers[0] = neighbor->pointers[neighbor->num_keys];
+			tmp = (node_t *)n->pointers[0];
+			tmp->parent = n;
+			neighbor->pointers[neighbor->num_keys] = NULL;
+			n->keys[0] = k_prime;
+			n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
+		} else {
+			n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
+			n->_pointers[0] = neighbor->_pointers[neighbor->num_keys - 1];
+			neighbor->pointers[neighbor->num_keys - 1] = NULL;
+			neighbor->_pointers[neighbor->num_keys - 1] = 0;
+			n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
+			n->parent->keys[k_prime_index] = n->keys[0];
+		}
+	} else {  
+		/*
+		 * Case: n is the leftmost child.
+		 * Take a key-pointer pair from the neighbor to the right.
+		 * Move the neighbor's leftmost key-pointer pair
+		 * to n's rightmost position.
+		 */
+		if (n->is_leaf) {
+			n->keys[n->num_keys] = neighbor->keys[0];
+			n->pointers[n->num_keys] = neighbor->pointers[0];
+			n->_pointers[n->num_keys] = neighbor->_pointers[0];
+			n->parent->keys[k_prime_index] = neighbor->keys[1];
+		} else {
+			n->keys[n->num_keys] = k_prime;
+			n->pointers[n->num_keys + 1] = neighbor->pointers[0];
+			tmp = (node_t *)n->pointers[n->num_keys + 1];
+			tmp->parent = n;
+			n->parent->keys[k_prime_index] = neighbor->keys[0];
+		}
+
+		for (i = 0; i < neighbor->num_keys - 1; i++) {
+			neighbor->keys[i] = neighbor->keys[i + 1];
+			neighbor->pointers[i] = neighbor->pointers[i + 1];
+			neighbor->_pointers[i] = neighbor->_pointers[i + 1];
+		}
+
+		if (!n->is_leaf)
+			neighbor->pointers[i] = neighbor->pointers[i + 1];
+	}
+
+	/* n now has one more key and one more pointer;
+	 * the neighbor has one fewer of each.
+	 */
+
+	n->num_keys++;
+	neighbor->num_keys--;
+
+	return (*db)->root;
+}
+
+/* Deletes an entry from the B+ tree.
+ * Removes the record and its key and pointer
+ * from the leaf, and then makes all appropriate
+ * changes to preserve the B+ tree properties.
+ */
+node_t *delete_entry(db_t **db, node_t *n, int key, void *pointer) {
+	int min_keys;
+	node_t *neighbor;
+	int neighbor_index;
+	int k_prime_index, k_prime;
+	int capacity;
+
+	/*
+	 * Remove key and pointer from node.
+	 */
+	n = remove_entry_from_node(db, n, key, pointer);
+
+	/*
+	 * Case:  deletion from the root. 
+	 */
+	if (n == (*db)->root) 
+		return adjust_root(db);
+
+	/* Case:  deletion from a node below the root.
+	 * (Rest of function body.)
+	 */
+
+	/* Determine minimum allowable size of node,
+	 * to be preserved after deletion.
+	 */
+	min_keys = n->is_leaf ? cut((*db)->order - 1) : cut((*db)->order) - 1;
+
+	/* Case:  node stays at or above minimum.
+	 * (The simple case.)
+	 */
+
+	if (n->num_keys >= min_keys)
+		return (*db)->root;
+
+	/* Case:  node falls below minimum.
+	 * Either coalescence or redistribution
+	 * is needed.
 	 */
-	node_t **temp_pointers = calloc(((*db)->order + 1), sizeof(node_t *));
-	if (!temp_pointers) {
-		perror("Temporary pointers array for splitting nodes.");
-		exit(EXIT_FAILURE);
-	}
 
-	uint32_t *temp__pointers = calloc(((*db)->order + 1), sizeof(uint32_t));
-	if (!temp__pointers) {
-		perror("Temporary _pointers array.");
-		exit(EXIT_FAILURE);
+	/* Find the appropriate neighbor node with which
+	 * to coalesce.
+	 * Also find the key (k_prime) in the parent
+	 * between the pointer to node n and the pointer
+	 * to the neighbor.
+	 */
+
+	neighbor_index = get_neighbor_index(n);
+	k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
+	k_prime = n->parent->keys[k_prime_index];
+	neighbor = neighbor_index == -1 ? n->parent->pointers[1] : n->parent->pointers[neighbor_index];
+
+	capacity = n->is_leaf ? (*db)->order : (*db)->order - 1;
+
+	/* Coalescence. */
+	if (neighbor->num_keys + n->num_keys < capacity)
+		return coalesce_nodes(db, n, neighbor, neighbor_index, k_prime);
+
+	/* Redistribution. */
+	return redistribute_nodes(db, n, neighbor, neighbor_index, k_prime_index, k_prime);
+}
+
+/*
+ * Hand the payload of a released data record
+ * to the release hook, if any, and free it.
+ */
+static void release_record(db_t **db, record_t *record) {
+	if (is_data(record)) {
+		void *object = record->value._data;
+		if ((*db)->hooks.object_release)
+			(*db)->hooks.object_release(object);
+		else if ((*db)->hooks.object_release_batch)
+			(*db)->hooks.object_release_batch(&object, 1);
+		else if (release_callback)
+			release_callback(object);
 	}
 
-	int *temp_keys = calloc((*db)->order, sizeof(int));
-	if (!temp_keys) {
-		perror("Temporary keys array for splitting nodes.");
-		exit(EXIT_FAILURE);
+	env_free_record((*db)->env, record);
+}
+
+/*
+ * Read back a removed value to take it out of
+ * the index and hand it to the release hooks.
+ */
+static void drop_value(db_t **db, int key, uint32_t offset) {
+	record_t *record = db_read_record(db, offset);
+	if (!record)
+		return;
+
+	unindex_record(db, key, record);
+	release_record(db, record);
+}
+
+/*
+ * Remove the key in the leaf slot and all its
+ * values. The values are only read back from
+ * the heap if there is a hook to release them to.
+ */
+static void delete_slot(db_t **db, node_t *leaf, int index) {
+	struct posting *posting = (struct posting *)leaf->pointers[index];
+	int key = leaf->keys[index];
+
+	front_invalidate(db, key);
+
+	if ((*db)->hooks.object_release || (*db)->hooks.object_release_batch || release_callback || (*db)->index) {
+		if (posting) {
+			struct posting_cursor cursor;
+			uint32_t offset;
+
+			posting_cursor_init(&cursor, posting);
+			while (posting_next(&cursor, &offset))
+				drop_value(db, key, offset);
+		} else {
+			drop_value(db, key, leaf->_pointers[index]);
+		}
 	}
 
-	int i, j;
-	for (i = 0, j = 0; i < old_node->num_keys + 1; i++, j++) {
-		if (j == left_index + 1) j++;
-		temp_pointers[j] = old_node->pointers[i];
-		temp__pointers[j] = old_node->_pointers[i];
+	if (posting) {
+		posting_free((*db)->env, posting);
+		leaf->pointers[index] = NULL;
 	}
 
-	for (i = 0, j = 0; i < old_node->num_keys; i++, j++) {
-		if (j == left_index) j++;
-		temp_keys[j] = old_node->keys[i];
+	(*db)->root = delete_entry(db, leaf, key, NULL);
+	(*db)->keys--;
+
+	if (!(*db)->root)
+		small_reset(db);
+	else if (((*db)->flags & DB_FLAG_SMALL) && !(*db)->small && (*db)->keys <= SMALL_DEMOTE_KEYS)
+		small_shrink(db);
+}
+
+/* 
+ * Master deletion function
+ */
+void ytree_delete(db_t **db, int key) {
+	uint64_t start = latency_begin(db);
+	node_t *leaf;
+	int index;
+
+	CAPTURE(db, CAPTURE_DELETE, key, 0, 0);
+	if (find_slot(db, key, &leaf, &index))
+		delete_slot(db, leaf, index);
+
+	latency_end(db, LAT_DELETE, start);
+}
+
+/*
+ * Remove a single value of a key. The value is
+ * matched on type and contents. The key is removed
+ * with its last value. Returns true if a value
+ * was removed.
+ */
+static bool delete_value(db_t **db, int key, record_t *value) {
+	struct posting_cursor cursor;
+	node_t *leaf;
+	int index;
+	uint32_t offset;
+
+	assert(value);
+
+	if (!find_slot(db, key, &leaf, &index))
+		return false;
+
+	if (!leaf->pointers[index]) {
+		record_t *record = db_read_record(db, leaf->_pointers[index]);
+		bool match = record && record_equal(record, value);
+
+		env_free_record((*db)->env, record);
+		if (match)
+			delete_slot(db, leaf, index);
+		return match;
 	}
 
-	temp_pointers[left_index + 1] = right;
-	temp_keys[left_index] = key;
+	posting_cursor_init(&cursor, (struct posting *)leaf->pointers[index]);
+	while (posting_next(&cursor, &offset)) {
+		record_t *record = db_read_record(db, offset);
+		if (!record)
+			continue;
+
+		if (record_equal(record, value)) {
+			slot_remove_value((*db)->env, leaf, index, offset);
+			front_invalidate(db, key);
+			unindex_record(db, key, record);
+			release_record(db, record);
+			return true;
+		}
 
-	/*
-	 * Create the new node and copy
-	 * half the keys and pointers to the
-	 * old and half to the new.
-	 */  
-	int split = cut((*db)->order);
-	node_t *new_node = make_node(db);
-	old_node->num_keys = 0;
-	for (i = 0; i < split - 1; i++) {
-		old_node->pointers[i] = temp_pointers[i];
-		old_node->_pointers[i] = temp__pointers[i];
-		old_node->keys[i] = temp_keys[i];
-		old_node->num_keys++;
+		env_free_record((*db)->env, record);
 	}
-	old_node->pointers[i] = temp_pointers[i];
-	old_node->_pointers[i] = temp__pointers[i];
-	int k_prime = temp_keys[split - 1];
-	for (++i, j = 0; i < (*db)->order; i++, j++) {
-		new_node->pointers[j] = temp_pointers[i];
-		new_node->_pointers[j] = temp__pointers[i];
-		new_node->keys[j] = temp_keys[i];
-		new_node->num_keys++;
+
+	return false;
+}
+
+bool ytree_delete_value(db_t **db, int key, record_t *value) {
+	CAPTURE(db, CAPTURE_DELETE_VALUE, key, ytree_record_size(value), value->value_type);
+	return delete_value(db, key, value);
+}
+
+/*
+ * State of a reclaim pass over detached nodes.
+ * The detached nodes are kept on a stack linked
+ * through the next field, so each step frees a
+ * bounded number of nodes without recursion.
+ */
+struct reclaim {
+	node_t *list;							// Detached nodes pending reclaim
+	env_t *env;								// Environment holding the records
+	int fd;									// Private descriptor or -1
+	hook_release object_release;			// Per object release hook
+	hook_release_batch object_release_batch;// Batched release hook
+	record_t *batch[RELEASE_BATCH];			// Records pending release
+	size_t count;							// Number of records in batch
+	env_t detached;							// Copy of the environment for a worker
+};
+
+static void reclaim_init(struct reclaim *rc, db_t **db) {
+	memset(rc, 0, sizeof(struct reclaim));
+	rc->list = (*db)->purge_list;
+	rc->env = (*db)->env;
+	rc->fd = -1;
+	rc->object_release = (*db)->hooks.object_release;
+	rc->object_release_batch = (*db)->hooks.object_release_batch;
+	if (!rc->object_release && !rc->object_release_batch)
+		rc->object_release = release_callback;
+}
+
+/*
+ * Read a record on behalf of the reclaimer. A
+ * background reclaimer uses its own descriptor
+ * and positional reads so it never moves the
+ * file position of the environment.
+ */
+static record_t *reclaim_read_record(struct reclaim *rc, uint32_t offset) {
+#ifndef _WIN32
+	if (rc->fd >= 0)
+		return db_pread_record(rc->env, rc->fd, offset);
+#endif
+	return env_read_record(rc->env, offset);
+}
+
+/*
+ * Pass the batch of released records
+ * to the hooks and free them.
+ */
+static void reclaim_flush(struct reclaim *rc) {
+	void *objects[RELEASE_BATCH];
+	size_t i;
+
+	for (i = 0; i < rc->count; ++i)
+		objects[i] = rc->batch[i]->value._data;
+
+	if (rc->object_release_batch)
+		rc->object_release_batch(objects, rc->count);
+	else
+		for (i = 0; i < rc->count; ++i)
+			rc->object_release(objects[i]);
+
+	for (i = 0; i < rc->count; ++i)
+		env_free_record(rc->env, rc->batch[i]);
+
+	rc->count = 0;
+}
+
+/*
+ * Queue the record at offset for release.
+ * Only data records are passed to the hooks.
+ */
+static void reclaim_record(struct reclaim *rc, uint32_t offset) {
+	record_t *record = reclaim_read_record(rc, offset);
+	if (!record)
+		return;
+
+	if (!is_data(record)) {
+		env_free_record(rc->env, record);
+		return;
 	}
-	new_node->pointers[j] = temp_pointers[i];
-	new_node->_pointers[j] = temp__pointers[i];
-	free(temp_pointers);
-	free(temp_keys);
-	new_node->parent = old_node->parent;
-	for (i = 0; i <= new_node->num_keys; i++) {
-		child = new_node->pointers[i];
-		child->parent = new_node;
+
+	rc->batch[rc->count++] = record;
+	if (rc->count == RELEASE_BATCH)
+		reclaim_flush(rc);
+}
+
+/*
+ * Free at most budget detached nodes. Records are
+ * only read back when a release hook is set.
+ * Returns true if there are nodes left.
+ */
+static bool reclaim_step(struct reclaim *rc, int budget) {
+	int i;
+	bool release = rc->object_release || rc->object_release_batch;
+
+	while (rc->list && budget-- > 0) {
+		node_t *n = rc->list;
+		rc->list = n->next;
+
+		if (!n->is_leaf) {
+			for (i = 0; i < n->num_keys + 1; i++) {
+				node_t *child = (node_t *)n->pointers[i];
+				child->next = rc->list;
+				rc->list = child;
+			}
+		} else {
+			for (i = 0; i < n->num_keys; ++i) {
+				struct posting *posting = (struct posting *)n->pointers[i];
+				if (!posting) {
+					if (release)
+						reclaim_record(rc, n->_pointers[i]);
+					continue;
+				}
+
+				if (release) {
+					struct posting_cursor cursor;
+					uint32_t offset;
+
+					posting_cursor_init(&cursor, posting);
+					while (posting_next(&cursor, &offset))
+						reclaim_record(rc, offset);
+				}
+
+				posting_free(rc->env, posting);
+			}
+		}
+
+		free_node(rc->env, n);
 	}
 
-	/*
-	 * Insert a new key into the parent of the two
-	 * nodes resulting from the split, with
-	 * the old node to the left and the new to the right.
-	 */
-	insert_into_parent(db, old_node, k_prime, new_node);
+	if (rc->count)
+		reclaim_flush(rc);
+
+	return rc->list != NULL;
 }
 
-/* 
- * Inserts a new node (leaf or internal node) into the B+Tree.
- * Returns the root of the tree after insertion.
+/*
+ * Move the tree of db to the front of list and
+ * leave db empty. The new generation makes the
+ * radix table stale.
  */
-static void insert_into_parent(db_t **db, node_t *left, int key, node_t *right) {
-	node_t *parent = left->parent;
+static void detach_tree(db_t **db, node_t **list) {
+	front_clear(db);
 
-	/* 
-	 *Case: new root.
-	 */
-	if (!parent) {
-		insert_into_new_root(db, left, key, right);
+	if (!(*db)->root)
 		return;
-	}
 
-	/*
-	 * Case: leaf or node.
-	 * (Remainder of function body.)  
-	 */
+	(*db)->root->next = *list;
+	*list = (*db)->root;
+	(*db)->root = NULL;
+	(*db)->keys = 0;
+	(*db)->generation++;
+	small_reset(db);
+}
 
-	/*
-	 * Find the parent's pointer to the left 
-	 * node.
-	 */
-	int left_index = get_left_index(parent, left);
+/*
+ * Detach the tree from the database in constant
+ * time. The database is empty and can be used
+ * right away, the detached nodes are reclaimed
+ * by ytree_purge_step or ytree_purge_background.
+ */
+void ytree_purge_detach(db_t **db) {
+	if ((*db)->index)
+		detach_tree(&(*db)->index, &(*db)->purge_list);
 
-	/*
-	 * Simple case: the new key fits into the node. 
-	 */
-	if (parent->num_keys < (*db)->order - 1) {
-		insert_into_node(db, parent, left_index, key, right);
+	detach_tree(db, &(*db)->purge_list);
+}
+
+/*
+ * Reclaim at most budget detached nodes and
+ * release their records. Returns true while
+ * there is work left.
+ */
+bool ytree_purge_step(db_t **db, int budget) {
+	struct reclaim rc;
+	bool more;
+
+	reclaim_init(&rc, db);
+	more = reclaim_step(&rc, budget);
+	(*db)->purge_list = rc.list;
+
+	return more;
+}
+
+#ifndef _WIN32
+static void *purge_worker(void *arg) {
+	struct reclaim *rc = (struct reclaim *)arg;
+
+	while (reclaim_step(rc, PURGE_BUDGET));
+
+	if (rc->fd >= 0)
+		close(rc->fd);
+	env_t env = rc->detached;
+	env_free(&env, rc, sizeof(struct reclaim));
+	return NULL;
+}
+#endif
+
+/*
+ * Detach the tree and reclaim the nodes on a
+ * background thread. Release hooks are called
+ * from that thread. If no thread can be started
+ * the nodes are reclaimed before returning.
+ */
+void ytree_purge_background(db_t **db) {
+	ytree_purge_detach(db);
+	if (!(*db)->purge_list)
 		return;
+
+#ifndef _WIN32
+	struct reclaim *rc = (struct reclaim *)env_alloc((*db)->env, sizeof(struct reclaim));
+	if (rc) {
+		pthread_t thread;
+		bool release;
+
+		reclaim_init(rc, db);
+		release = rc->object_release || rc->object_release_batch;
+
+		/*
+		 * The worker reads records through its own
+		 * descriptor, so all pending writes must
+		 * have reached the file. A memory image can
+		 * move while it grows, in which case the
+		 * purge runs in the foreground.
+		 */
+		if (release && rc->env->pdb) {
+			fflush(rc->env->pdb);
+			rc->fd = dup(fileno(rc->env->pdb));
+		}
+
+		/*
+		 * The environment may be closed before the
+		 * worker is done. The worker only needs the
+		 * allocator, which it takes from a copy.
+		 */
+		rc->detached = *rc->env;
+		rc->env = &rc->detached;
+
+		if ((!release || rc->fd >= 0) && !pthread_create(&thread, NULL, purge_worker, rc)) {
+			pthread_detach(thread);
+			(*db)->purge_list = NULL;
+			return;
+		}
+
+		if (rc->fd >= 0)
+			close(rc->fd);
+		env_free((*db)->env, rc, sizeof(struct reclaim));
 	}
+#endif
 
-	/* 
-	 * Harder case: split a node in order 
-	 * to preserve the B+ tree properties.
-	 */
-	insert_into_node_after_splitting(db, parent, left_index, key, right);
+	while (ytree_purge_step(db, PURGE_BUDGET));
 }
 
 /* 
- * Creates a new root for two subtrees
- * and inserts the appropriate key into
- * the new root.
+ * Delete tree object
  */
-static void insert_into_new_root(db_t **db, node_t *left, int key, node_t *right) {
-	node_t *root = make_node(db);
-	root->keys[0] = key;
-	root->pointers[0] = left;
-	root->pointers[1] = right;
-	root->num_keys++;
-	root->parent = NULL;
-	left->parent = root;
-	right->parent = root;
-	(*db)->root = root;
+void ytree_purge(db_t **db) {
+	ytree_purge_detach(db);
+
+	while (ytree_purge_step(db, PURGE_BUDGET));
+}
+
+/* ********************************
+ * SMALL DATABASES
+ * ********************************/
+
+/*
+ * Use the given order for new nodes, with
+ * the search kernel that suits it.
+ */
+static void set_order(db_t **db, int order) {
+	(*db)->order = order;
+	(*db)->search = search_kernels[ytree_search_select(order)];
+}
+
+/*
+ * Order of the leaf a small database starts
+ * with when empty. Databases without the small
+ * flag, or with a tree order as wide as the
+ * largest leaf, always use the tree order.
+ */
+static void small_reset(db_t **db) {
+	int order = (*db)->tree_order;
+
+	(*db)->small = ((*db)->flags & DB_FLAG_SMALL) && order < SMALL_MAX_ORDER;
+	if ((*db)->small && order < SMALL_MIN_ORDER)
+		order = SMALL_MIN_ORDER;
+
+	set_order(db, order);
 }
 
 /*
- * First insertion:
- * start a new tree.
+ * Move the entries of the leaf to arrays
+ * sized for the current database order.
  */
-static void start_new_tree(db_t **db, int key, uint32_t offset) {
-	node_t *root = make_leaf(db);
-	root->keys[0] = key;
-	root->pointers[0] = NULL;
-	root->pointers[(*db)->order - 1] = NULL;
-	root->_pointers[0] = offset;
-	root->_pointers[(*db)->order - 1] = 0;
-	root->parent = NULL;
-	root->num_keys++;
-	(*db)->root = root;
+static void small_resize(db_t **db, node_t *leaf) {
+	env_t *env = (*db)->env;
+	node_t old = *leaf;
+	int i;
+
+	leaf->order = (*db)->order;
+	leaf->keys = env_alloc_aligned(env, (leaf->order - 1) * sizeof(int));
+	leaf->pointers = env_alloc(env, leaf->order * sizeof(void *));
+	leaf->_pointers = env_alloc(env, leaf->order * sizeof(uint32_t));
+	if (!leaf->keys || !leaf->pointers || !leaf->_pointers) {
+		perror("Small leaf arrays.");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < leaf->num_keys; ++i) {
+		leaf->keys[i] = old.keys[i];
+		leaf->pointers[i] = old.pointers[i];
+		leaf->_pointers[i] = old._pointers[i];
+	}
+
+	free_node_arrays(env, &old);
+	(*db)->generation++;
 }
 
 /*
- * Master insertion function.
- * Inserts a key and an associated value into
- * the B+Tree, causing the tree to be adjusted
- * however necessary to maintain the B+ tree
- * properties.
+ * Make room in the full leaf of a small database
+ * for one more key. The leaf doubles in order until
+ * it is as wide as the vector search goes, then the
+ * entries are inserted into a tree of the order set
+ * by the user. Returns the leaf the key belongs in.
  */
-void ytree_insert(db_t **db, int key, record_t *pointer) {
-	assert(pointer);
+static node_t *small_grow(db_t **db, int key) {
+	node_t *leaf = (*db)->root;
+	node_t *last = NULL;
+	int i;
 
-	/* TODO: check with flags
-	 * The current implementation ignores
-	 * duplicates.
-	 */
-	if (find_value(db, key) != 0) {
-		return;
+	if ((*db)->order < SMALL_MAX_ORDER) {
+		set_order(db, (*db)->order * 2 < SMALL_MAX_ORDER ? (*db)->order * 2 : SMALL_MAX_ORDER);
+		small_resize(db, leaf);
+		return leaf;
 	}
 
-	/*
-	 * Write record to page.
-	 */
-	uint32_t offset = db_write_record(db, pointer);
+	/* Keys are added in order, always to the last leaf */
+	(*db)->root = NULL;
+	(*db)->small = false;
+	set_order(db, (*db)->tree_order);
+
+	for (i = 0; i < leaf->num_keys; ++i) {
+		if (!last) {
+			start_new_tree(db, leaf->keys[i], leaf->_pointers[i]);
+			last = (*db)->root;
+		} else if (last->num_keys < (*db)->order - 1) {
+			insert_into_leaf(last, leaf->keys[i], leaf->_pointers[i]);
+		} else {
+			insert_into_leaf_after_splitting(db, last, leaf->keys[i], leaf->_pointers[i]);
+			last = last->pointers[(*db)->order - 1];
+		}
 
-	/*
-	 * Case: the tree does not exist yet.
-	 * Start a new tree.
-	 */
-	if (!(*db)->root) {
-		start_new_tree(db, key, offset);
-		return;
+		last->pointers[last->num_keys - 1] = leaf->pointers[i];
 	}
 
-	/* 
-	 * Case: the tree already exists.
-	 * (Rest of function body.)
-	 */
-	node_t *leaf = find_leaf((*db)->root, key);
+	free_node((*db)->env, leaf);
 
-	/* 
-	 *Case: leaf has room for key and offset.
-	 */
-	if (leaf->num_keys < (*db)->order - 1) {
-		insert_into_leaf(leaf, key, offset);
-		return;
+	return find_leaf(db, key);
+}
+
+/* Release the nodes of a tree, not the postings */
+static void free_tree(env_t *env, node_t *n) {
+	int i;
+
+	if (!n->is_leaf)
+		for (i = 0; i < n->num_keys + 1; ++i)
+			free_tree(env, (node_t *)n->pointers[i]);
+
+	free_node(env, n);
+}
+
+/*
+ * Turn a tree that shrunk to a few keys back
+ * into a single leaf, of the narrowest order
+ * that holds them with room to spare.
+ */
+static void small_shrink(db_t **db) {
+	node_t *c = (*db)->root;
+	node_t *leaf;
+	int order = (*db)->tree_order < SMALL_MIN_ORDER ? SMALL_MIN_ORDER : (*db)->tree_order;
+
+	while (order < SMALL_MAX_ORDER && (*db)->keys >= order / 2)
+		order *= 2;
+	if (order > SMALL_MAX_ORDER)
+		order = SMALL_MAX_ORDER;
+
+	while (!c->is_leaf)
+		c = c->pointers[0];
+
+	set_order(db, order);
+	leaf = make_leaf(db);
+
+	for (; c; c = c->pointers[c->order - 1]) {
+		memcpy(&leaf->keys[leaf->num_keys], c->keys, c->num_keys * sizeof(int));
+		memcpy(&leaf->pointers[leaf->num_keys], c->pointers, c->num_keys * sizeof(void *));
+		memcpy(&leaf->_pointers[leaf->num_keys], c->_pointers, c->num_keys * sizeof(uint32_t));
+		leaf->num_keys += c->num_keys;
 	}
 
-	/*
-	 * Case: leaf must be split.
-	 */
-	insert_into_leaf_after_splitting(db, leaf, key, offset);
+	free_tree((*db)->env, (*db)->root);
+
+	(*db)->root = leaf;
+	(*db)->small = true;
+	(*db)->generation++;
+	(*db)->stats.root_changes++;
+	TRACE_DB(db, TRACE_ROOT_CHANGE, leaf->keys[0]);
 }
 
 /* ********************************
- * DELETION
+ * BATCH
  * ********************************/
 
-/* 
- * Utility function for deletion. Retrieves
- * the index of a node's nearest neighbor (sibling)
- * to the left if one exists.  If not (the node
- * is the leftmost child), returns -1 to signify
- * this special case.
+/*
+ * Buffered write operation.
  */
-static int get_neighbor_index(node_t *n) {
-	/* Return the index of the key to the left
-	 * of the pointer in the parent pointing
-	 * to n.  
-	 * If n is the leftmost child, this means
-	 * return -1.
-	 */
+struct batch_op {
+	int key;								// Key to write
+	bool remove;							// Delete instead of insert
+	size_t seq;								// Order in which the op was added
+	record_t record;						// Copy of the record to insert
+	uint32_t offset;						// Heap offset once written
+	bool skip;								// Insert of a key that will exist
+};
 
-	int i;
-	for (i = 0; i <= n->parent->num_keys; ++i)
-		if (n->parent->pointers[i] == n)
-			return i - 1;
+/*
+ * Set of operations applied by a single commit.
+ */
+struct ytree_batch {
+	env_t *env;								// Environment allocating the batch
+	struct batch_op *ops;					// Buffered operations
+	size_t count;							// Number of operations
+	size_t size;							// Allocated operations
+};
 
-	// Error state.
-	printf("Search for nonexistent pointer to node in parent.\n");
-	printf("Node:  %#x\n", (unsigned int)(uintptr_t)n);
-	exit(EXIT_FAILURE);
+/*
+ * Create a batch for the databases of env. Its
+ * memory comes from the allocator of env.
+ */
+void ytree_batch_init(ytree_batch_t **batch, env_t **env) {
+	*batch = (ytree_batch_t *)env_alloc(*env, sizeof(ytree_batch_t));
+	if (!*batch) {
+		perror("Batch creation");
+		exit(EXIT_FAILURE);
+	}
+
+	(*batch)->env = *env;
 }
 
-static node_t *remove_entry_from_node(db_t **db, node_t *n, int key, node_t *pointer) {
-	/* Remove the key and shift other keys accordingly. */
-	int i = 0;
-	while (n->keys[i] != key)
-		i++;
-	for (++i; i < n->num_keys; i++)
-		n->keys[i - 1] = n->keys[i];
+/* Bytes held for the value copied into an op */
+static size_t batch_value_size(struct batch_op *op) {
+	return op->record.value_size ? op->record.value_size : 1;
+}
 
-	// Remove the pointer and shift other pointers accordingly.
-	// First determine number of pointers.
-	int num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-	i = 0;
-	while (n->pointers[i] != pointer)
-		i++;
-	for (++i; i < num_pointers; i++)
-		n->pointers[i - 1] = n->pointers[i];
+static struct batch_op *batch_add(ytree_batch_t **batch, int key) {
+	ytree_batch_t *b = *batch;
 
-	/* One key fewer. */
-	n->num_keys--;
+	if (b->count == b->size) {
+		size_t size = b->size ? b->size * 2 : 64;
+		struct batch_op *ops = (struct batch_op *)env_realloc(b->env, b->ops, b->size * sizeof(struct batch_op), size * sizeof(struct batch_op));
+		if (!ops) {
+			perror("Batch operations");
+			exit(EXIT_FAILURE);
+		}
 
-	// Set the other pointers to NULL for tidiness.
-	// A leaf uses the last pointer to point to the next leaf.
-	if (n->is_leaf)
-		for (i = n->num_keys; i < (*db)->order - 1; i++)
-			n->pointers[i] = NULL;
-	else
-		for (i = n->num_keys + 1; i < (*db)->order; i++)
-			n->pointers[i] = NULL;
+		b->ops = ops;
+		b->size = size;
+	}
 
-	return n;
+	struct batch_op *op = &b->ops[b->count];
+	memset(op, 0, sizeof(struct batch_op));
+	op->key = key;
+	op->seq = b->count++;
+	return op;
 }
 
-static node_t *adjust_root(db_t **db) {
-	node_t *new_root = NULL;
+/*
+ * Buffer an insert. The record is copied into
+ * the batch, the caller keeps ownership.
+ */
+void ytree_batch_insert(ytree_batch_t **batch, int key, record_t *record) {
+	assert(record);
+
+	struct batch_op *op = batch_add(batch, key);
+	op->record = *record;
+	if (is_data(record)) {
+		op->record.value._data = env_alloc((*batch)->env, batch_value_size(op));
+		if (!op->record.value._data) {
+			perror("Batch record");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(op->record.value._data, record->value._data, record->value_size);
+	}
+}
 
-	/* Case: nonempty root.
-	 * Key and pointer have already been deleted,
-	 * so nothing to be done.
-	 */
-	if ((*db)->root->num_keys > 0)
-		return (*db)->root;
+void ytree_batch_delete(ytree_batch_t **batch, int key) {
+	batch_add(batch, key)->remove = true;
+}
 
-	/* Case: empty root. 
-	 */
+static void batch_clear(ytree_batch_t **batch) {
+	size_t i;
 
-	/*
-	 * If it has a child, promote 
-	 * the first (only) child
-	 * as the new root. If node is leaf
-	 * root becomes empty.
-	 */
-	if (!(*db)->root->is_leaf) {
-		new_root = (*db)->root->pointers[0];
-		new_root->parent = NULL;
-	}
+	for (i = 0; i < (*batch)->count; ++i)
+		if (!(*batch)->ops[i].remove && is_data((&(*batch)->ops[i].record)))
+			env_free((*batch)->env, (*batch)->ops[i].record.value._data, batch_value_size(&(*batch)->ops[i]));
 
-	free((*db)->root->keys);
-	free((*db)->root->pointers);
-	free((*db)->root);
+	(*batch)->count = 0;
+}
 
-	return new_root;
+void ytree_batch_close(ytree_batch_t **batch) {
+	batch_clear(batch);
+	env_free((*batch)->env, (*batch)->ops, (*batch)->size * sizeof(struct batch_op));
+	env_free((*batch)->env, *batch, sizeof(ytree_batch_t));
+	*batch = NULL;
 }
 
-/* Coalesces a node that has become
- * too small after deletion
- * with a neighboring node that
- * can accept the additional entries
- * without exceeding the maximum.
+/*
+ * Order operations by key, and by the order in
+ * which they were added for the same key.
  */
-static node_t *coalesce_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime) {
-	int i, j, neighbor_insertion_index, n_end;
-	node_t * tmp;
-
-	/* Swap neighbor with node if node is on the
-	 * extreme left and neighbor is to its right.
-	 */
-	if (neighbor_index == -1) {
-		tmp = n;
-		n = neighbor;
-		neighbor = tmp;
-	}
+static int batch_compare(const void *a, const void *b) {
+	const struct batch_op *x = (const struct batch_op *)a;
+	const struct batch_op *y = (const struct batch_op *)b;
 
-	/* Starting point in the neighbor for copying
-	 * keys and pointers from n.
-	 * Recall that n and neighbor have swapped places
-	 * in the special case of n being a leftmost child.
-	 */
-	neighbor_insertion_index = neighbor->num_keys;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
 
-	/* Case:  nonleaf node.
-	 * Append k_prime and the following pointer.
-	 * Append all pointers and keys from the neighbor.
-	 */
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
-	if (!n->is_leaf) {
+/*
+ * Mark the inserts the commit will ignore, those
+ * of keys that exist by then in a database without
+ * duplicates. Their records are not written. The
+ * sorted operations are checked in one sweep over
+ * the leaves, like the commit does.
+ */
+static void batch_mark_skipped(db_t **db, ytree_batch_t **batch) {
+	node_t *leaf = NULL;
+	int upper = 0;
+	bool bounded = false, exists = false;
+	size_t i;
 
-		/* Append k_prime.
-		 */
+	if ((*db)->flags & DB_FLAG_DUPLICATE)
+		return;
 
-		neighbor->keys[neighbor_insertion_index] = k_prime;
-		neighbor->num_keys++;
+	for (i = 0; i < (*batch)->count; ++i) {
+		struct batch_op *op = &(*batch)->ops[i];
 
+		if (!i || op->key != (*batch)->ops[i - 1].key) {
+			int index;
 
-		n_end = n->num_keys;
+			if (!leaf || (bounded && op->key >= upper))
+				leaf = find_leaf_bounded(db, op->key, &upper, &bounded);
 
-		for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-			neighbor->keys[i] = n->keys[j];
-			neighbor->pointers[i] = n->pointers[j];
-			neighbor->num_keys++;
-			n->num_keys--;
+			exists = false;
+			if (leaf) {
+				for (index = 0; index < leaf->num_keys && leaf->keys[index] < op->key; ++index);
+				exists = index < leaf->num_keys && leaf->keys[index] == op->key;
+			}
 		}
 
-		/* The number of pointers is always
-		 * one more than the number of keys.
-		 */
+		if (op->remove) {
+			exists = false;
+		} else {
+			op->skip = exists;
+			exists = true;
+		}
+	}
+}
 
-		neighbor->pointers[i] = n->pointers[j];
+/*
+ * Cut the environment back to size bytes,
+ * undoing growth that is no longer used.
+ */
+static void env_truncate(env_t *env, size_t size) {
+	if (!env->pdb) {
+		if (size < env->heap_size)
+			env->heap_size = size;
+		return;
+	}
 
-		/* All children must now point up to the same parent.
-		 */
+#ifndef _WIN32
+	if (!fflush(env->pdb) && ftruncate(fileno(env->pdb), (off_t)size))
+		perror("Environment truncate");
+#endif
+}
 
-		for (i = 0; i < neighbor->num_keys + 1; i++) {
-			tmp = (node_t *)neighbor->pointers[i];
-			tmp->parent = neighbor;
-		}
+/*
+ * Write the records of all inserts into one
+ * contiguous region of the heap with a single
+ * write and sync it. On failure the heap is
+ * left as it was.
+ */
+static bool batch_write_records(db_t **db, ytree_batch_t **batch) {
+	env_t *env = (*db)->env;
+	size_t i, total = 0, pos = 0, end = 0;
+
+	for (i = 0; i < (*batch)->count; ++i)
+		if (!(*batch)->ops[i].remove && !(*batch)->ops[i].skip)
+			total += record_disk_size(&(*batch)->ops[i].record);
+
+	if (!total)
+		return true;
+
+	uint8_t *buffer = (uint8_t *)env_alloc(env, total);
+	if (!buffer)
+		return false;
+
+	int free_back = env->free_back;
+	int heap_floor = env->heap_floor;
+	bool grows = env->free_back - env->heap_floor <= (int)total;
+	if (grows)
+		end = env_size(env);
+	uint32_t offset = env_reserve(env, total);
+
+	for (i = 0; i < (*batch)->count; ++i) {
+		struct batch_op *op = &(*batch)->ops[i];
+		if (op->remove || op->skip)
+			continue;
+
+		op->offset = offset + (uint32_t)pos;
+		pos += record_serialize(&op->record, buffer + pos);
 	}
 
-	/* In a leaf, append the keys and pointers of
-	 * n to the neighbor.
-	 * Set the neighbor's last pointer to point to
-	 * what had been n's right neighbor.
-	 */
+	bool written = env_pwrite(env, offset, buffer, total) && env_sync(env);
 
-	else {
-		for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
-			neighbor->keys[i] = n->keys[j];
-			neighbor->pointers[i] = n->pointers[j];
-			neighbor->num_keys++;
+	env_free(env, buffer, total);
+
+	if (!written) {
+		env->free_back = free_back;
+		env->heap_floor = heap_floor;
+		if (grows)
+			env_truncate(env, end);
+		return false;
+	}
+
+	for (i = 0; i < (*batch)->count; ++i) {
+		if (!(*batch)->ops[i].remove && !(*batch)->ops[i].skip) {
+			(*db)->stats.records_written++;
+			(*db)->stats.bytes_logical += sizeof(int) + ytree_record_size(&(*batch)->ops[i].record);
 		}
-		neighbor->pointers[(*db)->order - 1] = n->pointers[(*db)->order - 1];
 	}
+	(*db)->stats.bytes_written += total;
 
-	(*db)->root = delete_entry(db, n->parent, k_prime, n);
-	free(n->keys);
-	free(n->pointers);
-	free(n); 
-	return (*db)->root;
+	return true;
 }
 
-
-/* Redistributes entries between two nodes when
- * one has become too small after deletion
- * but its neighbor is too big to append the
- * small node's entries without exceeding the
- * maximum
+/*
+ * Apply all buffered operations to the database.
+ * The operations are sorted by key and applied in
+ * one sweep over the affected leaves, descending
+ * again only when a key leaves the current leaf
+ * or the tree was restructured. Operations on the
+ * same key keep the order in which they were added.
+ * The records are written and synced before the
+ * tree is touched, if that fails nothing is applied
+ * and false is returned. Inserts the commit would
+ * ignore are not written. The batch is emptied on
+ * success. Every commit is captured and timed,
+ * including empty and failed ones, the counters
+ * only count applied commits.
  */
-static node_t *redistribute_nodes(db_t **db, node_t *n, node_t *neighbor, int neighbor_index, int k_prime_index, int k_prime) {  
-	int i;
-	node_t *tmp;
+bool ytree_batch_commit(db_t **db, ytree_batch_t **batch) {
+	uint64_t start = latency_begin(db);
+	node_t *leaf = NULL;
+	unsigned int generation = 0;
+	int upper = 0;
+	bool bounded = false;
+	size_t i;
+
+	assert((*batch)->env == (*db)->env);
+
+	if ((*db)->env->capture) {
+		for (i = 0; i < (*batch)->count; ++i) {
+			struct batch_op *op = &(*batch)->ops[i];
+			if (op->remove)
+				CAPTURE(db, CAPTURE_BATCH_DELETE, op->key, 0, 0);
+			else
+				CAPTURE(db, CAPTURE_BATCH_INSERT, op->key, ytree_record_size(&op->record), op->record.value_type);
+		}
+		CAPTURE(db, CAPTURE_BATCH_COMMIT, 0, (int)(*batch)->count, 0);
+	}
 
-	/* Case: n has a neighbor to the left. 
-	 * Pull the neighbor's last key-pointer pair over
-	 * from the neighbor's right end to n's left end.
-	 */
-	if (neighbor_index != -1) {
-		if (!n->is_leaf)
-			n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
+	if (!(*batch)->count) {
+		latency_end(db, LAT_BATCH, start);
+		return true;
+	}
 
-		for (i = n->num_keys; i > 0; i--) {
-			n->keys[i] = n->keys[i - 1];
-			n->pointers[i] = n->pointers[i - 1];
+	qsort((*batch)->ops, (*batch)->count, sizeof(struct batch_op), batch_compare);
+	batch_mark_skipped(db, batch);
+
+	if (!batch_write_records(db, batch)) {
+		for (i = 0; i < (*batch)->count; ++i)
+			(*batch)->ops[i].skip = false;
+		latency_end(db, LAT_BATCH, start);
+		return false;
+	}
+
+	for (i = 0; i < (*batch)->count; ++i) {
+		struct batch_op *op = &(*batch)->ops[i];
+		int index;
+
+		if (op->skip)
+			continue;
+
+		if (!leaf || generation != (*db)->generation || (bounded && op->key >= upper)) {
+			leaf = find_leaf_bounded(db, op->key, &upper, &bounded);
+			generation = (*db)->generation;
 		}
 
-		if (!n->is_leaf) {
-			n->pointers[0] = neighbor->pointers[neighbor->num_keys];
-			tmp = (node_t *)n->pointers[0];
-			tmp->parent = n;
-			neighbor->pointers[neighbor->num_keys] = NULL;
-			n->keys[0] = k_prime;
-			n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
-		} else {
-			n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
-			neighbor->pointers[neighbor->num_keys - 1] = NULL;
-			n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-			n->parent->keys[k_prime_index] = n->keys[0];
+		if (!leaf) {
+			if (!op->remove) {
+				start_new_tree(db, op->key, op->offset);
+				index_record(db, op->key, &op->record);
+				(*db)->keys++;
+			}
+			continue;
 		}
-	} else {  
-		/*
-		 * Case: n is the leftmost child.
-		 * Take a key-pointer pair from the neighbor to the right.
-		 * Move the neighbor's leftmost key-pointer pair
-		 * to n's rightmost position.
-		 */
-		if (n->is_leaf) {
-			n->keys[n->num_keys] = neighbor->keys[0];
-			n->pointers[n->num_keys] = neighbor->pointers[0];
-			n->parent->keys[k_prime_index] = neighbor->keys[1];
-		} else {
-			n->keys[n->num_keys] = k_prime;
-			n->pointers[n->num_keys + 1] = neighbor->pointers[0];
-			tmp = (node_t *)n->pointers[n->num_keys + 1];
-			tmp->parent = n;
-			n->parent->keys[k_prime_index] = neighbor->keys[0];
+
+		for (index = 0; index < leaf->num_keys && leaf->keys[index] < op->key; ++index);
+		bool found = index < leaf->num_keys && leaf->keys[index] == op->key;
+
+		if (op->remove) {
+			if (found)
+				delete_slot(db, leaf, index);
+			continue;
 		}
 
-		for (i = 0; i < neighbor->num_keys - 1; i++) {
-			neighbor->keys[i] = neighbor->keys[i + 1];
-			neighbor->pointers[i] = neighbor->pointers[i + 1];
+		if (found) {
+			if ((*db)->flags & DB_FLAG_DUPLICATE) {
+				slot_add_value((*db)->env, leaf, index, op->offset);
+				front_invalidate(db, op->key);
+				index_record(db, op->key, &op->record);
+			}
+			continue;
 		}
 
-		if (!n->is_leaf)
-			neighbor->pointers[i] = neighbor->pointers[i + 1];
+		if ((*db)->small && leaf->num_keys == (*db)->order - 1) {
+			small_grow(db, op->key);
+			leaf = find_leaf_bounded(db, op->key, &upper, &bounded);
+			generation = (*db)->generation;
+		}
+
+		if (leaf->num_keys < (*db)->order - 1)
+			insert_into_leaf(leaf, op->key, op->offset);
+		else
+			insert_into_leaf_after_splitting(db, leaf, op->key, op->offset);
+		index_record(db, op->key, &op->record);
+		(*db)->keys++;
 	}
 
-	/* n now has one more key and one more pointer;
-	 * the neighbor has one fewer of each.
-	 */
+	(*db)->stats.batch_commits++;
+	(*db)->stats.batch_ops += (*batch)->count;
 
-	n->num_keys++;
-	neighbor->num_keys--;
+	batch_clear(batch);
+	latency_end(db, LAT_BATCH, start);
+	return true;
+}
 
-	return (*db)->root;
+/* ********************************
+ * DATABASE OPERATIONS
+ * ********************************/
+
+/*
+ * Size of a record in the record heap. Data
+ * records store their length after the type.
+ */
+static size_t record_disk_size(record_t *record) {
+	size_t size = sizeof(enum datatype) + ytree_record_size(record);
+	if (is_data(record))
+		size += sizeof(uint32_t);
+
+	return size;
 }
 
-/* Deletes an entry from the B+ tree.
- * Removes the record and its key and pointer
- * from the leaf, and then makes all appropriate
- * changes to preserve the B+ tree properties.
+/*
+ * Allocate a record with room for size bytes
+ * of data. The data follows the record in the
+ * same block so a single free releases both.
  */
-node_t *delete_entry(db_t **db, node_t *n, int key, void *pointer) {
-	int min_keys;
-	node_t *neighbor;
-	int neighbor_index;
-	int k_prime_index, k_prime;
-	int capacity;
+static record_t *alloc_record(env_t *env, size_t size) {
+	record_t *record = (record_t *)env_alloc(env, sizeof(record_t) + size);
+	if (!record) {
+		perror("Record creation");
+		exit(EXIT_FAILURE);
+	}
 
-	/*
-	 * Remove key and pointer from node.
-	 */
-	n = remove_entry_from_node(db, n, key, pointer);
+	return record;
+}
 
-	/*
-	 * Case:  deletion from the root. 
-	 */
-	if (n == (*db)->root) 
-		return adjust_root(db);
+/* Size of the block of a record from alloc_record */
+static size_t record_alloc_size(record_t *record) {
+	return sizeof(record_t) + (record->value_type == DT_DATA ? record->value_size : 0);
+}
 
-	/* Case:  deletion from a node below the root.
-	 * (Rest of function body.)
-	 */
+static void env_free_record(env_t *env, record_t *record) {
+	if (record)
+		env_free(env, record, record_alloc_size(record));
+}
 
-	/* Determine minimum allowable size of node,
-	 * to be preserved after deletion.
-	 */
-	min_keys = n->is_leaf ? cut((*db)->order - 1) : cut((*db)->order) - 1;
+/*
+ * Release a record returned by the environment,
+ * through the allocator it was allocated with.
+ */
+void ytree_free_record(env_t **env, record_t *record) {
+	env_free_record(*env, record);
+}
 
-	/* Case:  node stays at or above minimum.
-	 * (The simple case.)
-	 */
+/*
+ * Add pages to the end of the file to hold at
+ * least size bytes. Records are written from the
+ * back of the new pages towards the old end.
+ */
+static void env_grow_heap(env_t *env, size_t size) {
+	size_t end = env_size(env);
+	unsigned int pages = (unsigned int)((end + size + env->page_size - 1) / env->page_size);
 
-	if (n->num_keys >= min_keys)
-		return (*db)->root;
+	env_alloc_page(env, pages);
+	env->heap_floor = end;
+}
 
-	/* Case:  node falls below minimum.
-	 * Either coalescence or redistribution
-	 * is needed.
-	 */
+/*
+ * Write the record to the record heap and
+ * return its offset. The record is copied,
+ * ownership stays with the caller.
+ */
+uint32_t db_write_record(db_t **db, record_t *record) {
+	env_t *env = (*db)->env;
+	size_t recsz = record_disk_size(record);
+	uint32_t new_offset = env_reserve(env, recsz);
+
+	if (env->flags & DB_FLAG_VERBOSE) {
+		printf("size %zu\n", recsz);
+		printf("free_back %u\n", env->free_back);
+		printf("free_front %u\n", env->free_front);
+		printf("new_offset %u\n", new_offset);
+	}
 
-	/* Find the appropriate neighbor node with which
-	 * to coalesce.
-	 * Also find the key (k_prime) in the parent
-	 * between the pointer to node n and the pointer
-	 * to the neighbor.
-	 */
+	env_write_record(env, new_offset, record);
 
-	neighbor_index = get_neighbor_index(n);
-	k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-	k_prime = n->parent->keys[k_prime_index];
-	neighbor = neighbor_index == -1 ? n->parent->pointers[1] : n->parent->pointers[neighbor_index];
+	(*db)->stats.records_written++;
+	(*db)->stats.bytes_written += recsz;
 
-	capacity = n->is_leaf ? (*db)->order : (*db)->order - 1;
+	return new_offset;
+}
 
-	/* Coalescence. */
-	if (neighbor->num_keys + n->num_keys < capacity)
-		return coalesce_nodes(db, n, neighbor, neighbor_index, k_prime);
+/*
+ * Overwrite the record at offset in place. The
+ * record must take the same room in the heap.
+ */
+static void db_rewrite_record(db_t **db, uint32_t offset, record_t *record) {
+	env_write_record((*db)->env, offset, record);
 
-	/* Redistribution. */
-	return redistribute_nodes(db, n, neighbor, neighbor_index, k_prime_index, k_prime);
+	(*db)->stats.records_written++;
+	(*db)->stats.bytes_written += record_disk_size(record);
 }
 
-/* 
- * Master deletion function
+/*
+ * Allocate size bytes in the record heap,
+ * growing the heap if the current page is
+ * full. Returns the offset of the space.
  */
-void ytree_delete(db_t **db, int key) {
-	record_t *key_record = ytree_find(db, key);
-	node_t *key_leaf = find_leaf((*db)->root, key);
-	if (key_record && key_leaf) {
-		(*db)->root = delete_entry(db, key_leaf, key, key_record);
+static uint32_t env_reserve(env_t *env, size_t size) {
+	if (env->free_back - env->heap_floor <= (int)size)
+		env_grow_heap(env, size);
 
-		/* Call pointer release hook if type is data */
-		if (is_data(key_record) && release_callback)
-			release_callback(key_record->value._data);
+	env->free_back -= size;
+	return env->free_back;
+}
 
-		free(key_record);
+/*
+ * Serialize the record in the heap format
+ * into out. Returns the number of bytes.
+ */
+static size_t record_serialize(record_t *record, uint8_t *out) {
+	size_t datasz = ytree_record_size(record);
+	size_t pos = sizeof(enum datatype);
+
+	memcpy(out, &record->value_type, sizeof(enum datatype));
+	if (is_data(record)) {
+		uint32_t size = (uint32_t)datasz;
+		memcpy(out + pos, &size, sizeof(uint32_t));
+		memcpy(out + pos + sizeof(uint32_t), record->value._data, datasz);
+		return pos + sizeof(uint32_t) + datasz;
 	}
+
+	memcpy(out + pos, &record->value, datasz);
+	return pos + datasz;
 }
 
-/* TODO: call release hook
- * Traverse tree and delete nodes
+/*
+ * Flush all pending writes of the environment
+ * to stable storage.
  */
-static void destroy_tree_nodes(node_t *root) {
-	int i;
-	if (root->is_leaf)
-		for (i = 0; i < root->num_keys; ++i)
-			free(root->pointers[i]);
-	else
-		for (i = 0; i < root->num_keys + 1; i++)
-			destroy_tree_nodes(root->pointers[i]);
+static bool env_sync(env_t *env) {
+	if (!env->pdb)
+		return true;
+
+	if (fflush(env->pdb))
+		return false;
+
+#ifndef _WIN32
+	if (fsync(fileno(env->pdb)))
+		return false;
+#endif
 
-	free(root->pointers);
-	free(root->keys);
-	free(root);
+	env->io.fsyncs++;
+	TRACE_IO(env, TRACE_FSYNC, 0, 0);
+	return true;
 }
 
-/* 
- * Delete tree object
+/*
+ * Write the record at offset. The space must
+ * have been allocated in the record heap.
  */
-void ytree_purge(db_t **db) {
-	if (!(*db)->root)
-		return;
+static void env_write_record(env_t *env, uint32_t offset, record_t *record) {
+	uint8_t local[64];
+	size_t size = record_disk_size(record);
+	uint8_t *buffer = size <= sizeof(local) ? local : (uint8_t *)env_alloc(env, size);
+
+	if (!buffer) {
+		perror("Record buffer");
+		exit(EXIT_FAILURE);
+	}
 
-	destroy_tree_nodes((*db)->root);
+	record_serialize(record, buffer);
+	env_pwrite(env, offset, buffer, size);
 
-	(*db)->root = NULL;
+	if (buffer != local)
+		env_free(env, buffer, size);
 }
 
-/* ********************************
- * DATABASE OPERATIONS
- * ********************************/
+/*
+ * Read the record at offset from the record
+ * heap. The record is owned by the caller.
+ */
+static record_t *env_read_record(env_t *env, uint32_t offset) {
+	enum datatype type;
+	record_t *record;
 
-/* TODO: free record
-*/
-uint32_t db_write_record(db_t **db, record_t *record) {
-	size_t datasz = ytree_record_size(record);
-	
-	uint32_t new_offset = (*db)->env->free_back - sizeof(enum datatype) - datasz;
+	if (!offset)
+		return NULL;
 
-	printf("size %zu\n", sizeof(enum datatype) + datasz);
-	printf("free_back %u\n", (*db)->env->free_back);
-	printf("free_front %u\n", (*db)->env->free_front);
-	printf("new_offset %u\n", new_offset);
+	if (!env_pread(env, offset, &type, sizeof(enum datatype)))
+		return NULL;
 
-	/* Overflow */
-	if ((*db)->env->free_front >= new_offset) {
-		puts("ouch");
-		return 0;
+	offset += sizeof(enum datatype);
+	if (type == DT_DATA) {
+		uint32_t size = 0;
+		if (!env_pread(env, offset, &size, sizeof(uint32_t)))
+			return NULL;
+
+		record = alloc_record(env, size);
+		record->value_type = DT_DATA;
+		record->value._data = record + 1;
+		record->value_size = size;
+		if (size && !env_pread(env, offset + sizeof(uint32_t), record->value._data, size)) {
+			env_free_record(env, record);
+			return NULL;
+		}
+	} else {
+		record = alloc_record(env, 0);
+		record->value_type = type;
+		if (!env_pread(env, offset, &record->value, ytree_record_size(record))) {
+			env_free_record(env, record);
+			return NULL;
+		}
 	}
 
-	fseek((*db)->env->pdb, new_offset, SEEK_SET);
-	fwrite(&record->value_type, sizeof(enum datatype), 1, (*db)->env->pdb);
-	fwrite(&record->value._int, datasz, 1, (*db)->env->pdb);
-	(*db)->env->free_back = new_offset;
-
-	return new_offset;
+	return record;
 }
 
-/* */
 record_t *db_read_record(db_t **db, uint32_t offset) {
+	record_t *record = env_read_record((*db)->env, offset);
+
+	if (record) {
+		(*db)->stats.records_read++;
+		(*db)->stats.bytes_read += record_disk_size(record);
+	}
+
+	return record;
+}
+
+#ifndef _WIN32
+/*
+ * Positional variant of env_read_record
+ * for readers on other threads.
+ */
+static record_t *db_pread_record(env_t *env, int fd, uint32_t offset) {
+	enum datatype type;
+	record_t *record;
+
 	if (!offset)
 		return NULL;
 
-	record_t *record = (record_t *)calloc(1, sizeof(record_t));
-	if (!record) {
-		perror("Record creation");
-		exit(EXIT_FAILURE);
-	}
+	if (pread(fd, &type, sizeof(enum datatype), offset) != sizeof(enum datatype))
+		return NULL;
 
-	fseek((*db)->env->pdb, offset, SEEK_SET);
-	fread(&record->value_type, sizeof(enum datatype), 1, (*db)->env->pdb);
-	fread(&record->value._int, sizeof(int), 1, (*db)->env->pdb);
+	offset += sizeof(enum datatype);
+	if (type == DT_DATA) {
+		uint32_t size = 0;
+		if (pread(fd, &size, sizeof(uint32_t), offset) != sizeof(uint32_t))
+			return NULL;
+
+		record = alloc_record(env, size);
+		record->value_type = DT_DATA;
+		record->value._data = record + 1;
+		record->value_size = size;
+		if (pread(fd, record->value._data, size, offset + sizeof(uint32_t)) != (ssize_t)size) {
+			env_free_record(env, record);
+			return NULL;
+		}
+	} else {
+		record = alloc_record(env, 0);
+		record->value_type = type;
+		if (pread(fd, &record->value, ytree_record_size(record), offset) != (ssize_t)ytree_record_size(record)) {
+			env_free_record(env, record);
+			return NULL;
+		}
+	}
 
 	return record;
 }
+#endif
 
 /* Return schema size depending on page size */
 #define get_schema_size(n) (n)->page_size/128
@@ -1478,44 +4918,142 @@ static void env_write_header(env_t *env) {
 	buffer.page_size = env->page_size;
 	buffer.flags = env->flags;
 
-	fwrite(&buffer, sizeof(struct env), 1, env->pdb);
-	fflush(env->pdb);
+	env_pwrite(env, 0, &buffer, sizeof(struct env));
+	if (env->pdb)
+		fflush(env->pdb);
 }
 
 /* 
  * Write schema to offset
  */
 static void env_write_schema(env_t *env, uint32_t offset) {
-	struct schema *schema = calloc(get_schema_size(env), sizeof(struct schema));
+	size_t size = sizeof(struct schema) * get_schema_size(env);
+	struct schema *schema = env_alloc(env, size);
+
+	env_pwrite(env, offset, schema, size);
+
+	env_free(env, schema, size);
+}
+
+static void env_alloc_page(env_t *env, unsigned int n) {
+	uint8_t last = 0;
+
+	env_pwrite(env, (n * env->page_size) - 1, &last, 1);
+	env->free_back = n * env->page_size;
+}
+
+/*
+ * Resize the memory image to at least size
+ * bytes. New space is zeroed like a file hole.
+ */
+static void env_heap_resize(env_t *env, size_t size) {
+	size_t capacity = env->heap_capacity ? env->heap_capacity : env->page_size;
+
+	if (size <= env->heap_size)
+		return;
+
+	/* Double the image so appending pages does not copy it every time */
+	if (size > env->heap_capacity) {
+		while (capacity < size)
+			capacity *= 2;
+
+		uint8_t *heap = (uint8_t *)env_realloc(env, env->heap, env->heap_capacity, capacity);
+		if (!heap) {
+			perror("Memory environment");
+			exit(EXIT_FAILURE);
+		}
+
+		env->heap = heap;
+		env->heap_capacity = capacity;
+	}
+
+	memset(env->heap + env->heap_size, 0, size - env->heap_size);
+	env->heap_size = size;
+}
+
+/*
+ * Count an access of size bytes at offset
+ * in the storage counters.
+ */
+static void env_account(env_t *env, uint32_t offset, size_t size, uint64_t *calls, uint64_t *bytes, uint64_t *pages) {
+	(*calls)++;
+	*bytes += size;
+	if (size)
+		*pages += (offset + size - 1) / env->page_size - offset / env->page_size + 1;
+
+	if (offset != env->io_next)
+		env->io.seeks++;
+	env->io_next = offset + size;
+}
+
+/*
+ * Write size bytes at offset, either to the
+ * file or to the memory image of the environment.
+ */
+static bool env_pwrite(env_t *env, uint32_t offset, const void *buffer, size_t size) {
+	TRACE_IO(env, TRACE_WRITE, offset, size);
+	env_account(env, offset, size, &env->io.writes, &env->io.bytes_written, &env->io.pages_written);
+
+	if (!env->pdb) {
+		env_heap_resize(env, offset + size);
+		memcpy(env->heap + offset, buffer, size);
+		return true;
+	}
+
+	return !fseek(env->pdb, offset, SEEK_SET)
+		&& fwrite(buffer, size, 1, env->pdb) == 1;
+}
+
+/*
+ * Read size bytes at offset. Reads past
+ * the end of the environment fail.
+ */
+static bool env_pread(env_t *env, uint32_t offset, void *buffer, size_t size) {
+	TRACE_IO(env, TRACE_READ, offset, size);
+	env_account(env, offset, size, &env->io.reads, &env->io.bytes_read, &env->io.pages_read);
 
-	fseek(env->pdb, offset, SEEK_SET);
-	fwrite(schema, sizeof(struct schema), get_schema_size(env), env->pdb);
+	if (!env->pdb) {
+		if (offset + size > env->heap_size)
+			return false;
+
+		memcpy(buffer, env->heap + offset, size);
+		return true;
+	}
 
-	free(schema);
+	return !fseek(env->pdb, offset, SEEK_SET)
+		&& fread(buffer, size, 1, env->pdb) == 1;
 }
 
-static void env_alloc_page(env_t *env, unsigned short n) {
-	fseek(env->pdb, (n * env->page_size) - 1, SEEK_SET);
-	fwrite(&n, 1, 1, env->pdb);
+/* Total size of the environment */
+static size_t env_size(env_t *env) {
+	if (!env->pdb)
+		return env->heap_size;
 
-	env->free_back = ftell(env->pdb);
+	fseek(env->pdb, 0, SEEK_END);
+	env->io_next = (uint32_t)ftell(env->pdb);
+	env->io.seeks++;
+	return env->io_next;
 }
 
 /* 
- * Create new database environment
+ * Create new database environment. Without
+ * a name the environment lives in memory.
  */
 void ytree_env_init(const char *dbname, env_t **env, uint8_t flags) {
+	cpu_current();
+
 	*env = (env_t *)calloc(1, sizeof(env_t));
 
-	if (file_exist(dbname)) {
+	if (dbname && file_exist(dbname)) {
 		puts("open");
 		assert(0);
 
 		// env_read_header(*env);
 		// env_read_schema(*env);
 	} else {
-		(*env)->pdb = fopen(dbname, "w+b");
-		if (!(*env)->pdb) {
+		if (dbname)
+			(*env)->pdb = fopen(dbname, "w+b");
+		if (dbname && !(*env)->pdb) {
 			perror("ytree_env_init");
 			exit(1);
 		}
@@ -1528,7 +5066,8 @@ void ytree_env_init(const char *dbname, env_t **env, uint8_t flags) {
 		env_write_header(*env);
 		env_write_schema(*env, (*env)->schema);
 
-		(*env)->free_front = ftell((*env)->pdb);
+		(*env)->free_front = (*env)->schema + sizeof(struct schema) * get_schema_size(*env);
+		(*env)->heap_floor = (*env)->free_front;
 
 		env_alloc_page(*env, 1);
 	}
@@ -1537,22 +5076,91 @@ void ytree_env_init(const char *dbname, env_t **env, uint8_t flags) {
 void ytree_db_init(short index, db_t **db, env_t **env) {
 	assert(index < get_schema_size(*env));
 
-	*db = (db_t *)calloc(1, sizeof(db_t));
+	*db = (db_t *)env_alloc(*env, sizeof(db_t));
 
+	(*env)->databases++;
 	(*db)->schema_id = index;
 	(*db)->env = *env;
-	(*db)->order = DEFAULT_ORDER;
+	(*db)->flags = (*env)->flags;
+	(*db)->tree_order = DEFAULT_ORDER;
+	small_reset(db);
 }
 
 void ytree_db_close(db_t **db) {
-	free(*db);
+	while (ytree_purge_step(db, PURGE_BUDGET));
+
+	if ((*db)->index)
+		ytree_db_close(&(*db)->index);
+
+	ytree_front_cache(db, 0);
+	ytree_radix_table(db, 0);
+	env_free((*db)->env, (*db)->latency, LAT_MAX * sizeof(ytree_histogram_t));
+	(*db)->env->databases--;
+	env_free((*db)->env, *db, sizeof(db_t));
+}
+
+/*
+ * Allocate the memory of the environment with
+ * alloc and release it with release, passing ctx
+ * to both. Without alloc calloc and free are used.
+ * Only the memory image is moved to the new
+ * allocator, so this fails once a database is
+ * opened or a capture is started. The hooks
+ * are called from other threads by a background
+ * purge.
+ */
+bool ytree_set_allocator(env_t **env, hook_alloc alloc, hook_free release, void *ctx) {
+	env_t previous = **env;
+
+	assert(!alloc || release);
+	if ((*env)->databases || (*env)->capture)
+		return false;
+
+	memset(&(*env)->allocator, 0, sizeof(ytree_allocator_t));
+	(*env)->allocator.alloc = alloc;
+	(*env)->allocator.release = release;
+	(*env)->allocator.ctx = ctx;
+
+	if (previous.heap) {
+		(*env)->heap = (uint8_t *)env_alloc(*env, previous.heap_capacity);
+		if (!(*env)->heap) {
+			perror("Memory environment");
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy((*env)->heap, previous.heap, previous.heap_size);
+		env_free(&previous, previous.heap, previous.heap_capacity);
+	}
+
+	return true;
+}
+
+/*
+ * Optional hooks of the allocator. A sized release
+ * is preferred over the plain one. Node keys are
+ * allocated on a cache line with alloc_aligned.
+ * Call after ytree_set_allocator, fails once a
+ * database is opened or a capture is started.
+ */
+bool ytree_set_allocator_hints(env_t **env, hook_free_sized release_sized, hook_alloc_aligned alloc_aligned) {
+	assert((*env)->allocator.alloc);
+	if ((*env)->databases || (*env)->capture)
+		return false;
+
+	(*env)->allocator.release_sized = release_sized;
+	(*env)->allocator.alloc_aligned = alloc_aligned;
+	return true;
 }
 
 /* 
  * Close the database environment
  */
 void ytree_env_close(env_t **env) {
-	fclose((*env)->pdb);
+	if ((*env)->capture)
+		ytree_capture_stop(env);
+	if ((*env)->pdb)
+		fclose((*env)->pdb);
+	env_free(*env, (*env)->heap, (*env)->heap_capacity);
 	free(*env);
 }
 
@@ -34,9 +34,14 @@
 #ifndef _YTREE_H_
 #define _YTREE_H_
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Enable for debug compilation */
 #ifdef STANDALONE
 #define DEBUG 1
@@ -47,10 +52,11 @@
  * a new tree is created.
  */
 #define DB_FLAG_DUPLICATE	0x01	// Allow duplicated keys
-#define DB_FLAG_HASH		0x02	// Use hash buckets where possible
+#define DB_FLAG_HASH		0x02	// Reserved, hashed keys measure no faster (hashtest)
 #define DB_FLAG_VERBOSE		0x04	// Verbose output
 #define DB_FLAG_PREF_SPEED	0x08	// Prefer speed
 #define DB_FLAG_PREF_SIZE	0x10	// Prefer small database size
+#define DB_FLAG_SMALL		0x20	// Keep small databases in a single leaf
 
 /* ********************************
  * TYPES
@@ -61,6 +67,7 @@
  * object hooks.
  */
 typedef void (*hook_release)(void *object);
+typedef void (*hook_release_batch)(void **objects, size_t count);
 typedef void (*hook_serialize)(void *object, size_t *sz, void *out);
 
 /*
@@ -92,6 +99,24 @@ typedef struct {
 	size_t value_size;
 } record_t;
 
+/*
+ * Called by ytree_update with the current
+ * record. Return true to store the record.
+ */
+typedef bool (*hook_update)(record_t *record, void *ctx);
+
+/*
+ * Called for each value visited by a
+ * lookup. Return false to stop.
+ */
+typedef bool (*hook_visit)(int key, record_t *record, void *ctx);
+
+/*
+ * Extract the value to index from a record.
+ * Return false to leave the record out.
+ */
+typedef bool (*hook_extract)(record_t *record, int *value);
+
 /*
  * Type representing a node in the B+ tree.
  * This type is general enough to serve for both
@@ -128,33 +153,340 @@ typedef struct node {
 	int *keys;								// Array of keys with size: order 
 	struct node *parent;					// Parent node or NULL for root
 	bool is_leaf;							// Internal node or leaf
+	short order;							// Order the arrays are sized for
 	int num_keys;							// Number of keys in node
 	struct node *next;						// Used for queue
 } node_t;
 
+/*
+ * Events reported to the trace hook. Tracing
+ * is compiled in with YTREE_TRACE.
+ */
+enum trace_type {
+	TRACE_LEAF_SPLIT,
+	TRACE_INTERNAL_SPLIT,
+	TRACE_COALESCE,
+	TRACE_REDISTRIBUTE,
+	TRACE_ROOT_CHANGE,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_EVICT,
+	TRACE_FSYNC,
+	TRACE_MAX,
+};
+
+typedef struct {
+	enum trace_type type;					// Event type
+	int schema_id;							// Database or -1 for the environment
+	int key;								// Key involved in a structural event
+	uint32_t offset;						// Offset of the I/O
+	uint32_t size;							// Bytes of I/O
+} trace_event_t;
+
+/*
+ * Called for each traced event on the
+ * thread that caused the event.
+ */
+typedef void (*hook_trace)(const trace_event_t *event, void *ctx);
+
+/*
+ * Operations recorded by the capture. The
+ * argument holds the value size, the records
+ * visited by a range, index range or find all,
+ * the bits of an incr delta as float or the
+ * operations of a batch. The operations of a
+ * batch are recorded when it is committed,
+ * followed by the commit. A setup precedes the
+ * first operation of every database, and follows
+ * the declaration of an index: the value type
+ * holds the database flags, the key the schema
+ * of the index or -1 and the argument the front
+ * cache entries. Index extractors and the radix
+ * table are not recorded.
+ */
+enum capture_op {
+	CAPTURE_INSERT,
+	CAPTURE_FIND,
+	CAPTURE_DELETE,
+	CAPTURE_RANGE,
+	CAPTURE_INCR,
+	CAPTURE_CAS,
+	CAPTURE_UPDATE,
+	CAPTURE_FIND_ALL,
+	CAPTURE_DELETE_VALUE,
+	CAPTURE_BATCH_INSERT,
+	CAPTURE_BATCH_DELETE,
+	CAPTURE_BATCH_COMMIT,
+	CAPTURE_INDEX_RANGE,
+	CAPTURE_SETUP,
+	CAPTURE_MAX,
+};
+
+#define CAPTURE_MAGIC		"YTREECAP"
+#define CAPTURE_VERSION		2
+
+/* Capture file header, events follow in host byte order */
+typedef struct {
+	char magic[8];							// CAPTURE_MAGIC
+	uint32_t version;						// CAPTURE_VERSION
+	uint32_t event_size;					// Size of capture_event_t
+} capture_header_t;
+
+/* Single captured operation */
+typedef struct {
+	uint64_t timestamp;						// Nanoseconds since the capture started
+	int32_t key;							// Key or start of the range
+	int32_t arg;							// Operation argument
+	uint16_t thread;						// Calling thread in order of appearance
+	uint16_t schema_id;						// Database of the operation
+	uint16_t order;							// Tree order of the database
+	uint8_t op;								// Operation, enum capture_op
+	uint8_t value_type;						// Type of the value written
+} capture_event_t;
+
+struct capture;
+struct front_cache;
+struct radix_table;
+
+/*
+ * Storage counters of an environment. A seek is
+ * an access that does not start where the previous
+ * one ended, pages are those spanned by each call.
+ */
+typedef struct {
+	uint64_t reads;							// Read calls
+	uint64_t writes;						// Write calls
+	uint64_t bytes_read;					// Bytes read
+	uint64_t bytes_written;					// Bytes written
+	uint64_t seeks;							// Non sequential accesses
+	uint64_t fsyncs;						// Flushes to stable storage
+	uint64_t pages_read;					// Pages touched by reads
+	uint64_t pages_written;					// Pages touched by writes
+} ytree_io_t;
+
+/*
+ * Memory allocator hooks. Memory returned need
+ * not be zeroed. The sized free and the aligned
+ * allocation are optional.
+ */
+typedef void *(*hook_alloc)(size_t size, void *ctx);
+typedef void (*hook_free)(void *ptr, void *ctx);
+typedef void (*hook_free_sized)(void *ptr, size_t size, void *ctx);
+typedef void *(*hook_alloc_aligned)(size_t alignment, size_t size, void *ctx);
+
+typedef struct {
+	hook_alloc alloc;						// Allocation or NULL for calloc
+	hook_free release;						// Release of an allocation
+	hook_free_sized release_sized;			// Release with the allocated size or NULL
+	hook_alloc_aligned alloc_aligned;		// Aligned allocation or NULL
+	void *ctx;								// Context passed to the hooks
+} ytree_allocator_t;
+
 /* Database environment */
 typedef struct {
 	int schema;								// Offset to database schema
 	int free_front;							// Offset to free block from front
 	int free_back;							// Offset to free block from back
+	int heap_floor;							// Lower bound of current record page
 	size_t page_size;						// Page size
 	char flags;								// Bitmap defining tree options
-	FILE *pdb;								// Database file pointer
+	FILE *pdb;								// Database file pointer or NULL
+	uint8_t *heap;							// Memory image without a file
+	size_t heap_size;						// Size of the memory image
+	size_t heap_capacity;					// Bytes allocated for the memory image
+	hook_trace trace;						// Trace hook or NULL
+	void *trace_ctx;						// Context passed to the trace hook
+	ytree_io_t io;							// Storage counters
+	uint32_t io_next;						// Offset following the last access
+	struct capture *capture;				// Operation capture or NULL
+	ytree_allocator_t allocator;			// Memory allocator
+	int databases;							// Databases opened on the environment
 } env_t;
 
-/* Single database */
+/* Operation counters */
+typedef struct {
+	uint64_t descents;						// Root to leaf descents
+	uint64_t comparisons;					// Key comparisons
+	uint64_t leaf_splits;					// Leaf nodes split
+	uint64_t internal_splits;				// Internal nodes split
+	uint64_t coalesces;						// Nodes merged
+	uint64_t redistributions;				// Entries moved between nodes
+	uint64_t root_changes;					// New or removed root
+	uint64_t records_written;				// Records written to the heap
+	uint64_t records_read;					// Records read from the heap
+	uint64_t bytes_written;					// Record bytes written
+	uint64_t bytes_read;					// Record bytes read
+	uint64_t bytes_logical;					// Key and value bytes handed in by the caller
+	uint64_t front_hits;					// Lookups answered by the front cache
+	uint64_t front_misses;					// Lookups that missed the front cache
+	uint64_t front_evictions;				// Front cache entries replaced
+	uint64_t radix_hits;					// Descents started below the root
+	uint64_t radix_rebuilds;				// Radix table rebuilds
+	uint64_t batch_commits;					// Batches committed
+	uint64_t batch_ops;						// Operations in committed batches
+	ytree_io_t io;							// Storage counters of the environment
+	double write_amplification;				// Bytes written to storage per logical byte
+} ytree_stats_t;
+
+/*
+ * Operations timed by the latency histograms.
+ * A timed operation reads the time stamp counter
+ * twice and adds to one histogram of the calling
+ * database, without atomics. On a virtualized
+ * Xeon, where one read of the counter takes 22ns,
+ * timing adds about 65ns per operation, nearly
+ * all of it in the two reads.
+ */
+enum latency_op {
+	LAT_INSERT,
+	LAT_FIND,
+	LAT_DELETE,
+	LAT_RANGE,
+	LAT_BATCH,
+	LAT_MAX,
+};
+
+/*
+ * Log-linear histogram buckets. Every power of
+ * two is split in 2^HIST_SUB_BITS linear buckets,
+ * values up to 2^HIST_MAX_EXP ticks are kept.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_MAX_EXP	40
+#define HIST_BUCKETS	((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+/* Latency histogram in clock ticks */
 typedef struct {
+	uint64_t counts[HIST_BUCKETS];			// Samples per bucket
+	uint64_t count;							// Total number of samples
+	uint64_t min;							// Smallest sample
+	uint64_t max;							// Largest sample
+	uint64_t sum;							// Sum of all samples
+} ytree_histogram_t;
+
+/*
+ * Node search kernels. Each returns the number
+ * of keys in the sorted array that are less than
+ * or equal to key, which is the child to descend.
+ */
+enum search_kernel {
+	SEARCH_LINEAR,
+	SEARCH_BINARY,
+	SEARCH_BRANCHLESS,
+	SEARCH_SIMD,
+	SEARCH_AVX2,
+	SEARCH_AVX512,
+	SEARCH_MAX,
+};
+
+/*
+ * Instruction set levels for the kernels, detected
+ * once. YTREE_CPU in the environment can name a
+ * lower level, for testing the fallbacks.
+ */
+enum cpu_level {
+	CPU_SCALAR,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_AVX512,
+	CPU_MAX,
+};
+
+typedef int (*search_fn)(const int *keys, int n, int key);
+
+/* Single database */
+typedef struct db {
 	int schema_id;							// Id in schema
 	short order;							// Tree order (B+Tree only)
+	short tree_order;						// Order set by the user
+	bool small;								// Held in a single wide leaf
+	int keys;								// Distinct keys in the tree
+	char flags;								// Bitmap defining tree options
 	int _root;								// Offset to root
 	env_t *env;								// Pointer to current environment
 	node_t *root;							// Pointer to root node
+	node_t *purge_list;						// Detached nodes awaiting reclaim
+	unsigned int generation;				// Bumped on every restructure
+	struct db *index;						// Secondary index on values
+	hook_extract extract;					// Value extractor for the index
+	ytree_stats_t stats;					// Operation counters
+	search_fn search;						// Node search kernel for the order
+	ytree_histogram_t *latency;				// Histograms per operation or NULL
+	bool timing;							// Record latencies
+	struct front_cache *front;				// Hot key cache or NULL
+	struct radix_table *radix;				// Subtree roots by key or NULL
+	unsigned int capture_run;				// Capture the setup was recorded in
 	struct {
 		hook_release object_release;		// Called on record release
+		hook_release_batch object_release_batch;	// Called on batched record release
 		hook_serialize object_serialize;	// Called on record serialization
 	} hooks;
 } db_t;
 
+/*
+ * Tree shape. Levels are counted from the
+ * root, fill is the share of keys in use per
+ * node in SHAPE_FILL_BUCKETS equal steps.
+ */
+#define SHAPE_MAX_LEVELS	32
+#define SHAPE_FILL_BUCKETS	10
+
+typedef struct {
+	int height;								// Edges from root to the leaves
+	int order;								// Tree order
+	uint64_t nodes;							// Total nodes
+	uint64_t keys;							// Keys in the leaves
+	struct {
+		uint64_t nodes;						// Nodes on the level
+		uint64_t keys;						// Keys on the level
+		uint64_t fill[SHAPE_FILL_BUCKETS];	// Nodes per fill factor
+	} levels[SHAPE_MAX_LEVELS];
+	uint64_t chain_leaves;					// Leaves reached by the leaf chain
+	bool chain_ordered;						// Keys ascend along the chain
+	uint64_t chain_gap_bytes;				// Mean distance between chained leaves in memory
+	uint64_t heap_near;						// Adjacent keys with records within a page
+	uint64_t heap_far;						// Adjacent keys with records further apart
+} ytree_shape_t;
+
+/*
+ * Lookup of a single key as described by
+ * ytree_explain, one level per node visited.
+ */
+#define EXPLAIN_MAX_LEVELS	SHAPE_MAX_LEVELS
+
+typedef struct {
+	const void *node;						// Address of the node
+	bool leaf;								// Node is a leaf
+	int num_keys;							// Keys in the node
+	int index;								// Child taken or slot of the key, -1 if none
+	int comparisons;						// Keys examined by the search
+	int cache_lines;						// Cache lines of the node touched
+	uint64_t ns;							// Time spent searching the node
+} ytree_explain_level_t;
+
+typedef struct {
+	int key;								// Key looked up
+	bool found;								// Key exists
+	const char *kernel;						// Node search kernel
+	const char *entry;						// Descent started at the "root" or a "radix" entry
+	int levels;								// Nodes visited
+	ytree_explain_level_t level[EXPLAIN_MAX_LEVELS];
+	uint32_t offset;						// Offset of the record
+	uint32_t record_bytes;					// Bytes of the record in the heap
+	const char *record_source;				// Record read from "file" or "memory"
+	uint64_t record_ns;						// Time spent reading the record
+	uint64_t total_ns;						// Time spent in all levels and the read
+} ytree_explain_t;
+
+/* Formats of the structure dump */
+enum dump_format {
+	DUMP_JSON,
+	DUMP_DOT,
+};
+
+/* Buffered write operations */
+typedef struct ytree_batch ytree_batch_t;
+
 /* Key value pair */
 typedef struct {
 	void *data;
@@ -180,23 +512,89 @@ void find_and_print_range(db_t **db, int range1, int range2, bool verbose);
 int ytree_height(db_t **db);
 int ytree_count(db_t **db);
 void ytree_purge(db_t **db);
+void ytree_purge_detach(db_t **db);
+bool ytree_purge_step(db_t **db, int budget);
+void ytree_purge_background(db_t **db);
 void ytree_order(db_t **db, unsigned int order);
 const char *ytree_version();
+void ytree_stats(db_t **db, ytree_stats_t *stats);
+void ytree_stats_reset(db_t **db);
+void ytree_front_cache(db_t **db, unsigned int entries);
+void ytree_radix_table(db_t **db, unsigned int entries);
+
+/* Search kernels */
+search_fn ytree_search_kernel(enum search_kernel kernel);
+const char *ytree_search_name(enum search_kernel kernel);
+enum search_kernel ytree_search_select(int order);
+enum cpu_level ytree_cpu_level();
+enum cpu_level ytree_cpu_set(enum cpu_level level);
+const char *ytree_cpu_name(enum cpu_level level);
+
+/* Analysis */
+void ytree_shape(db_t **db, ytree_shape_t *shape);
+void ytree_dump(db_t **db, FILE *fp, enum dump_format format);
+bool ytree_explain(db_t **db, int key, ytree_explain_t *out);
+
+/* Tracing */
+void ytree_trace(env_t **env, hook_trace fn, void *ctx);
+
+/* Operation capture */
+bool ytree_capture_start(env_t **env, const char *path);
+bool ytree_capture_stop(env_t **env);
+
+/* Latency histograms */
+void ytree_latency_enable(db_t **db, bool enable);
+void ytree_latency(db_t **db, enum latency_op op, ytree_histogram_t *hist);
+void ytree_latency_reset(db_t **db);
+uint64_t ytree_histogram_percentile(ytree_histogram_t *hist, double percentile);
+void ytree_histogram_merge(ytree_histogram_t *dst, ytree_histogram_t *src);
 
 void ytree_insert(db_t **db, int key, record_t *pointer);
 record_t *ytree_find(db_t **db, int key);
+int ytree_range(db_t **db, int key_start, int key_end, hook_visit fn, void *ctx);
 void ytree_delete(db_t **db, int key);
 
+/* Duplicate keys */
+int ytree_find_all(db_t **db, int key, hook_visit fn, void *ctx);
+bool ytree_delete_value(db_t **db, int key, record_t *value);
+
+/* Read-modify-write */
+bool ytree_incr(db_t **db, int key, double delta);
+bool ytree_cas(db_t **db, int key, record_t *expected, record_t *record);
+bool ytree_update(db_t **db, int key, hook_update fn, void *ctx);
+
+/* Write batch */
+void ytree_batch_init(ytree_batch_t **batch, env_t **env);
+void ytree_batch_insert(ytree_batch_t **batch, int key, record_t *record);
+void ytree_batch_delete(ytree_batch_t **batch, int key);
+bool ytree_batch_commit(db_t **db, ytree_batch_t **batch);
+void ytree_batch_close(ytree_batch_t **batch);
+
+/* Secondary index */
+void ytree_index_init(short index, db_t **db, hook_extract extract);
+int ytree_index_range(db_t **db, int value_start, int value_end, hook_visit fn, void *ctx);
+
 /* Tree operations */
 void ytree_env_init(const char *dbname, env_t **tree, uint8_t flags);
 void ytree_env_close(env_t **tree);
 void ytree_db_init(short index, db_t **db, env_t **env);
 void ytree_db_close(db_t **db);
+bool ytree_set_allocator(env_t **env, hook_alloc alloc, hook_free release, void *ctx);
+bool ytree_set_allocator_hints(env_t **env, hook_free_sized release_sized, hook_alloc_aligned alloc_aligned);
 
-/* Record */
+/*
+ * Record. make_record and the helper macros
+ * allocate with calloc, the caller releases the
+ * record with free. Records from ytree_make_record
+ * and those returned by the databases come from
+ * the allocator of the environment, and are
+ * released with ytree_free_record.
+ */
 record_t *make_record(enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize);
+record_t *ytree_make_record(env_t **env, enum datatype type, char c_value, int i_value, float f_value, void *p_value, size_t vsize);
 record_t *ytree_new_record(valuepair_t *pair);
 int ytree_record_size(record_t *record);
+void ytree_free_record(env_t **env, record_t *record);
 
 /* Helper macros */
 #define ytree_new_char(c) make_record(DT_CHAR, c, 0, 0, NULL, 0)
@@ -206,4 +604,8 @@ int ytree_record_size(record_t *record);
 
 #define ytree_db_empty(d) ((*d)->root == NULL)
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // _YTREE_H_